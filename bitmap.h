@@ -0,0 +1,185 @@
+#ifndef TERMKCD_BITMAP_H
+#define TERMKCD_BITMAP_H
+
+// Allocator for image-sized buffers: decoded comics, the viewer's backbuffer and its copy of the
+// screen. Every buffer starts on a cache line (which is also wider than any SIMD register used
+// on them). Big ones are mapped separately, on 2MB boundaries and with transparent huge pages
+// asked for, so walking a 30MB bitmap touches a few dozen TLB entries instead of thousands of
+// them. Freed mappings are pooled, so the next big buffer (e.g. the backbuffer allocated after a
+// comic is run-length encoded, or the next comic in the daemon) reuses pages which are already
+// faulted in. A pooled mapping bigger than needed is cut down to size, so e.g. a comic's freed
+// bitmap becomes the viewer's backbuffer instead of staying resident beside it. Pooled pages still
+// count as used memory, so the pool is turned off under a memory limit (see bitmap_pool_limit).
+// Rows are still packed (w * 3 bytes apart): every consumer indexes them that way, and the
+// framebuffer's own line length is fixed by the device.
+
+// Includes for mappings and the pool's lock
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define BITMAP_ALIGN 64                 // Alignment of every buffer
+#define BITMAP_HUGE_PAGE (2 << 20)      // Transparent huge page size (x86 and arm64 with 4K pages)
+#define BITMAP_MAP_MIN (1 << 20)        // Buffers this big are mapped instead of malloc'd
+#define BITMAP_POOL_N 4                 // Freed mappings kept for reuse
+#define BITMAP_POOL_BUDGET (256 << 20)  // Most bytes kept in the pool, unless limited
+
+// Sits in the BITMAP_ALIGN bytes before every buffer
+struct bitmap_header {
+    size_t mapped;                      // Length of the mapping it starts, 0 if malloc'd
+};
+
+struct bitmap_mapping {
+    unsigned char* base;
+    size_t len;
+};
+
+struct bitmap_pool {
+    pthread_mutex_t lock;               // Decoder and thumbnail threads allocate too
+    struct bitmap_mapping free[BITMAP_POOL_N];
+    size_t bytes;
+    size_t budget;                      // Most bytes kept
+} bitmap_pool = {PTHREAD_MUTEX_INITIALIZER, {{NULL, 0}}, 0, BITMAP_POOL_BUDGET};
+
+// Maps len bytes (a multiple of BITMAP_HUGE_PAGE) on a BITMAP_HUGE_PAGE boundary, as transparent
+// huge pages can only back aligned ranges. Returns NULL on failure
+unsigned char* bitmap_map(size_t len) {
+    size_t over = len + BITMAP_HUGE_PAGE;
+    unsigned char* mem = mmap(NULL, over, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mem == MAP_FAILED)
+        return NULL;
+    // Trim the unaligned head and the tail
+    size_t head = (BITMAP_HUGE_PAGE - ((uintptr_t)mem % BITMAP_HUGE_PAGE)) % BITMAP_HUGE_PAGE;
+    if(head > 0)
+        munmap(mem, head);
+    munmap(mem + head + len, over - head - len);
+    mem += head;
+#ifdef MADV_HUGEPAGE
+    madvise(mem, len, MADV_HUGEPAGE);
+#endif
+    return mem;
+}
+
+// Takes the smallest pooled mapping of at least len bytes (a multiple of BITMAP_HUGE_PAGE),
+// unmapping the rest of it. Returns NULL if there's none
+unsigned char* bitmap_pool_take(size_t len) {
+    pthread_mutex_lock(&bitmap_pool.lock);
+    struct bitmap_mapping* best = NULL;
+    for(size_t n = 0; n < BITMAP_POOL_N; ++n) {
+        struct bitmap_mapping* m = &bitmap_pool.free[n];
+        if(m->base != NULL && m->len >= len && (best == NULL || m->len < best->len))
+            best = m;
+    }
+    struct bitmap_mapping taken = {NULL, 0};
+    if(best != NULL) {
+        taken = *best;
+        bitmap_pool.bytes -= best->len;
+        (*best) = (struct bitmap_mapping){NULL, 0};
+    }
+    pthread_mutex_unlock(&bitmap_pool.lock);
+    // The tail ends on a huge page boundary too, so the start stays aligned
+    if(taken.len > len)
+        munmap(taken.base + len, taken.len - len);
+    return taken.base;
+}
+
+// Limits the pool for a memory limit (0 for none). Pooled pages stay resident, so with a limit
+// there's no pool: freed buffers are given back straight away and the limit holds
+void bitmap_pool_limit(size_t max_mem) {
+    struct bitmap_mapping dropped[BITMAP_POOL_N];
+    size_t n_dropped = 0;
+    pthread_mutex_lock(&bitmap_pool.lock);
+    bitmap_pool.budget = (max_mem == 0) ? BITMAP_POOL_BUDGET : 0;
+    for(size_t n = 0; n < BITMAP_POOL_N && bitmap_pool.bytes > bitmap_pool.budget; ++n) {
+        struct bitmap_mapping* m = &bitmap_pool.free[n];
+        if(m->base == NULL)
+            continue;
+        dropped[n_dropped++] = *m;
+        bitmap_pool.bytes -= m->len;
+        (*m) = (struct bitmap_mapping){NULL, 0};
+    }
+    pthread_mutex_unlock(&bitmap_pool.lock);
+    for(size_t n = 0; n < n_dropped; ++n)
+        munmap(dropped[n].base, dropped[n].len);
+}
+
+// Keeps a mapping for reuse, unmapping it if the pool is full
+void bitmap_pool_put(unsigned char* base, size_t len) {
+    pthread_mutex_lock(&bitmap_pool.lock);
+    struct bitmap_mapping* slot = NULL;
+    if(bitmap_pool.bytes + len <= bitmap_pool.budget) {
+        for(size_t n = 0; n < BITMAP_POOL_N && slot == NULL; ++n) {
+            if(bitmap_pool.free[n].base == NULL)
+                slot = &bitmap_pool.free[n];
+        }
+    }
+    if(slot != NULL) {
+        (*slot) = (struct bitmap_mapping){base, len};
+        bitmap_pool.bytes += len;
+    }
+    pthread_mutex_unlock(&bitmap_pool.lock);
+    if(slot == NULL)
+        munmap(base, len);
+}
+
+// Allocates len bytes, setting fresh to whether they're known to be zero (new mappings are).
+// Returns NULL if out of memory
+unsigned char* bitmap_alloc_fresh(size_t len, int* fresh) {
+    (*fresh) = 0;
+    unsigned char* base;
+    size_t mapped = 0;
+    if(len + BITMAP_ALIGN >= BITMAP_MAP_MIN) {
+        mapped = (len + BITMAP_ALIGN + BITMAP_HUGE_PAGE - 1) / BITMAP_HUGE_PAGE * BITMAP_HUGE_PAGE;
+        base = bitmap_pool_take(mapped);
+        if(base == NULL) {
+            base = bitmap_map(mapped);
+            (*fresh) = 1;
+        }
+    }
+    else if(posix_memalign((void**)&base, BITMAP_ALIGN, len + BITMAP_ALIGN) != 0)
+        base = NULL;
+    if(base == NULL) {
+        fprintf(stderr, "malloc@bitmap_alloc: Out of memory!\n");
+        return NULL;
+    }
+    ((struct bitmap_header*)base)->mapped = mapped;
+    return base + BITMAP_ALIGN;
+}
+
+unsigned char* bitmap_alloc(size_t len) {
+    int fresh;
+    return bitmap_alloc_fresh(len, &fresh);
+}
+
+// Like bitmap_alloc, but zeroed. Only pooled and malloc'd memory needs clearing
+unsigned char* bitmap_calloc(size_t len) {
+    int fresh;
+    unsigned char* mem = bitmap_alloc_fresh(len, &fresh);
+    if(mem != NULL && !fresh)
+        memset(mem, 0, len);
+    return mem;
+}
+
+void bitmap_free(void* ptr) {
+    if(ptr == NULL)
+        return;
+    unsigned char* base = (unsigned char*)ptr - BITMAP_ALIGN;
+    size_t mapped = ((struct bitmap_header*)base)->mapped;
+    if(mapped > 0)
+        bitmap_pool_put(base, mapped);
+    else
+        free(base);
+}
+
+// For load_png_with and load_jpeg_with
+void* bitmap_allocator_alloc(size_t size, void* user) {
+    return bitmap_alloc(size);
+}
+
+void bitmap_allocator_free(void* ptr, void* user) {
+    bitmap_free(ptr);
+}
+
+static const struct allocator bitmap_allocator = {bitmap_allocator_alloc, bitmap_allocator_free, NULL};
+
+#endif
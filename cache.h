@@ -0,0 +1,331 @@
+#ifndef TERMKCD_CACHE_H
+#define TERMKCD_CACHE_H
+
+// On-disk cache of decoded comic images, for viewing from a local mirror without paying for PNG
+// decoding (inflating and unfiltering) every time. Bitmaps are stored in a QOI-style lossless
+// encoding: a few times bigger than the PNG, a few times smaller than the raw bitmap, and a byte
+// oriented format which decodes with a handful of branches per pixel. Images are split into
+// bands of rows which are encoded independently, so bands are decoded in parallel, straight into
+// the bitmap the viewer uses.
+//
+// File layout (native endianness, as the cache is local):
+// - A cache_header
+// - n_chunks uint64 offsets, each one being where a band's data ends (relative to the first band)
+// - The bands' data. Each starts from a black previous pixel and an empty index
+
+// Includes for reading cache files
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "pool.h"
+
+#define CACHE_MAGIC 0x31514B54  // "TKQ1"
+#define CACHE_CHUNK_ROWS 64
+#define CACHE_PATH_LEN 4096
+
+// Ops. QOI's, without alpha
+#define CACHE_OP_INDEX 0x00     // 00iiiiii: pixel from the index of recent pixels
+#define CACHE_OP_DIFF 0x40      // 01bbggrr: small difference to the previous pixel, biased by 2
+#define CACHE_OP_LUMA 0x80      // 10gggggg, rrrrbbbb: green difference biased by 32, then red and
+                                // blue differences relative to it, biased by 8
+#define CACHE_OP_RUN 0xC0       // 11nnnnnn: previous pixel repeated n + 1 times (up to 62)
+#define CACHE_OP_BGR 0xFE       // Followed by the pixel
+
+struct cache_header {
+    uint32_t magic;
+    uint32_t chunk_rows;
+    uint64_t w;
+    uint64_t h;
+    uint64_t n_chunks;
+};
+
+// One band, encoded or decoded by a worker
+struct cache_chunk {
+    unsigned char* px;          // The band's first pixel
+    size_t n;                   // Pixels in the band
+    unsigned char* data;        // Encoded band
+    size_t len;                 // Encoded length (or room for it, when encoding)
+    char ok;
+};
+
+#define CACHE_HASH(p) (((p)[0] * 7 + (p)[1] * 5 + (p)[2] * 3) & 63)
+
+// Encodes n BGR pixels into out, which must have room for 4 bytes per pixel. Returns the length
+size_t cache_encode_chunk(const unsigned char* px, size_t n, unsigned char* out) {
+    unsigned char index[64 * 3] = {0};
+    unsigned char prev[3] = {0, 0, 0};
+    size_t o = 0;
+    unsigned int run = 0;
+    for(size_t i = 0; i < n; ++i, px += 3) {
+        if(px[0] == prev[0] && px[1] == prev[1] && px[2] == prev[2]) {
+            if(++run == 62 || i == n - 1) {
+                out[o++] = CACHE_OP_RUN | (run - 1);
+                run = 0;
+            }
+            continue;
+        }
+        if(run > 0) {
+            out[o++] = CACHE_OP_RUN | (run - 1);
+            run = 0;
+        }
+
+        unsigned int hash = CACHE_HASH(px);
+        unsigned char* slot = index + (hash * 3);
+        if(slot[0] == px[0] && slot[1] == px[1] && slot[2] == px[2])
+            out[o++] = CACHE_OP_INDEX | hash;
+        else {
+            memcpy(slot, px, 3);
+            int db = (signed char)(px[0] - prev[0]);
+            int dg = (signed char)(px[1] - prev[1]);
+            int dr = (signed char)(px[2] - prev[2]);
+            int db_dg = db - dg;
+            int dr_dg = dr - dg;
+            if(db >= -2 && db <= 1 && dg >= -2 && dg <= 1 && dr >= -2 && dr <= 1)
+                out[o++] = CACHE_OP_DIFF | ((db + 2) << 4) | ((dg + 2) << 2) | (dr + 2);
+            else if(dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7 && dr_dg >= -8 && dr_dg <= 7) {
+                out[o++] = CACHE_OP_LUMA | (dg + 32);
+                out[o++] = ((dr_dg + 8) << 4) | (db_dg + 8);
+            }
+            else {
+                out[o++] = CACHE_OP_BGR;
+                memcpy(out + o, px, 3);
+                o += 3;
+            }
+        }
+        memcpy(prev, px, 3);
+    }
+    return o;
+}
+
+// Decodes len bytes into exactly n BGR pixels. Returns 0 if the data is corrupted
+int cache_decode_chunk(const unsigned char* in, size_t len, unsigned char* px, size_t n) {
+    unsigned char index[64 * 3] = {0};
+    unsigned char b = 0, g = 0, r = 0;
+    const unsigned char* end = in + len;
+    unsigned char* px_end = px + (n * 3);
+    while(px < px_end) {
+        if(in >= end)
+            return 0;
+        unsigned char op = *(in++);
+        if(op == CACHE_OP_BGR) {
+            if(end - in < 3)
+                return 0;
+            b = in[0];
+            g = in[1];
+            r = in[2];
+            in += 3;
+        }
+        else if((op & 0xC0) == CACHE_OP_INDEX) {
+            const unsigned char* slot = index + (op * 3);
+            b = slot[0];
+            g = slot[1];
+            r = slot[2];
+        }
+        else if((op & 0xC0) == CACHE_OP_DIFF) {
+            b += ((op >> 4) & 3) - 2;
+            g += ((op >> 2) & 3) - 2;
+            r += (op & 3) - 2;
+        }
+        else if((op & 0xC0) == CACHE_OP_LUMA) {
+            if(in >= end)
+                return 0;
+            int dg = (op & 0x3F) - 32;
+            b += dg + (in[0] & 0x0F) - 8;
+            g += dg;
+            r += dg + (in[0] >> 4) - 8;
+            ++in;
+        }
+        else { // Run
+            size_t run = (op & 0x3F) + 1;
+            if((size_t)(px_end - px) < run * 3)
+                return 0;
+            for(; run > 0; --run, px += 3) {
+                px[0] = b;
+                px[1] = g;
+                px[2] = r;
+            }
+            continue;
+        }
+
+        px[0] = b;
+        px[1] = g;
+        px[2] = r;
+        memcpy(index + (CACHE_HASH(px) * 3), px, 3);
+        px += 3;
+    }
+    return in == end;
+}
+
+void cache_encode_worker(void* arg) {
+    struct cache_chunk* chunk = arg;
+    chunk->len = cache_encode_chunk(chunk->px, chunk->n, chunk->data);
+    chunk->ok = 1;
+}
+
+void cache_decode_worker(void* arg) {
+    struct cache_chunk* chunk = arg;
+    chunk->ok = cache_decode_chunk(chunk->data, chunk->len, chunk->px, chunk->n);
+}
+
+// Runs fn on every chunk, spread over a thread pool if there's more than one
+void cache_run_chunks(struct cache_chunk* chunks, size_t n_chunks, void (*fn)(void*)) {
+    struct thread_pool pool;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n_threads = (cpus > 1) ? (size_t)cpus : 1;
+    if(n_threads > n_chunks)
+        n_threads = n_chunks;
+    size_t c = 0;
+    if(n_threads > 1 && thread_pool_init(&pool, n_threads)) {
+        while(c < n_chunks && thread_pool_submit(&pool, fn, &chunks[c]))
+            ++c;
+        thread_pool_destroy(&pool);
+    }
+    // Whatever couldn't be handed to the pool is done here
+    for(; c < n_chunks; ++c)
+        fn(&chunks[c]);
+}
+
+// Gets the path of a comic's cache file
+void cache_path(char* path, const char* dir, unsigned long comic) {
+    snprintf(path, CACHE_PATH_LEN, "%s/%lu.tkq", dir, comic);
+}
+
+// Checks whether a comic is cached
+int cache_has(const char* dir, unsigned long comic) {
+    char path[CACHE_PATH_LEN];
+    cache_path(path, dir, comic);
+    return access(path, R_OK) == 0;
+}
+
+// Loads a comic's BGR bitmap from the cache. Returns 0 if it isn't cached (or the file is unusable)
+int cache_load(const char* dir, unsigned long comic, unsigned char** bitmap, size_t* w, size_t* h, int debug) {
+    char path[CACHE_PATH_LEN];
+    cache_path(path, dir, comic);
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        if(debug)
+            fprintf(stderr, "@cache_load: Comic %lu isn't cached\n", comic);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(struct cache_header)) {
+        close(fd);
+        fprintf(stderr, "@cache_load: Cache file %s is truncated!\n", path);
+        return 0;
+    }
+    unsigned char* file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(file == MAP_FAILED) {
+        fprintf(stderr, "mmap@cache_load: Could not map %s!\n", path);
+        return 0;
+    }
+
+    // Validate the header and band offsets before trusting them
+    size_t size = st.st_size;
+    struct cache_header header;
+    memcpy(&header, file, sizeof(struct cache_header));
+    size_t table_end = sizeof(struct cache_header) + header.n_chunks * sizeof(uint64_t);
+    int valid = header.magic == CACHE_MAGIC && header.chunk_rows > 0 && header.w > 0 && header.h > 0
+                && header.w <= SIZE_MAX / 3 / header.h
+                && header.n_chunks == (header.h + header.chunk_rows - 1) / header.chunk_rows
+                && header.n_chunks <= size / sizeof(uint64_t) && table_end <= size;
+    struct cache_chunk* chunks = NULL;
+    unsigned char* out = NULL;
+    if(valid) {
+        chunks = malloc(header.n_chunks * sizeof(struct cache_chunk));
+        out = bitmap_alloc(header.w * header.h * 3);
+        if(chunks == NULL || out == NULL) {
+            fprintf(stderr, "malloc@cache_load: Out of memory!\n");
+            free(chunks);
+            bitmap_free(out);
+            munmap(file, size);
+            return 0;
+        }
+        uint64_t start = 0;
+        for(size_t c = 0; valid && c < header.n_chunks; ++c) {
+            uint64_t chunk_end;
+            memcpy(&chunk_end, file + sizeof(struct cache_header) + c * sizeof(uint64_t), sizeof(uint64_t));
+            valid = chunk_end >= start && chunk_end <= size - table_end;
+            size_t row = c * header.chunk_rows;
+            size_t rows = (header.h - row < header.chunk_rows) ? header.h - row : header.chunk_rows;
+            chunks[c] = (struct cache_chunk){out + (row * header.w * 3), rows * header.w, file + table_end + start, chunk_end - start, 0};
+            start = chunk_end;
+        }
+    }
+    if(valid) {
+        cache_run_chunks(chunks, header.n_chunks, cache_decode_worker);
+        for(size_t c = 0; c < header.n_chunks; ++c)
+            valid = valid && chunks[c].ok;
+    }
+    free(chunks);
+    munmap(file, size);
+    if(!valid) {
+        bitmap_free(out);
+        fprintf(stderr, "@cache_load: Cache file %s is corrupted!\n", path);
+        return 0;
+    }
+
+    (*bitmap) = out;
+    (*w) = header.w;
+    (*h) = header.h;
+    return 1;
+}
+
+// Stores a comic's BGR bitmap in the cache, creating the directory if needed. The file is written
+// under a temporary name first, so readers never see half of it. Returns 0 on failure
+int cache_store(const char* dir, unsigned long comic, const unsigned char* bitmap, size_t w, size_t h, int debug) {
+    if(mkdir(dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir@cache_store: Could not create directory %s!\n", dir);
+        return 0;
+    }
+
+    struct cache_header header = {CACHE_MAGIC, CACHE_CHUNK_ROWS, w, h, (h + CACHE_CHUNK_ROWS - 1) / CACHE_CHUNK_ROWS};
+    struct cache_chunk* chunks = malloc(header.n_chunks * sizeof(struct cache_chunk));
+    unsigned char* data = malloc(w * h * 4);
+    if(chunks == NULL || data == NULL) {
+        fprintf(stderr, "malloc@cache_store: Out of memory!\n");
+        free(chunks);
+        free(data);
+        return 0;
+    }
+    for(size_t c = 0; c < header.n_chunks; ++c) {
+        size_t row = c * CACHE_CHUNK_ROWS;
+        size_t rows = (h - row < CACHE_CHUNK_ROWS) ? h - row : CACHE_CHUNK_ROWS;
+        chunks[c] = (struct cache_chunk){(unsigned char*)bitmap + (row * w * 3), rows * w, data + (row * w * 4), 0, 0};
+    }
+    cache_run_chunks(chunks, header.n_chunks, cache_encode_worker);
+
+    char path[CACHE_PATH_LEN];
+    char tmp_path[CACHE_PATH_LEN + 16];
+    cache_path(path, dir, comic);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%li", path, (long)getpid());
+    FILE* file = fopen(tmp_path, "wb");
+    int ok = file != NULL && fwrite(&header, sizeof(struct cache_header), 1, file) == 1;
+    uint64_t chunk_end = 0;
+    for(size_t c = 0; ok && c < header.n_chunks; ++c) {
+        chunk_end += chunks[c].len;
+        ok = fwrite(&chunk_end, sizeof(uint64_t), 1, file) == 1;
+    }
+    for(size_t c = 0; ok && c < header.n_chunks; ++c)
+        ok = fwrite(chunks[c].data, 1, chunks[c].len, file) == chunks[c].len;
+    if(file != NULL && fclose(file) != 0)
+        ok = 0;
+    if(ok)
+        ok = rename(tmp_path, path) == 0;
+    if(!ok) {
+        fprintf(stderr, "fopen@cache_store: Could not write %s!\n", path);
+        if(file != NULL)
+            unlink(tmp_path);
+    }
+    else if(debug)
+        fprintf(stderr, "@cache_store: Cached comic %lu (%zu bytes, %zu raw)\n", comic, (size_t)(sizeof(struct cache_header) + header.n_chunks * sizeof(uint64_t) + chunk_end), w * h * 3);
+    free(chunks);
+    free(data);
+    return ok;
+}
+
+#endif
@@ -0,0 +1,759 @@
+#ifndef TERMKCD_DAEMON_H
+#define TERMKCD_DAEMON_H
+
+// Resident daemon mode. A daemon started with --daemon keeps a warm download scheduler (open
+// connections, DNS and TLS session caches) and in-memory LRU caches of comic metadata and
+// decoded bitmaps. Regular invocations ask it for data through a unix socket, falling back to
+// fetching everything themselves when no daemon is running. Every client gets its own thread,
+// which only holds the daemon's lock (over the caches) while looking requests up in them. Downloads
+// run on a thread of their own, which owns the scheduler.
+//
+// Protocol (native endianness, as both ends are on the same machine):
+// - Client sends a daemon_request, followed by url_len bytes of image link for image requests
+// - Daemon replies with a daemon_response, followed by len bytes of data. For metadata this is
+//   the raw info.0.json. For images this is the BGR bitmap, or the compressed file if it's too
+//   big to be decoded in one go (w and h are 0 then)
+
+// Includes for sockets
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+// Request types
+#define DAEMON_REQ_JSON 1
+#define DAEMON_REQ_IMAGE 2
+
+// Cache sizes
+#define DAEMON_JSON_CACHE_N 256
+#define DAEMON_BITMAP_CACHE_N 32
+#define DAEMON_BITMAP_CACHE_BUDGET (256 * 1024 * 1024)
+// Seconds before the latest comic's metadata is fetched again
+#define DAEMON_LATEST_TTL 60
+// Largest reply a client accepts (bitmaps bigger than this are sent compressed anyway)
+#define DAEMON_MAX_REPLY ((uint64_t)1 << 30)
+// Seconds a client may stay idle or take to read a reply before it's dropped
+#define DAEMON_CLIENT_TIMEOUT 30
+
+struct daemon_request {
+    uint64_t type;
+    uint64_t comic;
+    uint64_t url_len;
+};
+
+struct daemon_response {
+    int32_t curl_err;
+    int64_t http_status;
+    uint64_t w;
+    uint64_t h;
+    uint64_t len;
+};
+
+struct daemon_cache_entry {
+    uint64_t comic;         // Comic number (metadata cache)
+    char* url;              // Image link (bitmap cache)
+    struct mem_block data;  // Raw JSON, BGR bitmap or compressed image
+    size_t w;               // Bitmap width, 0 if data is a compressed image
+    size_t h;               // Bitmap height, 0 if data is a compressed image
+    time_t fetched;
+    unsigned long last_used;
+    size_t pins;            // Replies being written from data, which keep it from being evicted
+    char pending;           // Being fetched, url (or comic) is set but data isn't yet
+};
+
+// Gets the daemon socket path. Uses $XDG_RUNTIME_DIR if set, otherwise a directory in /tmp which
+// only the user can access (created if needed), so nobody else can put a socket there first.
+// Returns 0 if that directory belongs to someone else or is open to them
+int daemon_socket_path(struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if(runtime_dir != NULL && runtime_dir[0] != '\0') {
+        snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/termkcd.sock", runtime_dir);
+        return 1;
+    }
+
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/tmp/termkcd-%u", (unsigned int)getuid());
+    struct stat st;
+    if((mkdir(dir, 0700) == -1 && errno != EEXIST) || lstat(dir, &st) == -1) {
+        fprintf(stderr, "mkdir@daemon_socket_path: Could not create %s!\n", dir);
+        return 0;
+    }
+    if(!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 077) != 0) {
+        fprintf(stderr, "@daemon_socket_path: %s isn't a directory private to this user!\n", dir);
+        return 0;
+    }
+    snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/termkcd.sock", dir);
+    return 1;
+}
+
+// Reads or writes exactly len bytes. Returns 0 on failure (including the other end hanging up)
+int daemon_read_all(int fd, void* buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = read(fd, (unsigned char*)buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+int daemon_write_all(int fd, const void* buf, size_t len) {
+    size_t done = 0;
+    while(done < len) {
+        ssize_t n = write(fd, (const unsigned char*)buf + done, len - done);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+// Connects to a running daemon. Returns the socket, or -1 if there's no daemon running (or it's
+// run by another user)
+int daemon_connect(void) {
+    struct sockaddr_un addr;
+    if(!daemon_socket_path(&addr))
+        return -1;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+        return -1;
+    if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    struct ucred cred;
+    socklen_t cred_len = sizeof(cred);
+    if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1 || cred.uid != getuid()) {
+        fprintf(stderr, "@daemon_connect: The daemon at %s is run by another user! Ignoring it\n", addr.sun_path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Sends a request and reads the response header. Returns 0 if the daemon went away
+int daemon_transact(int fd, struct daemon_request* req, const char* url, struct daemon_response* res, struct mem_block* data) {
+    if(!daemon_write_all(fd, req, sizeof(struct daemon_request)))
+        return 0;
+    if(req->url_len > 0 && !daemon_write_all(fd, url, req->url_len))
+        return 0;
+    if(!daemon_read_all(fd, res, sizeof(struct daemon_response)))
+        return 0;
+
+    // Replies are sized by the daemon, so they are checked before anything is allocated or read:
+    // bitmaps must be exactly w * h BGR pixels
+    if(res->len > DAEMON_MAX_REPLY || ((res->w > 0 || res->h > 0) && (res->w > DAEMON_MAX_REPLY || res->h > DAEMON_MAX_REPLY || res->w * res->h * 3 != res->len))) {
+        fprintf(stderr, "@daemon_transact: Malformed reply from the daemon!\n");
+        return 0;
+    }
+
+    (*data) = empty_mem;
+    if(res->len > 0) {
+        // Extra byte for null terminating JSON. Bitmaps come from the bitmap allocator, like
+        // decoded ones
+        int is_bitmap = res->w > 0 && res->h > 0;
+        data->ptr = is_bitmap ? (char*)bitmap_alloc(res->len + 1) : malloc(res->len + 1);
+        if(data->ptr == NULL) {
+            fprintf(stderr, "malloc@daemon_transact: Out of memory!\n");
+            return 0;
+        }
+        if(!daemon_read_all(fd, data->ptr, res->len)) {
+            if(is_bitmap)
+                bitmap_free(data->ptr);
+            else
+                free(data->ptr);
+            (*data) = empty_mem;
+            return 0;
+        }
+        data->ptr[res->len] = '\0';
+        data->i = res->len;
+    }
+    return 1;
+}
+
+// Asks the daemon for a comic's raw info.0.json. Returns 1 if the daemon replied (err and
+// http_status tell whether the download succeeded) or 0 if direct mode should be used instead
+int daemon_fetch_json(int fd, unsigned long comic, struct mem_block* json_raw, CURLcode* err, long* http_status) {
+    struct daemon_request req = {DAEMON_REQ_JSON, comic, 0};
+    struct daemon_response res;
+    if(!daemon_transact(fd, &req, NULL, &res, json_raw))
+        return 0;
+    (*err) = res.curl_err;
+    (*http_status) = res.http_status;
+    return 1;
+}
+
+// Asks the daemon for a comic's image. On success, either bitmap (w * h BGR pixels) is set or,
+// for images too big to be decoded in one go, file_buffer holds the compressed image
+int daemon_fetch_image(int fd, const char* url, unsigned char** bitmap, struct mem_block* file_buffer, size_t* w, size_t* h, CURLcode* err, long* http_status) {
+    struct daemon_request req = {DAEMON_REQ_IMAGE, 0, strlen(url)};
+    struct daemon_response res;
+    struct mem_block data;
+    if(!daemon_transact(fd, &req, url, &res, &data))
+        return 0;
+    (*err) = res.curl_err;
+    (*http_status) = res.http_status;
+    (*w) = res.w;
+    (*h) = res.h;
+    if(res.w > 0 && res.h > 0) {
+        (*bitmap) = (unsigned char*)data.ptr;
+        (*file_buffer) = empty_mem;
+    }
+    else {
+        (*bitmap) = NULL;
+        (*file_buffer) = data;
+    }
+    return 1;
+}
+
+// Download handed to the download thread, which owns the scheduler
+struct daemon_fetch {
+    const char* url;
+    struct dl_job* job;
+    struct mem_block data;
+    CURLcode err;
+    long http_status;
+    char done;
+    struct daemon_fetch* next;
+};
+
+struct daemon_state {
+    pthread_mutex_t lock;   // Over the caches and the fetch queue, never held while doing I/O
+    pthread_cond_t idle;    // Signaled when the last client leaves
+    pthread_cond_t fetched; // Broadcast when a fetch or a pending cache entry is done
+    pthread_cond_t work;    // Signaled when fetches are queued (or the daemon stops)
+    size_t n_clients;
+    struct daemon_fetch* fetch_queue; // Not yet submitted to the scheduler
+    pthread_t fetch_thread;
+    char stopping;
+    struct dl_scheduler sched;
+    CURLSH* share;
+    struct daemon_cache_entry json_cache[DAEMON_JSON_CACHE_N];
+    struct daemon_cache_entry bitmap_cache[DAEMON_BITMAP_CACHE_N];
+    size_t bitmap_cache_bytes;
+    unsigned long clock;
+};
+
+// What a reply's data is written from, once the lock is released: a bitmap cache entry, pinned
+// until the reply is written, or data owned by the reply (a copy of cached JSON, or an image which
+// didn't fit in the cache)
+struct daemon_reply {
+    struct daemon_cache_entry* pinned;
+    struct mem_block data;
+    char is_bitmap;         // data comes from the bitmap allocator
+};
+
+void daemon_cache_drop(struct daemon_cache_entry* entry) {
+    if(entry->w > 0 && entry->h > 0)
+        bitmap_free(entry->data.ptr);
+    else
+        free(entry->data.ptr);
+    free(entry->url);
+    memset(entry, 0, sizeof(struct daemon_cache_entry));
+}
+
+// Whether an entry may be dropped: not being fetched or written to a client
+int daemon_cache_evictable(struct daemon_cache_entry* entry) {
+    return !entry->pending && entry->pins == 0;
+}
+
+// Gets the least recently used (or an empty) slot of a cache, NULL if they're all in use
+struct daemon_cache_entry* daemon_cache_victim(struct daemon_cache_entry* cache, size_t n) {
+    struct daemon_cache_entry* victim = NULL;
+    for(size_t i = 0; i < n; ++i) {
+        if(!daemon_cache_evictable(&cache[i]))
+            continue;
+        if(cache[i].data.ptr == NULL)
+            return &cache[i];
+        if(victim == NULL || cache[i].last_used < victim->last_used)
+            victim = &cache[i];
+    }
+    return victim;
+}
+
+// Gets the least recently used occupied slot of a cache which isn't in use, NULL if there's none
+struct daemon_cache_entry* daemon_cache_lru(struct daemon_cache_entry* cache, size_t n) {
+    struct daemon_cache_entry* lru = NULL;
+    for(size_t i = 0; i < n; ++i) {
+        if(cache[i].data.ptr != NULL && daemon_cache_evictable(&cache[i]) && (lru == NULL || cache[i].last_used < lru->last_used))
+            lru = &cache[i];
+    }
+    return lru;
+}
+
+// Runs the scheduler for the client threads, so their downloads share its connections and caches
+// without any of them holding the lock while transferring
+void* daemon_fetch_thread(void* arg) {
+    struct daemon_state* state = arg;
+    struct daemon_fetch* running = NULL;
+    pthread_mutex_lock(&state->lock);
+    while(1) {
+        // Submit new fetches, in the order they were queued
+        while(state->fetch_queue != NULL) {
+            struct daemon_fetch* fetch = state->fetch_queue;
+            state->fetch_queue = fetch->next;
+            fetch->job = dl_submit(&state->sched, fetch->url, DL_PRIORITY_VISIBLE);
+            if(fetch->job == NULL) {
+                fetch->err = CURLE_OUT_OF_MEMORY;
+                fetch->done = 1;
+                pthread_cond_broadcast(&state->fetched);
+                continue;
+            }
+            fetch->next = running;
+            running = fetch;
+        }
+        if(running == NULL) {
+            if(state->stopping)
+                break;
+            pthread_cond_wait(&state->work, &state->lock);
+            continue;
+        }
+
+        // Only this thread touches the scheduler, so it runs unlocked. Clients queueing fetches
+        // wake it up from curl_multi_poll
+        pthread_mutex_unlock(&state->lock);
+        dl_step(&state->sched, NULL, 0, 1000);
+        pthread_mutex_lock(&state->lock);
+
+        // Hand finished downloads over
+        for(struct daemon_fetch** link = &running; *link != NULL;) {
+            struct daemon_fetch* fetch = *link;
+            if(fetch->job->state == DL_STATE_DONE || fetch->job->state == DL_STATE_FAILED) {
+                (*link) = fetch->next;
+                fetch->err = dl_wait(&state->sched, fetch->job, &fetch->data, &fetch->http_status);
+                fetch->done = 1;
+                pthread_cond_broadcast(&state->fetched);
+            }
+            else
+                link = &fetch->next;
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Downloads url through the download thread. Called with the lock held, which is released while
+// waiting
+CURLcode daemon_fetch_url(struct daemon_state* state, const char* url, struct mem_block* out, long* http_status) {
+    struct daemon_fetch fetch = {url, NULL, empty_mem, CURLE_OK, 0, 0, NULL};
+    struct daemon_fetch** tail = &state->fetch_queue;
+    while(*tail != NULL)
+        tail = &(*tail)->next;
+    (*tail) = &fetch;
+    pthread_cond_signal(&state->work);
+    curl_multi_wakeup(state->sched.multi);
+    while(!fetch.done)
+        pthread_cond_wait(&state->fetched, &state->lock);
+    (*out) = fetch.data;
+    (*http_status) = fetch.http_status;
+    return fetch.err;
+}
+
+// Makes the reply own a copy of data. Returns 0 if out of memory
+int daemon_reply_copy(struct daemon_reply* reply, const struct mem_block* data) {
+    reply->data.ptr = malloc(data->i);
+    if(reply->data.ptr == NULL) {
+        fprintf(stderr, "malloc@daemon_reply_copy: Out of memory!\n");
+        return 0;
+    }
+    memcpy(reply->data.ptr, data->ptr, data->i);
+    reply->data.i = data->i;
+    return 1;
+}
+
+// Frees a written reply's data, or unpins its cache entry
+void daemon_reply_free(struct daemon_state* state, struct daemon_reply* reply) {
+    if(reply->pinned != NULL) {
+        pthread_mutex_lock(&state->lock);
+        --reply->pinned->pins;
+        pthread_mutex_unlock(&state->lock);
+    }
+    else if(reply->is_bitmap)
+        bitmap_free(reply->data.ptr);
+    else
+        free(reply->data.ptr);
+}
+
+// Request handlers are called with the lock held, and release it while downloading and decoding.
+// A cache entry being fetched is marked pending, so clients asking for the same data at the same
+// time wait for it instead of downloading it again
+void daemon_handle_json(struct daemon_state* state, struct daemon_request* req, struct daemon_response* res, struct daemon_reply* reply) {
+    time_t now = time(NULL);
+    for(size_t i = 0; i < DAEMON_JSON_CACHE_N; ++i) {
+        struct daemon_cache_entry* entry = &state->json_cache[i];
+        if((entry->data.ptr != NULL || entry->pending) && entry->comic == req->comic) {
+            if(entry->pending) { // Look again once it's done
+                pthread_cond_wait(&state->fetched, &state->lock);
+                i = -1;
+                continue;
+            }
+            // The latest comic changes, so it expires
+            if(req->comic == 0 && now - entry->fetched > DAEMON_LATEST_TTL) {
+                daemon_cache_drop(entry);
+                break;
+            }
+            entry->last_used = ++state->clock;
+            // Metadata is small, so it's copied instead of pinned
+            if(!daemon_reply_copy(reply, &entry->data)) {
+                res->curl_err = CURLE_OUT_OF_MEMORY;
+                return;
+            }
+            res->http_status = 200;
+            res->len = reply->data.i;
+            return;
+        }
+    }
+
+    struct daemon_cache_entry* entry = daemon_cache_victim(state->json_cache, DAEMON_JSON_CACHE_N);
+    if(entry != NULL) {
+        daemon_cache_drop(entry);
+        entry->comic = req->comic;
+        entry->pending = 1;
+    }
+    char url[COMIC_JSON_URL_LEN];
+    comic_json_url(url, req->comic);
+    struct mem_block json_raw = empty_mem;
+    long http_status;
+    res->curl_err = daemon_fetch_url(state, url, &json_raw, &http_status);
+    res->http_status = http_status;
+    if(entry != NULL) {
+        entry->pending = 0;
+        pthread_cond_broadcast(&state->fetched);
+    }
+    if(res->curl_err != CURLE_OK || http_status != 200) {
+        free(json_raw.ptr);
+        return;
+    }
+
+    if(entry != NULL) {
+        if(!daemon_reply_copy(reply, &json_raw)) {
+            free(json_raw.ptr);
+            res->curl_err = CURLE_OUT_OF_MEMORY;
+            return;
+        }
+        entry->data = json_raw;
+        entry->fetched = now;
+        entry->last_used = ++state->clock;
+    }
+    else // Every slot is being fetched, so it isn't cached
+        reply->data = json_raw;
+    res->len = reply->data.i;
+}
+
+void daemon_handle_image(struct daemon_state* state, const char* url, struct daemon_response* res, struct daemon_reply* reply) {
+    for(size_t i = 0; i < DAEMON_BITMAP_CACHE_N; ++i) {
+        struct daemon_cache_entry* entry = &state->bitmap_cache[i];
+        if(entry->url != NULL && strcmp(entry->url, url) == 0) {
+            if(entry->pending) { // Look again once it's done
+                pthread_cond_wait(&state->fetched, &state->lock);
+                i = -1;
+                continue;
+            }
+            entry->last_used = ++state->clock;
+            ++entry->pins;
+            res->http_status = 200;
+            res->w = entry->w;
+            res->h = entry->h;
+            res->len = entry->data.i;
+            reply->pinned = entry;
+            return;
+        }
+    }
+
+    struct mem_block url_mem = {(char*)url, strlen(url)};
+    enum file_ext extension = get_extension(&url_mem);
+    if(extension == FILE_EXT_UNKNOWN) {
+        res->curl_err = CURLE_UNSUPPORTED_PROTOCOL;
+        return;
+    }
+
+    // Reserve a slot while fetching
+    struct daemon_cache_entry* entry = daemon_cache_victim(state->bitmap_cache, DAEMON_BITMAP_CACHE_N);
+    if(entry != NULL) {
+        state->bitmap_cache_bytes -= entry->data.i;
+        daemon_cache_drop(entry);
+        entry->url = strdup(url);
+        if(entry->url == NULL) {
+            fprintf(stderr, "strdup@daemon_handle_image: Out of memory!\n");
+            res->curl_err = CURLE_OUT_OF_MEMORY;
+            return;
+        }
+        entry->pending = 1;
+    }
+
+    struct mem_block file_buffer = empty_mem;
+    long http_status;
+    res->curl_err = daemon_fetch_url(state, url, &file_buffer, &http_status);
+    res->http_status = http_status;
+
+    // Decode here so clients get the bitmap straight away. Giant images are sent compressed
+    // and decoded tile by tile by the client
+    int opened = 0;
+    unsigned char* bitmap;
+    size_t w = 0, h = 0;
+    struct mem_block data = empty_mem;
+    if(res->curl_err == CURLE_OK && http_status == 200) {
+        pthread_mutex_unlock(&state->lock);
+        struct tiled_image tiled;
+        opened = open_image(&file_buffer, extension, TILE_DEFAULT_BUDGET, &bitmap, &bitmap_allocator, &tiled, NULL, &w, &h);
+        if(opened == 1) {
+            free(file_buffer.ptr);
+            data.ptr = (char*)bitmap;
+            data.i = w * h * 3;
+        }
+        else if(opened == 2) {
+            tiled_image_free(&tiled);
+            data = file_buffer;
+            w = h = 0;
+        }
+        else {
+            free(file_buffer.ptr);
+            res->curl_err = CURLE_BAD_CONTENT_ENCODING;
+        }
+        pthread_mutex_lock(&state->lock);
+    }
+    else
+        free(file_buffer.ptr);
+
+    if(entry != NULL) {
+        pthread_cond_broadcast(&state->fetched);
+        if(opened == 0) {
+            daemon_cache_drop(entry);
+            return;
+        }
+        entry->pending = 0;
+    }
+    else if(opened == 0)
+        return;
+    res->w = w;
+    res->h = h;
+    res->len = data.i;
+
+    // Make room in the bitmap cache, evicting the least recently used entries until it fits (or
+    // there's nothing left to evict)
+    while(entry != NULL && state->bitmap_cache_bytes + data.i > DAEMON_BITMAP_CACHE_BUDGET) {
+        struct daemon_cache_entry* victim = daemon_cache_lru(state->bitmap_cache, DAEMON_BITMAP_CACHE_N);
+        if(victim == NULL)
+            break;
+        state->bitmap_cache_bytes -= victim->data.i;
+        daemon_cache_drop(victim);
+    }
+    if(entry == NULL) { // Every slot is in use, so it isn't cached
+        reply->data = data;
+        reply->is_bitmap = opened == 1;
+        return;
+    }
+    entry->data = data;
+    entry->w = w;
+    entry->h = h;
+    entry->last_used = ++state->clock;
+    ++entry->pins;
+    state->bitmap_cache_bytes += data.i;
+    reply->pinned = entry;
+}
+
+// Serves one client until it hangs up. The lock is only held while looking requests up in (or
+// adding them to) the caches, so replies are written without it
+void daemon_serve_client(struct daemon_state* state, int client_fd) {
+    struct daemon_request req;
+    while(daemon_read_all(client_fd, &req, sizeof(struct daemon_request))) {
+        struct daemon_response res = {CURLE_OK, 0, 0, 0, 0};
+        struct daemon_reply reply = {NULL, empty_mem, 0};
+        char url[4096];
+
+        if(req.type == DAEMON_REQ_IMAGE && req.url_len > 0 && req.url_len < sizeof(url)) {
+            if(!daemon_read_all(client_fd, url, req.url_len))
+                return;
+            url[req.url_len] = '\0';
+        }
+        else if(req.type != DAEMON_REQ_JSON) {
+            fprintf(stderr, "@daemon_serve_client: Invalid request!\n");
+            return;
+        }
+
+        pthread_mutex_lock(&state->lock);
+        if(req.type == DAEMON_REQ_JSON)
+            daemon_handle_json(state, &req, &res, &reply);
+        else
+            daemon_handle_image(state, url, &res, &reply);
+        pthread_mutex_unlock(&state->lock);
+
+        // Pinned entries aren't changed or evicted until unpinned
+        const struct mem_block* data = (reply.pinned != NULL) ? &reply.pinned->data : &reply.data;
+        int ok = daemon_write_all(client_fd, &res, sizeof(struct daemon_response));
+        if(ok && res.len > 0)
+            ok = daemon_write_all(client_fd, data->ptr, data->i);
+        daemon_reply_free(state, &reply);
+        if(!ok)
+            return;
+    }
+}
+
+struct daemon_client {
+    struct daemon_state* state;
+    int fd;
+};
+
+void* daemon_client_thread(void* arg) {
+    struct daemon_client* client = arg;
+    struct daemon_state* state = client->state;
+    daemon_serve_client(state, client->fd);
+    close(client->fd);
+    free(client);
+
+    pthread_mutex_lock(&state->lock);
+    if(--state->n_clients == 0)
+        pthread_cond_signal(&state->idle);
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+// Serves a client in its own thread, so a slow one doesn't hold up the others. Returns 0 (after
+// closing it) if no thread could be started
+int daemon_start_client(struct daemon_state* state, int client_fd) {
+    // Clients which go quiet or stop reading are dropped instead of holding a thread (or the
+    // lock) forever
+    struct timeval timeout = {DAEMON_CLIENT_TIMEOUT, 0};
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    struct daemon_client* client = malloc(sizeof(struct daemon_client));
+    if(client == NULL) {
+        fprintf(stderr, "malloc@daemon_start_client: Out of memory!\n");
+        close(client_fd);
+        return 0;
+    }
+    client->state = state;
+    client->fd = client_fd;
+
+    pthread_mutex_lock(&state->lock);
+    ++state->n_clients;
+    pthread_mutex_unlock(&state->lock);
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, daemon_client_thread, client) != 0) {
+        fprintf(stderr, "pthread_create@daemon_start_client: Could not start client thread!\n");
+        pthread_mutex_lock(&state->lock);
+        --state->n_clients;
+        pthread_mutex_unlock(&state->lock);
+        close(client_fd);
+        free(client);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+// Runs the daemon in the foreground until killed. Returns 0 if it couldn't be started
+int run_daemon(int debug) {
+    struct sockaddr_un addr;
+    if(!daemon_socket_path(&addr))
+        return 0;
+
+    // Refuse to start if another daemon is already listening, otherwise remove stale sockets
+    int other_fd = daemon_connect();
+    if(other_fd >= 0) {
+        close(other_fd);
+        fprintf(stderr, "@run_daemon: A daemon is already running at %s!\n", addr.sun_path);
+        return 0;
+    }
+    unlink(addr.sun_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listen_fd < 0) {
+        fprintf(stderr, "socket@run_daemon: Could not create socket!\n");
+        return 0;
+    }
+    if(bind(listen_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listen_fd, 16) == -1) {
+        close(listen_fd);
+        fprintf(stderr, "bind@run_daemon: Could not listen on %s!\n", addr.sun_path);
+        return 0;
+    }
+
+    struct daemon_state* state = calloc(1, sizeof(struct daemon_state));
+    if(state == NULL) {
+        close(listen_fd);
+        unlink(addr.sun_path);
+        fprintf(stderr, "calloc@run_daemon: Out of memory!\n");
+        return 0;
+    }
+    pthread_mutex_init(&state->lock, NULL);
+    pthread_cond_init(&state->idle, NULL);
+    pthread_cond_init(&state->fetched, NULL);
+    pthread_cond_init(&state->work, NULL);
+
+    // Share DNS results and TLS sessions, so they outlive connections being closed by the server
+    state->share = curl_share_init();
+    curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    int sched_ready = dl_scheduler_init(&state->sched, state->share, debug);
+    if(sched_ready && pthread_create(&state->fetch_thread, NULL, daemon_fetch_thread, state) != 0) {
+        fprintf(stderr, "pthread_create@run_daemon: Could not start download thread!\n");
+        dl_scheduler_cleanup(&state->sched);
+        sched_ready = 0;
+    }
+    if(!sched_ready) {
+        curl_share_cleanup(state->share);
+        pthread_cond_destroy(&state->work);
+        pthread_cond_destroy(&state->fetched);
+        pthread_cond_destroy(&state->idle);
+        pthread_mutex_destroy(&state->lock);
+        free(state);
+        close(listen_fd);
+        unlink(addr.sun_path);
+        return 0;
+    }
+
+    // Clients hanging up mid-reply shouldn't kill the daemon
+    signal(SIGPIPE, SIG_IGN);
+
+    if(debug)
+        fprintf(stderr, "@run_daemon: Listening on %s\n", addr.sun_path);
+
+    while(1) {
+        int client_fd = accept(listen_fd, NULL, NULL);
+        if(client_fd < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "accept@run_daemon: Could not accept client!\n");
+            break;
+        }
+        daemon_start_client(state, client_fd);
+    }
+
+    // Clean-up, once clients (which time out eventually) are gone
+    pthread_mutex_lock(&state->lock);
+    while(state->n_clients > 0)
+        pthread_cond_wait(&state->idle, &state->lock);
+    state->stopping = 1;
+    pthread_cond_signal(&state->work);
+    pthread_mutex_unlock(&state->lock);
+    pthread_join(state->fetch_thread, NULL);
+    for(size_t i = 0; i < DAEMON_JSON_CACHE_N; ++i)
+        daemon_cache_drop(&state->json_cache[i]);
+    for(size_t i = 0; i < DAEMON_BITMAP_CACHE_N; ++i)
+        daemon_cache_drop(&state->bitmap_cache[i]);
+    dl_scheduler_cleanup(&state->sched);
+    curl_share_cleanup(state->share);
+    pthread_cond_destroy(&state->work);
+    pthread_cond_destroy(&state->fetched);
+    pthread_cond_destroy(&state->idle);
+    pthread_mutex_destroy(&state->lock);
+    free(state);
+    close(listen_fd);
+    unlink(addr.sun_path);
+    return 0;
+}
+
+#endif
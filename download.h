@@ -0,0 +1,517 @@
+#ifndef TERMKCD_DOWNLOAD_H
+#define TERMKCD_DOWNLOAD_H
+
+// Download scheduler. Transfers are queued by priority (the comic being viewed first, then
+// prefetching, then background syncing) and run concurrently on a curl multi handle, with a limit
+// of simultaneous transfers per host. Failed transfers are retried with jittered exponential
+// backoff, resuming from where they stopped with HTTP Range requests. Downloaded data goes into
+// buffers presized from Content-Length, which are recycled between transfers.
+
+// Include time header for monotonic clock
+#include <time.h>
+#include <unistd.h>
+
+#include "netcache.h"
+
+enum dl_priority {
+    DL_PRIORITY_VISIBLE,    // Needed right now
+    DL_PRIORITY_PREFETCH,   // Likely needed soon
+    DL_PRIORITY_BACKGROUND, // Syncing, paused while visible transfers run
+    DL_PRIORITY_N
+};
+
+enum dl_state {
+    DL_STATE_QUEUED,
+    DL_STATE_RUNNING,
+    DL_STATE_DONE,
+    DL_STATE_FAILED
+};
+
+// Scheduler settings
+#define DL_MAX_PER_HOST 4
+#define DL_MAX_RUNNING 8
+#define DL_MAX_RETRIES 5
+#define DL_BACKOFF_BASE 0.5  // Seconds before the first retry (before jitter)
+#define DL_BACKOFF_MAX 30.0  // Backoff cap, in seconds
+
+// Transfer buffer settings
+#define DL_POOL_N 8                              // Buffers kept for reuse
+#define DL_POOL_BUDGET (32 * 1024 * 1024)        // Bytes kept for reuse
+#define DL_BUFFER_MIN 16384                      // First allocation when the size isn't known
+#define DL_PRESIZE_MAX (64 * 1024 * 1024)        // Content-Length isn't trusted past this
+
+struct dl_buffer {
+    char* ptr;
+    size_t cap;
+};
+
+struct dl_job {
+    char* url;
+    enum dl_priority priority;
+    enum dl_state state;
+    struct mem_block data;    // Downloaded data, kept between attempts for resuming
+    size_t data_cap;          // Bytes allocated for data
+    CURLcode err;             // Result of the last attempt
+    long http_status;         // Status code of the last attempt
+    int attempts;
+    double retry_at;          // Monotonic time at which the job may be started again
+    char host[256];
+    CURL* handle;
+    char paused;
+    char first_write;         // No data received yet in the current attempt
+    char discard;             // Current attempt's body is an error page, don't keep it
+    size_t resume_from;       // Offset requested in the current attempt
+    // Optional hook called after data is appended at offset from, for consuming it while it's
+    // downloading. from goes back to 0 if the download had to start over
+    void (*on_data)(struct dl_job* job, size_t from);
+    void* user;
+    struct dl_scheduler* sched;
+    struct dl_job* next;      // Next job in queue or running list
+};
+
+struct dl_scheduler {
+    CURLM* multi;
+    CURLSH* share;            // Optional DNS and TLS session share
+    struct net_cache* net;    // Optional cache of addresses and TLS sessions kept between runs
+    struct dl_job* queues[DL_PRIORITY_N]; // Queued jobs, by priority
+    struct dl_job* running;
+    int n_running;
+    struct dl_buffer pool[DL_POOL_N]; // Free transfer buffers
+    int n_pooled;
+    size_t pooled_bytes;
+    int debug;
+};
+
+double dl_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Copies the host part of url to host, which has room for len chars
+void dl_get_host(const char* url, char* host, size_t len) {
+    const char* start = strstr(url, "://");
+    start = (start == NULL) ? url : start + 3;
+    size_t n = 0;
+    while(start[n] != '\0' && start[n] != '/' && start[n] != ':' && n < len - 1) {
+        host[n] = start[n];
+        ++n;
+    }
+    host[n] = '\0';
+}
+
+int dl_scheduler_init(struct dl_scheduler* sched, CURLSH* share, int debug) {
+    memset(sched, 0, sizeof(struct dl_scheduler));
+    sched->multi = curl_multi_init();
+    if(sched->multi == NULL) {
+        fprintf(stderr, "curl_multi_init@dl_scheduler_init: Could not initialize cURL!\n");
+        return 0;
+    }
+    sched->share = share;
+    sched->debug = debug;
+    // Seed backoff jitter
+    srand(time(NULL) ^ getpid());
+    return 1;
+}
+
+// Gives a buffer of cap bytes to the pool, or frees it if the pool is full
+void dl_pool_put(struct dl_scheduler* sched, char* ptr, size_t cap) {
+    if(ptr == NULL)
+        return;
+    if(cap > DL_POOL_BUDGET) {
+        free(ptr);
+        return;
+    }
+    // Make room by dropping smaller buffers, as big ones save the most copying
+    while(sched->n_pooled > 0 && (sched->n_pooled == DL_POOL_N || sched->pooled_bytes + cap > DL_POOL_BUDGET)) {
+        int smallest = 0;
+        for(int n = 1; n < sched->n_pooled; ++n) {
+            if(sched->pool[n].cap < sched->pool[smallest].cap)
+                smallest = n;
+        }
+        if(sched->pool[smallest].cap >= cap)
+            break;
+        free(sched->pool[smallest].ptr);
+        sched->pooled_bytes -= sched->pool[smallest].cap;
+        sched->pool[smallest] = sched->pool[--sched->n_pooled];
+    }
+    if(sched->n_pooled == DL_POOL_N || sched->pooled_bytes + cap > DL_POOL_BUDGET) {
+        free(ptr);
+        return;
+    }
+    sched->pool[sched->n_pooled++] = (struct dl_buffer){ptr, cap};
+    sched->pooled_bytes += cap;
+}
+
+// Gives data which was taken from a finished job back for reuse by later transfers
+void dl_recycle(struct dl_scheduler* sched, struct mem_block* data) {
+    // The buffer is at least as big as its data
+    dl_pool_put(sched, data->ptr, data->i);
+    (*data) = empty_mem;
+}
+
+// Makes room for need bytes of data in a job. Returns 0 if out of memory
+int dl_reserve(struct dl_job* job, size_t need) {
+    if(need <= job->data_cap)
+        return 1;
+    struct dl_scheduler* sched = job->sched;
+    if(job->data.ptr == NULL && sched->n_pooled > 0) {
+        // Smallest pooled buffer which fits, or else the biggest one to grow from
+        int best = 0;
+        for(int n = 1; n < sched->n_pooled; ++n) {
+            size_t cap = sched->pool[n].cap;
+            size_t best_cap = sched->pool[best].cap;
+            if((cap >= need && (best_cap < need || cap < best_cap)) || (best_cap < need && cap > best_cap))
+                best = n;
+        }
+        job->data.ptr = sched->pool[best].ptr;
+        job->data_cap = sched->pool[best].cap;
+        sched->pooled_bytes -= job->data_cap;
+        sched->pool[best] = sched->pool[--sched->n_pooled];
+        if(need <= job->data_cap)
+            return 1;
+    }
+
+    // Grow geometrically, so unknown sizes cost a logarithmic number of copies
+    size_t cap = job->data_cap * 2;
+    if(cap < DL_BUFFER_MIN)
+        cap = DL_BUFFER_MIN;
+    if(cap < need)
+        cap = need;
+    char* ptr = realloc(job->data.ptr, cap);
+    if(ptr == NULL) {
+        fprintf(stderr, "realloc@dl_reserve: Out of memory!\n");
+        return 0;
+    }
+    job->data.ptr = ptr;
+    job->data_cap = cap;
+    return 1;
+}
+
+size_t dl_write_callback(char* buf, size_t size, size_t nmemb, struct dl_job* job) {
+    if(job->first_write) {
+        job->first_write = 0;
+        long http_status = 0;
+        curl_easy_getinfo(job->handle, CURLINFO_RESPONSE_CODE, &http_status);
+        // Error pages aren't wanted, and a 200 to a Range request means the server is sending
+        // the whole file again
+        job->discard = http_status >= 300;
+        if(!job->discard && job->resume_from > 0 && http_status != 206)
+            job->data.i = 0;
+
+        // Allocate the whole body up front when its size is known
+        curl_off_t length = -1;
+        if(!job->discard && curl_easy_getinfo(job->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK && length > 0)
+            dl_reserve(job, job->data.i + ((length < DL_PRESIZE_MAX) ? (size_t)length : DL_PRESIZE_MAX));
+    }
+    if(job->discard)
+        return size * nmemb;
+    size_t from = job->data.i;
+    if(!dl_reserve(job, from + size * nmemb))
+        return (size * nmemb) + 1; // Anything != size * nmemb tells curl that an error has occured
+    memcpy(job->data.ptr + from, buf, size * nmemb);
+    job->data.i += size * nmemb;
+    if(job->on_data != NULL)
+        job->on_data(job, from);
+    return size * nmemb;
+}
+
+// Queues a download. Returns NULL if out of memory. The job must be freed with dl_job_free once
+// it has finished (or before dl_scheduler_cleanup, which aborts it)
+struct dl_job* dl_submit(struct dl_scheduler* sched, const char* url, enum dl_priority priority) {
+    struct dl_job* job = calloc(1, sizeof(struct dl_job));
+    if(job == NULL || (job->url = strdup(url)) == NULL) {
+        free(job);
+        fprintf(stderr, "malloc@dl_submit: Out of memory!\n");
+        return NULL;
+    }
+    job->priority = priority;
+    job->state = DL_STATE_QUEUED;
+    job->data = empty_mem;
+    job->sched = sched;
+    dl_get_host(url, job->host, sizeof(job->host));
+
+    // Append to the end of its queue, so jobs of the same priority run in order
+    struct dl_job** tail = &sched->queues[priority];
+    while(*tail != NULL)
+        tail = &(*tail)->next;
+    (*tail) = job;
+    return job;
+}
+
+// Starts an attempt of a job which was removed from its queue
+int dl_start(struct dl_scheduler* sched, struct dl_job* job) {
+    job->handle = curl_easy_init();
+    if(job->handle == NULL) {
+        fprintf(stderr, "curl_easy_init@dl_start: Could not initialize cURL!\n");
+        return 0;
+    }
+    if(sched->share != NULL)
+        curl_easy_setopt(job->handle, CURLOPT_SHARE, sched->share);
+    if(sched->net != NULL && sched->net->resolve != NULL)
+        curl_easy_setopt(job->handle, CURLOPT_RESOLVE, sched->net->resolve);
+    curl_easy_setopt(job->handle, CURLOPT_URL, job->url);
+    curl_easy_setopt(job->handle, CURLOPT_WRITEFUNCTION, dl_write_callback);
+    curl_easy_setopt(job->handle, CURLOPT_WRITEDATA, job);
+    curl_easy_setopt(job->handle, CURLOPT_PRIVATE, job);
+    // Stalled attempts time out, so they're retried (and resumed) like dropped ones
+    set_transfer_timeouts(job->handle);
+    if(sched->debug)
+        curl_easy_setopt(job->handle, CURLOPT_VERBOSE, 1L);
+
+    // Resume partial downloads
+    job->resume_from = job->data.i;
+    if(job->resume_from > 0)
+        curl_easy_setopt(job->handle, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)job->resume_from);
+
+    job->first_write = 1;
+    job->discard = 0;
+    job->paused = 0;
+    job->state = DL_STATE_RUNNING;
+    ++job->attempts;
+    curl_multi_add_handle(sched->multi, job->handle);
+
+    job->next = sched->running;
+    sched->running = job;
+    ++sched->n_running;
+    return 1;
+}
+
+int dl_host_running(struct dl_scheduler* sched, const char* host) {
+    int n = 0;
+    for(struct dl_job* job = sched->running; job != NULL; job = job->next) {
+        if(strcmp(job->host, host) == 0)
+            ++n;
+    }
+    return n;
+}
+
+// Starts as many queued jobs as the limits allow, highest priority first
+void dl_fill(struct dl_scheduler* sched) {
+    double now = dl_now();
+    for(int p = 0; p < DL_PRIORITY_N; ++p) {
+        struct dl_job** link = &sched->queues[p];
+        while(*link != NULL && sched->n_running < DL_MAX_RUNNING) {
+            struct dl_job* job = *link;
+            if(job->retry_at <= now && dl_host_running(sched, job->host) < DL_MAX_PER_HOST) {
+                (*link) = job->next;
+                if(!dl_start(sched, job)) {
+                    job->err = CURLE_FAILED_INIT;
+                    job->state = DL_STATE_FAILED;
+                }
+            }
+            else
+                link = &job->next;
+        }
+    }
+
+    // Background transfers give way to visible ones
+    int visible = 0;
+    for(struct dl_job* job = sched->running; job != NULL; job = job->next) {
+        if(job->priority == DL_PRIORITY_VISIBLE)
+            visible = 1;
+    }
+    for(struct dl_job* job = sched->running; job != NULL; job = job->next) {
+        if(job->priority == DL_PRIORITY_BACKGROUND && job->paused != visible) {
+            curl_easy_pause(job->handle, visible ? CURLPAUSE_RECV : CURLPAUSE_CONT);
+            job->paused = visible;
+        }
+    }
+}
+
+// Whether a failed attempt is worth retrying
+int dl_should_retry(struct dl_job* job) {
+    if(job->attempts > DL_MAX_RETRIES)
+        return 0;
+    switch(job->err) {
+    case CURLE_OK: // Server errors and rate limiting
+        return job->http_status == 408 || job->http_status == 429 || job->http_status >= 500;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_GOT_NOTHING:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Handles finished transfers, requeueing the ones to retry
+void dl_reap(struct dl_scheduler* sched) {
+    CURLMsg* msg;
+    int msgs_left;
+    while((msg = curl_multi_info_read(sched->multi, &msgs_left)) != NULL) {
+        if(msg->msg != CURLMSG_DONE)
+            continue;
+
+        struct dl_job* job;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&job);
+        job->err = msg->data.result;
+        curl_easy_getinfo(job->handle, CURLINFO_RESPONSE_CODE, &job->http_status);
+        curl_multi_remove_handle(sched->multi, job->handle);
+        if(sched->net != NULL)
+            net_cache_record(sched->net, job->handle, job->err);
+        curl_easy_cleanup(job->handle);
+        job->handle = NULL;
+
+        // Unlink from running list
+        for(struct dl_job** link = &sched->running; *link != NULL; link = &(*link)->next) {
+            if(*link == job) {
+                (*link) = job->next;
+                break;
+            }
+        }
+        --sched->n_running;
+        job->next = NULL;
+
+        // A range past the end of the file means the data is stale, start over
+        if(job->err == CURLE_OK && job->http_status == 416 && job->resume_from > 0) {
+            job->data.i = 0;
+            job->http_status = 503;
+        }
+
+        if(job->err == CURLE_OK && (job->http_status == 200 || job->http_status == 206))
+            job->state = DL_STATE_DONE;
+        else if(dl_should_retry(job)) {
+            // Exponential backoff with equal jitter: half fixed, half random
+            double backoff = DL_BACKOFF_BASE * (1 << (job->attempts - 1));
+            if(backoff > DL_BACKOFF_MAX)
+                backoff = DL_BACKOFF_MAX;
+            backoff = backoff / 2 + (backoff / 2) * ((double)rand() / RAND_MAX);
+            job->retry_at = dl_now() + backoff;
+            job->state = DL_STATE_QUEUED;
+            if(sched->debug)
+                fprintf(stderr, "@dl_reap: Retrying %s in %.2fs (resuming at %zu bytes)\n", job->url, backoff, job->data.i);
+            // Retries go back to the front of their queue
+            job->next = sched->queues[job->priority];
+            sched->queues[job->priority] = job;
+        }
+        else
+            job->state = DL_STATE_FAILED;
+    }
+}
+
+// Runs one round of transfers, waiting up to timeout_ms for activity on them or on the extra file
+// descriptors (e.g. stdin, for interactive use). Returns the number of unfinished jobs
+int dl_step(struct dl_scheduler* sched, struct curl_waitfd* extra_fds, unsigned int n_extra_fds, int timeout_ms) {
+    dl_fill(sched);
+
+    int still_running;
+    curl_multi_perform(sched->multi, &still_running);
+    dl_reap(sched);
+    dl_fill(sched);
+
+    int queued = 0;
+    double next_retry = -1;
+    for(int p = 0; p < DL_PRIORITY_N; ++p) {
+        for(struct dl_job* job = sched->queues[p]; job != NULL; job = job->next) {
+            ++queued;
+            if(next_retry < 0 || job->retry_at < next_retry)
+                next_retry = job->retry_at;
+        }
+    }
+    if(sched->n_running == 0 && queued == 0 && n_extra_fds == 0)
+        return 0;
+
+    // Wait for activity, or until the next retry is due
+    if(queued > 0) {
+        double wait = next_retry - dl_now();
+        if(wait < 0)
+            wait = 0;
+        if(wait * 1000 < timeout_ms)
+            timeout_ms = wait * 1000;
+    }
+    curl_multi_poll(sched->multi, extra_fds, n_extra_fds, timeout_ms, NULL);
+    return sched->n_running + queued;
+}
+
+// Runs transfers until the given job (or every job, if NULL) has finished
+void dl_run(struct dl_scheduler* sched, struct dl_job* until) {
+    while(until == NULL || (until->state != DL_STATE_DONE && until->state != DL_STATE_FAILED)) {
+        if(dl_step(sched, NULL, 0, 1000) == 0)
+            return;
+    }
+}
+
+void dl_job_free(struct dl_scheduler* sched, struct dl_job* job) {
+    if(job == NULL)
+        return;
+    // Unlink if still queued or running
+    if(job->state == DL_STATE_QUEUED || job->state == DL_STATE_RUNNING) {
+        struct dl_job** list = (job->state == DL_STATE_QUEUED) ? &sched->queues[job->priority] : &sched->running;
+        for(struct dl_job** link = list; *link != NULL; link = &(*link)->next) {
+            if(*link == job) {
+                (*link) = job->next;
+                break;
+            }
+        }
+        if(job->handle != NULL) {
+            curl_multi_remove_handle(sched->multi, job->handle);
+            curl_easy_cleanup(job->handle);
+            --sched->n_running;
+        }
+    }
+    free(job->url);
+    dl_pool_put(sched, job->data.ptr, job->data_cap);
+    free(job);
+}
+
+void dl_scheduler_cleanup(struct dl_scheduler* sched) {
+    for(int p = 0; p < DL_PRIORITY_N; ++p) {
+        while(sched->queues[p] != NULL)
+            dl_job_free(sched, sched->queues[p]);
+    }
+    while(sched->running != NULL)
+        dl_job_free(sched, sched->running);
+    for(int n = 0; n < sched->n_pooled; ++n)
+        free(sched->pool[n].ptr);
+    sched->n_pooled = 0;
+    curl_multi_cleanup(sched->multi);
+}
+
+// Runs an already submitted job to completion, then takes its data and frees it. Same results as
+// dl_fetch
+CURLcode dl_wait(struct dl_scheduler* sched, struct dl_job* job, struct mem_block* out, long* http_status) {
+    dl_run(sched, job);
+
+    CURLcode err = job->err;
+    (*http_status) = job->http_status;
+    if(job->state == DL_STATE_DONE) {
+        // Resumed downloads report 206, but the data is whole
+        (*http_status) = 200;
+        // Data much smaller than its (likely recycled) buffer is copied out, so the buffer stays
+        // in the pool instead of being kept by e.g. a cache
+        char* copy = NULL;
+        if(job->data.i * 2 < job->data_cap && (copy = malloc(job->data.i + 1)) != NULL) {
+            memcpy(copy, job->data.ptr, job->data.i);
+            out->ptr = copy;
+            out->i = job->data.i;
+        }
+        else {
+            (*out) = job->data;
+            job->data = empty_mem;
+            job->data_cap = 0;
+        }
+    }
+    dl_job_free(sched, job);
+    return err;
+}
+
+// Downloads url into out and waits for it, running other queued transfers meanwhile. Returns the
+// curl error code and sets http_status to the response's status code, like a single blocking
+// curl_easy_perform would
+CURLcode dl_fetch(struct dl_scheduler* sched, const char* url, enum dl_priority priority, struct mem_block* out, long* http_status) {
+    (*http_status) = 0;
+    struct dl_job* job = dl_submit(sched, url, priority);
+    if(job == NULL)
+        return CURLE_OUT_OF_MEMORY;
+    return dl_wait(sched, job, out, http_status);
+}
+
+#endif
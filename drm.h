@@ -0,0 +1,323 @@
+#ifndef TERMKCD_DRM_H
+#define TERMKCD_DRM_H
+
+// DRM/KMS display backend. Frames are drawn straight into dumb buffers (double or triple buffered)
+// which are shown with vblank-synchronized page flips, so nothing is copied and nothing tears.
+// Only the kernel's uapi headers are needed, not libdrm. Builds without them just lack this
+// backend, and the framebuffer falls back to fbdev.
+
+#if defined(__has_include)
+#if __has_include(<drm/drm.h>)
+#define TERMKCD_HAVE_DRM
+#endif
+#endif
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#ifdef TERMKCD_HAVE_DRM
+#include <drm/drm.h>
+#include <drm/drm_mode.h>
+#endif
+
+// Checked device nodes: /dev/dri/card0 to card<DRM_MAX_CARDS - 1>
+#define DRM_MAX_CARDS 8
+#define DRM_MAX_BUFFERS 3
+
+struct drm_buffer {
+    uint32_t handle; // Dumb buffer handle
+    uint32_t fb_id;
+    unsigned char* mem;
+    size_t size;
+};
+
+struct drm_display {
+    int fd;
+    uint32_t connector_id;
+    uint32_t crtc_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    struct drm_buffer buffers[DRM_MAX_BUFFERS];
+    int n_buffers;
+    char flip_pending;
+#ifdef TERMKCD_HAVE_DRM
+    struct drm_mode_modeinfo mode;
+    struct drm_mode_crtc saved_crtc; // Restored on exit, which brings the console back
+#endif
+};
+
+#ifdef TERMKCD_HAVE_DRM
+
+// Like ioctl, but retries when interrupted
+int drm_ioctl(int fd, unsigned long request, void* arg) {
+    int ret;
+    do {
+        ret = ioctl(fd, request, arg);
+    } while(ret == -1 && (errno == EINTR || errno == EAGAIN));
+    return ret;
+}
+
+// Finds a connected connector with a mode, and a CRTC to drive it. Returns 0 if there's none
+int drm_find_output(struct drm_display* disp) {
+    struct drm_mode_card_res res;
+    memset(&res, 0, sizeof(struct drm_mode_card_res));
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1 || res.count_connectors == 0 || res.count_crtcs == 0)
+        return 0;
+
+    uint32_t connectors[res.count_connectors];
+    uint32_t crtcs[res.count_crtcs];
+    // Only the connectors and CRTCs are needed
+    res.count_fbs = 0;
+    res.count_encoders = 0;
+    res.connector_id_ptr = (uintptr_t)connectors;
+    res.crtc_id_ptr = (uintptr_t)crtcs;
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETRESOURCES, &res) == -1)
+        return 0;
+
+    for(uint32_t c = 0; c < res.count_connectors; ++c) {
+        struct drm_mode_get_connector conn;
+        memset(&conn, 0, sizeof(struct drm_mode_get_connector));
+        conn.connector_id = connectors[c];
+        if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == -1 || conn.connection != 1 || conn.count_modes == 0)
+            continue;
+
+        struct drm_mode_modeinfo modes[conn.count_modes];
+        uint32_t encoders[conn.count_encoders + 1];
+        conn.count_props = 0;
+        conn.modes_ptr = (uintptr_t)modes;
+        conn.encoders_ptr = (uintptr_t)encoders;
+        if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn) == -1 || conn.count_modes == 0)
+            continue;
+
+        // Preferred mode, if any
+        disp->mode = modes[0];
+        for(uint32_t m = 0; m < conn.count_modes; ++m) {
+            if(modes[m].type & DRM_MODE_TYPE_PREFERRED) {
+                disp->mode = modes[m];
+                break;
+            }
+        }
+
+        // Keep the CRTC the connector is already on, otherwise take any it can use
+        disp->crtc_id = 0;
+        for(uint32_t e = 0; e < conn.count_encoders && disp->crtc_id == 0; ++e) {
+            struct drm_mode_get_encoder enc;
+            memset(&enc, 0, sizeof(struct drm_mode_get_encoder));
+            enc.encoder_id = encoders[e];
+            if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETENCODER, &enc) == -1)
+                continue;
+            if(enc.encoder_id == conn.encoder_id && enc.crtc_id != 0)
+                disp->crtc_id = enc.crtc_id;
+            else {
+                for(uint32_t n = 0; n < res.count_crtcs && n < 32; ++n) {
+                    if(enc.possible_crtcs & (1 << n)) {
+                        disp->crtc_id = crtcs[n];
+                        break;
+                    }
+                }
+            }
+        }
+        if(disp->crtc_id == 0)
+            continue;
+
+        disp->connector_id = conn.connector_id;
+        disp->width = disp->mode.hdisplay;
+        disp->height = disp->mode.vdisplay;
+        return 1;
+    }
+    return 0;
+}
+
+void drm_destroy_buffer(struct drm_display* disp, struct drm_buffer* buf) {
+    if(buf->mem != NULL)
+        munmap(buf->mem, buf->size);
+    if(buf->fb_id != 0)
+        drm_ioctl(disp->fd, DRM_IOCTL_MODE_RMFB, &buf->fb_id);
+    if(buf->handle != 0) {
+        struct drm_mode_destroy_dumb destroy = {buf->handle};
+        drm_ioctl(disp->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset(buf, 0, sizeof(struct drm_buffer));
+}
+
+// Creates a 32-bit XRGB dumb buffer the size of the mode, maps it, and makes a framebuffer of it
+int drm_create_buffer(struct drm_display* disp, struct drm_buffer* buf) {
+    struct drm_mode_create_dumb create;
+    memset(&create, 0, sizeof(struct drm_mode_create_dumb));
+    create.width = disp->width;
+    create.height = disp->height;
+    create.bpp = 32;
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) == -1)
+        return 0;
+    buf->handle = create.handle;
+    buf->size = create.size;
+    disp->pitch = create.pitch;
+
+    struct drm_mode_fb_cmd fb;
+    memset(&fb, 0, sizeof(struct drm_mode_fb_cmd));
+    fb.width = disp->width;
+    fb.height = disp->height;
+    fb.pitch = create.pitch;
+    fb.bpp = 32;
+    fb.depth = 24;
+    fb.handle = create.handle;
+    struct drm_mode_map_dumb map;
+    memset(&map, 0, sizeof(struct drm_mode_map_dumb));
+    map.handle = create.handle;
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_ADDFB, &fb) == -1 || drm_ioctl(disp->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) == -1) {
+        drm_destroy_buffer(disp, buf);
+        return 0;
+    }
+    buf->fb_id = fb.fb_id;
+
+    buf->mem = mmap(0, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED, disp->fd, map.offset);
+    if(buf->mem == MAP_FAILED) {
+        buf->mem = NULL;
+        drm_destroy_buffer(disp, buf);
+        return 0;
+    }
+    // Dumb buffers start zeroed (black)
+    return 1;
+}
+
+// Waits for the pending page flip, if any, to finish
+void drm_wait_flip(struct drm_display* disp) {
+    char buf[1024];
+    while(disp->flip_pending) {
+        ssize_t len = read(disp->fd, buf, sizeof(buf));
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            disp->flip_pending = 0; // Nothing more can be done
+            break;
+        }
+        for(ssize_t off = 0; off + (ssize_t)sizeof(struct drm_event) <= len; ) {
+            struct drm_event* event = (struct drm_event*)(buf + off);
+            if(event->type == DRM_EVENT_FLIP_COMPLETE)
+                disp->flip_pending = 0;
+            if(event->length == 0)
+                break;
+            off += event->length;
+        }
+    }
+}
+
+// Shows a buffer on the next vblank
+int drm_flip(struct drm_display* disp, int n) {
+    drm_wait_flip(disp);
+    struct drm_mode_crtc_page_flip flip;
+    memset(&flip, 0, sizeof(struct drm_mode_crtc_page_flip));
+    flip.crtc_id = disp->crtc_id;
+    flip.fb_id = disp->buffers[n].fb_id;
+    flip.flags = DRM_MODE_PAGE_FLIP_EVENT;
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_PAGE_FLIP, &flip) == -1)
+        return 0;
+    disp->flip_pending = 1;
+    return 1;
+}
+
+void drm_close(struct drm_display* disp) {
+    drm_wait_flip(disp);
+
+    // Give the CRTC back to whatever had it (usually the console)
+    if(disp->saved_crtc.crtc_id != 0) {
+        disp->saved_crtc.set_connectors_ptr = (uintptr_t)&disp->connector_id;
+        disp->saved_crtc.count_connectors = 1;
+        drm_ioctl(disp->fd, DRM_IOCTL_MODE_SETCRTC, &disp->saved_crtc);
+    }
+
+    for(int n = 0; n < disp->n_buffers; ++n)
+        drm_destroy_buffer(disp, &disp->buffers[n]);
+    close(disp->fd);
+}
+
+// Opens the first card with a connected display, creates its buffers (three, or two if they don't
+// fit in max_mem, 0 meaning no limit) and shows the first one. Failures are only reported if
+// verbose, as probing for DRM under a display server is expected to fail. Returns 0 on failure
+int drm_open(struct drm_display* disp, size_t max_mem, int verbose) {
+    memset(disp, 0, sizeof(struct drm_display));
+    disp->fd = -1;
+    for(int card = 0; card < DRM_MAX_CARDS && disp->fd < 0; ++card) {
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/dri/card%i", card);
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        if(fd < 0)
+            continue;
+
+        struct drm_get_cap cap = {DRM_CAP_DUMB_BUFFER, 0};
+        disp->fd = fd;
+        if(drm_ioctl(fd, DRM_IOCTL_GET_CAP, &cap) == -1 || cap.value == 0 || !drm_find_output(disp)) {
+            close(fd);
+            disp->fd = -1;
+        }
+    }
+    if(disp->fd < 0)
+        return 0;
+
+    int n_buffers = DRM_MAX_BUFFERS;
+    if(max_mem != 0 && (size_t)DRM_MAX_BUFFERS * disp->width * disp->height * 4 > max_mem)
+        n_buffers = 2;
+    for(; disp->n_buffers < n_buffers; ++disp->n_buffers) {
+        if(!drm_create_buffer(disp, &disp->buffers[disp->n_buffers]))
+            break;
+    }
+
+    disp->saved_crtc.crtc_id = disp->crtc_id;
+    if(disp->n_buffers < 2 || drm_ioctl(disp->fd, DRM_IOCTL_MODE_GETCRTC, &disp->saved_crtc) == -1) {
+        disp->saved_crtc.crtc_id = 0;
+        drm_close(disp);
+        if(verbose)
+            fprintf(stderr, "ioctl@drm_open: Could not create display buffers!\n");
+        return 0;
+    }
+
+    // Needs to be the DRM master, which fails under a display server
+    struct drm_mode_crtc crtc;
+    memset(&crtc, 0, sizeof(struct drm_mode_crtc));
+    crtc.crtc_id = disp->crtc_id;
+    crtc.fb_id = disp->buffers[0].fb_id;
+    crtc.set_connectors_ptr = (uintptr_t)&disp->connector_id;
+    crtc.count_connectors = 1;
+    crtc.mode = disp->mode;
+    crtc.mode_valid = 1;
+    if(drm_ioctl(disp->fd, DRM_IOCTL_MODE_SETCRTC, &crtc) == -1) {
+        disp->saved_crtc.crtc_id = 0;
+        drm_close(disp);
+        if(verbose)
+            fprintf(stderr, "ioctl@drm_open: Could not set display mode! Is a display server running?\n");
+        return 0;
+    }
+    return 1;
+}
+
+#else
+
+int drm_open(struct drm_display* disp, size_t max_mem, int verbose) {
+    (void)disp;
+    (void)max_mem;
+    (void)verbose;
+    return 0; // Built without DRM support
+}
+
+int drm_flip(struct drm_display* disp, int n) {
+    (void)disp;
+    (void)n;
+    return 0;
+}
+
+void drm_wait_flip(struct drm_display* disp) {
+    (void)disp;
+}
+
+void drm_close(struct drm_display* disp) {
+    (void)disp;
+}
+
+#endif
+
+#endif
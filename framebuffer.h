@@ -11,91 +11,602 @@
 
 // Includes for raw input
 #include <termios.h>
+#include <poll.h>
 
 // Pre-rendered help text include:
 #include "text.h"
 
-int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
+// DRM/KMS backend
+#include "drm.h"
+
+// Alt-text overlay
+#include "overlay.h"
+
+// Performance HUD
+#include "hud.h"
+
+// Rotated displays
+#include "rotate.h"
+
+// Display backends. Auto uses DRM/KMS when possible, otherwise fbdev. Mock draws to memory, for
+// benchmarking and testing without a console
+enum fb_backend {
+    FB_BACKEND_AUTO,
+    FB_BACKEND_DRM,
+    FB_BACKEND_FBDEV,
+    FB_BACKEND_MOCK
+};
+
+// Mock display defaults
+#define FB_MOCK_XRES 1920
+#define FB_MOCK_YRES 1080
+#define FB_MOCK_BPP 4
+
+struct fb_settings {
+    enum fb_backend backend;
+    int mock_xres;
+    int mock_yres;
+    int mock_bpp;           // BYTES per pixel, 3 or 4
+    size_t mock_ll;         // Line length, 0 for xres * bpp
+    const char* keys;       // Key script replayed instead of reading stdin (NULL for none), see fb_read_key
+    int rotate;             // Degrees the image is turned clockwise, FB_ROTATE_AUTO to follow the console
+};
+
+// Use the console's rotation, see fb_query_rotation
+#define FB_ROTATE_AUTO -1
+
+// Frame times recorded while replaying a key script, in seconds
+struct fb_bench {
+    double* render;         // Drawing a frame, including waiting for a free buffer
+    double* swap;           // Presenting it
+    size_t n;
+    size_t cap;
+};
+
+// Viewer rendering strategies, from most to least memory hungry. Every strategy but the last one
+// also keeps a copy of the visible screen, to restore it on exit
+enum fb_strategy {
+    FB_STRATEGY_BACKBUFFER,   // Draw to a backbuffer in RAM, then copy it to the framebuffer
+    FB_STRATEGY_FLIP,         // Draw to the hidden half of a double-height framebuffer, then pan to it
+    FB_STRATEGY_DIRECT,       // Draw straight to the framebuffer (may flicker)
+    FB_STRATEGY_DIRECT_NOSAVE // Like direct, but the screen is cleared on exit instead of restored
+};
+
+// Screen rectangle. Right and bottom are exclusive
+struct fb_rect {
+    int l;
+    int t;
+    int r;
+    int b;
+};
+
+// Buffer being drawn to, with what was drawn to it last time, as it's only partially cleared
+struct fb_target {
+    unsigned char* mem;
+    struct fb_rect drawn; // Image area
+    char toolbar;         // Whether the toolbar was drawn
+    char overlay;         // Whether the text overlay was drawn
+    char hud;             // Whether the HUD was drawn
+};
+
+// Clears the part of old which isn't covered by new (at most 4 strips). Returns the number of
+// pixels cleared
+size_t fb_clear_stale(unsigned char* mem, size_t ll, int bpp, struct fb_rect* old, struct fb_rect* new) {
+    if(old->l >= old->r || old->t >= old->b)
+        return 0;
+
+    // Whole old rectangle if they don't overlap
+    struct fb_rect keep = *new;
+    if(keep.l < old->l)
+        keep.l = old->l;
+    if(keep.t < old->t)
+        keep.t = old->t;
+    if(keep.r > old->r)
+        keep.r = old->r;
+    if(keep.b > old->b)
+        keep.b = old->b;
+    if(keep.l >= keep.r || keep.t >= keep.b)
+        keep = (struct fb_rect){old->l, old->t, old->l, old->t};
+
+    for(int y = old->t; y < old->b; ++y) {
+        if(y < keep.t || y >= keep.b) // Strips above and below
+            stride_memset(mem + (old->l * bpp) + (y * ll), 0, 3, old->r - old->l, bpp);
+        else { // Strips left and right
+            if(keep.l > old->l)
+                stride_memset(mem + (old->l * bpp) + (y * ll), 0, 3, keep.l - old->l, bpp);
+            if(old->r > keep.r)
+                stride_memset(mem + (keep.r * bpp) + (y * ll), 0, 3, old->r - keep.r, bpp);
+        }
+    }
+    return (size_t)(old->r - old->l) * (old->b - old->t) - (size_t)(keep.r - keep.l) * (keep.b - keep.t);
+}
+
+// Picks the rendering strategy for a viewer memory budget (0 for no limit). page_len is the size
+// of one screen
+enum fb_strategy fb_pick_strategy(size_t max_mem, size_t page_len, int can_flip) {
+    if(max_mem == 0)
+        return FB_STRATEGY_BACKBUFFER;
+    if(can_flip && page_len <= max_mem)
+        return FB_STRATEGY_FLIP;
+    if(2 * page_len <= max_mem)
+        return FB_STRATEGY_BACKBUFFER;
+    if(page_len <= max_mem)
+        return FB_STRATEGY_DIRECT;
+    return FB_STRATEGY_DIRECT_NOSAVE;
+}
+
+// Opened framebuffer, with everything needed to draw to it and to restore it afterwards
+struct fb_device {
+    int fd;
+    struct fb_var_screeninfo var_info;     // Framebuffer variable info
+    struct fb_var_screeninfo restore_info; // For restoring video mode...
+    struct fb_fix_screeninfo fix_info;     // Framebuffer fixed info
+    int bpp;                  // BYTES per pixel, not BITS per pixel
+    size_t ll;                // Line length
+    int xres;
+    int yres;
+    unsigned char* fb_mem;
+    size_t fb_buflen;         // Framebuffer buffer length (of each sub-buffer)
+    size_t page_len;          // Length of the visible part only
+    unsigned char* visible_mem;
+    unsigned char* fb_mem_old;
+    unsigned char* backbuffer;
+    enum fb_strategy strategy;
+    struct fb_target targets[DRM_MAX_BUFFERS];
+    int n_targets;
+    int cur_target;
+    struct termios termio_old;
+    char is_drm;              // Drawing to DRM dumb buffers instead of /dev/fb0
+    char is_mock;             // Drawing to memory
+    struct drm_display drm;
+    const char* keys;         // Rest of the key script
+    unsigned int key_repeat;  // Times left to repeat the script's current key
+    struct fb_bench bench;
+};
+
+// Sets up DRM/KMS dumb buffers to draw to, triple buffered unless memory is tight. verbose reports
+// why it failed (see drm_open). Returns 0 on failure
+int fb_open_drm(struct fb_device* dev, size_t max_mem, int verbose) {
+    if(!drm_open(&dev->drm, max_mem, verbose))
+        return 0;
+
+    const struct fb_rect empty_rect = {0, 0, 0, 0};
+    dev->is_drm = 1;
+    dev->bpp = 4;
+    dev->ll = dev->drm.pitch;
+    dev->xres = dev->drm.width;
+    dev->yres = dev->drm.height;
+    dev->page_len = dev->drm.pitch * dev->drm.height;
+    dev->strategy = FB_STRATEGY_FLIP;
+    dev->n_targets = dev->drm.n_buffers;
+    for(int n = 0; n < dev->n_targets; ++n)
+        dev->targets[n] = (struct fb_target){dev->drm.buffers[n].mem, empty_rect, 0};
+    // The first buffer is on screen
+    dev->cur_target = 1;
+    return 1;
+}
+
+// Picks the rendering strategy for an opened framebuffer (fb_mem, page_len and visible_mem set)
+// and sets up the buffers to draw to. Returns 0 if out of memory
+int fb_setup_pages(struct fb_device* dev, size_t max_mem, int can_flip) {
+    enum fb_strategy strategy = fb_pick_strategy(max_mem, dev->page_len, can_flip);
+    unsigned char* fb_mem_old = NULL;
+    unsigned char* backbuffer = NULL;
+    if(strategy != FB_STRATEGY_DIRECT_NOSAVE)
+        fb_mem_old = bitmap_alloc(dev->page_len);
+    if(strategy == FB_STRATEGY_BACKBUFFER)
+        backbuffer = bitmap_alloc(dev->page_len);
+    if((strategy != FB_STRATEGY_DIRECT_NOSAVE && fb_mem_old == NULL) || (strategy == FB_STRATEGY_BACKBUFFER && backbuffer == NULL)) {
+        bitmap_free(fb_mem_old);
+        bitmap_free(backbuffer);
+        fprintf(stderr, "malloc@fb_open: Out of memory!\n");
+        return 0;
+    }
+    dev->fb_mem_old = fb_mem_old;
+    dev->backbuffer = backbuffer;
+    dev->strategy = strategy;
+
+    // Set up buffers to draw to. Framebuffer pages start with whatever was on screen, so they
+    // are fully cleared on their first frame
+    struct fb_rect full_screen = {0, 0, dev->xres, dev->yres};
+    struct fb_rect empty_rect = {0, 0, 0, 0};
+    dev->n_targets = 1;
+    dev->cur_target = 0;
+    if(strategy == FB_STRATEGY_BACKBUFFER) {
+        // Clear current buffer, with it being fully black
+        memset(backbuffer, 0, dev->page_len);
+        dev->targets[0] = (struct fb_target){backbuffer, empty_rect, 0};
+    }
+    else if(strategy == FB_STRATEGY_FLIP) {
+        // Start drawing on the hidden page
+        dev->targets[0] = (struct fb_target){dev->fb_mem, full_screen, 1};
+        dev->targets[1] = (struct fb_target){dev->fb_mem + dev->page_len, full_screen, 1};
+        dev->n_targets = 2;
+        dev->cur_target = 1;
+    }
+    else
+        dev->targets[0] = (struct fb_target){dev->visible_mem, full_screen, 1};
+
+    // Copy buffer
+    if(fb_mem_old != NULL)
+        memcpy(fb_mem_old, dev->visible_mem, dev->page_len);
+
+    return 1;
+}
+
+// Opens /dev/fb0 and sets it up for drawing. Returns 0 on failure
+int fb_open_fbdev(struct fb_device* dev, size_t max_mem) {
     int fd = open("/dev/fb0", O_RDWR); // Open framebuffer device
     if(fd < 0) { // If the framebuffer device id is >= 0, then it successfully opened
-        fprintf(stderr, "open@draw_to_fb: Could not open framebuffer device /dev/fb0!\nAre you root or part of the framebuffer's group (typically video)?\n");
+        fprintf(stderr, "open@fb_open: Could not open framebuffer device /dev/fb0!\nAre you root or part of the framebuffer's group (typically video)?\n");
         return 0;
     }
+    dev->fd = fd;
    
     struct fb_var_screeninfo var_info; // Framebuffer variable info
 
     if(ioctl(fd, FBIOGET_VSCREENINFO, &var_info) == -1) {
-        fprintf(stderr, "ioctl@draw_to_fb: Could not retreive variable framebuffer info!\n");
+        close(fd); // Clean-up
+        fprintf(stderr, "ioctl@fb_open: Could not retreive variable framebuffer info!\n");
         return 0;
     }
 
-    struct fb_var_screeninfo restore_info = var_info; // For restoring video mode...
+    dev->restore_info = var_info; // For restoring video mode...
 
     // Force 24-bit bit-depth, with RGB colour
     const int bpp = 4; // BYTES per pixel, not BITS per pixel
     var_info.bits_per_pixel = bpp * 8; // Set bpp to full colour with no alpha
     var_info.grayscale = 0;            // Set to use colour
-    if(ioctl(fd, FBIOPUT_VSCREENINFO, &var_info) == -1) {
+
+    // When memory is tight, try to get a double-height framebuffer for page flipping
+    char want_flip = (max_mem != 0) && (var_info.yoffset == 0);
+    if(want_flip) {
+        struct fb_var_screeninfo flip_info = var_info;
+        if(flip_info.yres_virtual < flip_info.yres * 2)
+            flip_info.yres_virtual = flip_info.yres * 2;
+        if(ioctl(fd, FBIOPUT_VSCREENINFO, &flip_info) == 0 && ioctl(fd, FBIOGET_VSCREENINFO, &flip_info) == 0 && flip_info.yres_virtual >= flip_info.yres * 2)
+            var_info = flip_info;
+        else
+            want_flip = 0;
+    }
+
+    if(!want_flip && ioctl(fd, FBIOPUT_VSCREENINFO, &var_info) == -1) {
         close(fd); // Clean-up
-        fprintf(stderr, "ioctl@draw_to_fb: Could not set variable framebuffer info!\n");
+        fprintf(stderr, "ioctl@fb_open: Could not set variable framebuffer info!\n");
         return 0;
     }
 
     struct fb_fix_screeninfo fix_info; // Framebuffer fixed info
     if(ioctl(fd, FBIOGET_FSCREENINFO, &fix_info) == -1) {
+        ioctl(fd, FBIOPUT_VSCREENINFO, &dev->restore_info);
         close(fd); // Clean-up
-        fprintf(stderr, "ioctl@draw_to_fb: Could not retreive fixed framebuffer info!\n");
+        fprintf(stderr, "ioctl@fb_open: Could not retreive fixed framebuffer info!\n");
         return 0;
     }
 
     size_t fb_buflen = var_info.yres_virtual * fix_info.line_length; // Framebuffer buffer length (of each sub-buffer)
+    size_t page_len = var_info.yres * fix_info.line_length; // Length of the visible part only
     unsigned char* fb_mem = mmap(0, fb_buflen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0); // Framebuffer buffer ptr
 
     if(fb_mem == MAP_FAILED) { // Get access to framebuffer memory
+        ioctl(fd, FBIOPUT_VSCREENINFO, &dev->restore_info);
         close(fd); // Clean-up
-        fprintf(stderr, "mmap@draw_to_fb: Could not map framebuffer into memory!\n");
+        fprintf(stderr, "mmap@fb_open: Could not map framebuffer into memory!\n");
         return 0;
     }
 
-    // Allocate memory for framebuffer restore
-    unsigned char* fb_mem_old = malloc(fb_buflen);
-    if(fb_mem_old == NULL) {
+    // Page flipping needs the driver to support panning
+    if(want_flip) {
+        if(fix_info.smem_len < 2 * page_len || ioctl(fd, FBIOPAN_DISPLAY, &var_info) == -1)
+            want_flip = 0;
+    }
+
+    dev->var_info = var_info;
+    dev->fix_info = fix_info;
+    dev->bpp = bpp;
+    dev->ll = fix_info.line_length;
+    dev->xres = var_info.xres;
+    dev->yres = var_info.yres;
+    dev->fb_mem = fb_mem;
+    dev->fb_buflen = fb_buflen;
+    dev->page_len = page_len;
+    // Only the visible part of the screen is drawn to, so only that is saved. Page flipping draws
+    // to the second page too, but that one isn't visible when restoring
+    dev->visible_mem = fb_mem + (var_info.yoffset * fix_info.line_length);
+    if(!fb_setup_pages(dev, max_mem, want_flip)) {
         // Clean-up
         munmap(fb_mem, fb_buflen);
+        ioctl(fd, FBIOPUT_VSCREENINFO, &dev->restore_info);
         close(fd);
-        fprintf(stderr, "malloc@draw_to_fb: Out of memory!\n");
         return 0;
     }
+    return 1;
+}
 
-    unsigned char* backbuffer = malloc(fb_buflen);
-    if(fb_mem_old == NULL) {
-        // Clean-up
-        munmap(fb_mem, fb_buflen);
-        close(fd);
-        free(fb_mem_old);
-        fprintf(stderr, "malloc@draw_to_fb: Out of memory!\n");
+// Sets up a block of memory shaped like a framebuffer to draw to. Returns 0 on failure
+int fb_open_mock(struct fb_device* dev, size_t max_mem, const struct fb_settings* settings) {
+    dev->bpp = settings->mock_bpp;
+    dev->xres = settings->mock_xres;
+    dev->yres = settings->mock_yres;
+    dev->ll = (settings->mock_ll != 0) ? settings->mock_ll : (size_t)dev->xres * dev->bpp;
+    if((dev->bpp != 3 && dev->bpp != 4) || dev->xres <= 0 || dev->yres <= 0 || dev->ll < (size_t)dev->xres * dev->bpp) {
+        fprintf(stderr, "@fb_open_mock: Invalid mock display mode!\n");
         return 0;
     }
 
-    // Clear current buffer, with it being fully black
-    memset(backbuffer, 0, fb_buflen);
+    // Double height, so page flipping can be used like on a real framebuffer
+    dev->is_mock = 1;
+    dev->page_len = dev->ll * dev->yres;
+    dev->fb_buflen = 2 * dev->page_len;
+    dev->fb_mem = bitmap_calloc(dev->fb_buflen);
+    if(dev->fb_mem == NULL) {
+        fprintf(stderr, "malloc@fb_open_mock: Out of memory!\n");
+        return 0;
+    }
+    dev->visible_mem = dev->fb_mem;
+    if(!fb_setup_pages(dev, max_mem, 1)) {
+        bitmap_free(dev->fb_mem);
+        return 0;
+    }
+    return 1;
+}
+
+// Degrees the console is turned clockwise, from the framebuffer's rotate setting or else fbcon's
+// (both in quarter turns: 1 is 90 degrees clockwise, 3 is 90 degrees counter-clockwise). 0 if unknown
+int fb_query_rotation(void) {
+    int quarters = 0;
+    int fd = open("/dev/fb0", O_RDONLY);
+    if(fd != -1) {
+        struct fb_var_screeninfo var_info;
+        if(ioctl(fd, FBIOGET_VSCREENINFO, &var_info) == 0)
+            quarters = var_info.rotate;
+        close(fd);
+    }
+    if(quarters == 0) {
+        FILE* file = fopen("/sys/class/graphics/fbcon/rotate", "r");
+        if(file != NULL) {
+            if(fscanf(file, "%i", &quarters) != 1)
+                quarters = 0;
+            fclose(file);
+        }
+    }
+    return (quarters & 3) * 90;
+}
+
+// Opens the display with the given settings, sets it up for drawing and enters noncanonical input
+// mode. max_mem limits the memory used for buffers (0 for no limit). Returns 0 on failure
+int fb_open(struct fb_device* dev, size_t max_mem, const struct fb_settings* settings) {
+    memset(dev, 0, sizeof(struct fb_device));
+    dev->keys = settings->keys;
+    enum fb_backend backend = settings->backend;
+    if(backend == FB_BACKEND_MOCK) // Headless, so the terminal is left alone
+        return fb_open_mock(dev, max_mem, settings);
+    if(backend == FB_BACKEND_AUTO || backend == FB_BACKEND_DRM) {
+        // Only worth complaining about if DRM was asked for, auto falls back to fbdev
+        if(!fb_open_drm(dev, max_mem, backend == FB_BACKEND_DRM)) {
+            if(backend == FB_BACKEND_DRM) {
+                fprintf(stderr, "drm_open@fb_open: Could not open a DRM device with a connected display!\n");
+                return 0;
+            }
+            // Falling back to fbdev, the key script is kept
+            memset(dev, 0, sizeof(struct fb_device));
+            dev->keys = settings->keys;
+        }
+    }
+    if(!dev->is_drm && !fb_open_fbdev(dev, max_mem))
+        return 0;
 
     // Hide cursor
     printf("\033[?25l");
-    
-    // Copy buffer
-    memcpy(fb_mem_old, fb_mem, fb_buflen);
+    fflush(stdout);
 
     // Enter noncanonical input mode
-    struct termios termio_old, termio_new;
-    tcgetattr(STDIN_FILENO, &termio_old);
-    termio_new = termio_old;
+    struct termios termio_new;
+    tcgetattr(STDIN_FILENO, &dev->termio_old);
+    termio_new = dev->termio_old;
     termio_new.c_lflag &= (~ICANON & ECHOE);
     tcsetattr(STDIN_FILENO, TCSANOW, &termio_new);
 
+    return 1;
+}
+
+// Buffer to draw the next frame to
+struct fb_target* fb_get_target(struct fb_device* dev) {
+    // Double buffered DRM can only draw to the other buffer once the flip to it is done
+    if(dev->is_drm && dev->n_targets == 2)
+        drm_wait_flip(&dev->drm);
+    return &dev->targets[dev->cur_target];
+}
+
+// Shows the frame drawn to the current target
+void fb_present(struct fb_device* dev) {
+    // "Swap" buffers
+    if(dev->strategy == FB_STRATEGY_BACKBUFFER)
+        memcpy(dev->visible_mem, dev->backbuffer, dev->page_len);
+    else if(dev->is_drm) {
+        drm_flip(&dev->drm, dev->cur_target);
+        dev->cur_target = (dev->cur_target + 1) % dev->n_targets;
+    }
+    else if(dev->strategy == FB_STRATEGY_FLIP) {
+        if(!dev->is_mock) {
+            dev->var_info.yoffset = dev->cur_target * dev->var_info.yres;
+            ioctl(dev->fd, FBIOPAN_DISPLAY, &dev->var_info);
+        }
+        dev->cur_target = (dev->cur_target + 1) % dev->n_targets;
+    }
+}
+
+// Next key, from the key script if there is one (q once it runs out), or else from stdin. A key
+// script is a string of keys, each optionally preceded by a repeat count, e.g. "40l20ja40hq".
+// Returns '\0' instead if wake_fd (-1 for none) becomes readable first, which key scripts don't
+// wait for
+char fb_read_key(struct fb_device* dev, int wake_fd) {
+    if(wake_fd >= 0) {
+        struct pollfd fds[2] = {{wake_fd, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if(poll(fds, (dev->keys == NULL) ? 2 : 1, (dev->keys == NULL) ? -1 : 0) > 0 && (fds[0].revents & POLLIN))
+            return '\0';
+        // Read unbuffered, so no keys are left in stdio's buffer where poll can't see them
+        char c;
+        if(dev->keys == NULL)
+            return (read(STDIN_FILENO, &c, 1) == 1) ? c : EOF;
+    }
+    if(dev->keys == NULL)
+        return getchar();
+    if(dev->key_repeat == 0) {
+        unsigned int count = 0;
+        while(*dev->keys >= '0' && *dev->keys <= '9')
+            count = count * 10 + (*dev->keys++ - '0');
+        dev->key_repeat = (count == 0) ? 1 : count;
+    }
+    if(*dev->keys == '\0')
+        return 'q';
+    char c = *dev->keys;
+    if(--dev->key_repeat == 0)
+        ++dev->keys;
+    return c;
+}
+
+double fb_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Records a frame's times. Frames which don't fit in memory aren't recorded
+void fb_bench_add(struct fb_bench* bench, double render, double swap) {
+    if(bench->n == bench->cap) {
+        size_t cap = (bench->cap == 0) ? 256 : bench->cap * 2;
+        double* new_render = realloc(bench->render, cap * sizeof(double));
+        if(new_render == NULL)
+            return;
+        bench->render = new_render;
+        double* new_swap = realloc(bench->swap, cap * sizeof(double));
+        if(new_swap == NULL)
+            return;
+        bench->swap = new_swap;
+        bench->cap = cap;
+    }
+    bench->render[bench->n] = render;
+    bench->swap[bench->n] = swap;
+    ++bench->n;
+}
+
+int fb_bench_cmp(const void* a, const void* b) {
+    double da = *(const double*)a;
+    double db = *(const double*)b;
+    return (da > db) - (da < db);
+}
+
+// Sorts times and prints their percentiles
+void fb_bench_print(const char* name, double* times, size_t n) {
+    qsort(times, n, sizeof(double), fb_bench_cmp);
+    fprintf(stderr, "%-7s p50 %8.3fms  p90 %8.3fms  p99 %8.3fms  max %8.3fms\n", name
+           , times[n / 2] * 1e3, times[n * 9 / 10] * 1e3, times[n * 99 / 100] * 1e3, times[n - 1] * 1e3);
+}
+
+void fb_bench_report(struct fb_device* dev) {
+    struct fb_bench* bench = &dev->bench;
+    if(bench->n > 0) {
+        static const char* strategies[] = {"backbuffer", "flip", "direct", "direct (no restore)"};
+        fprintf(stderr, "%zu frames at %ix%i, %i bytes per pixel, %s\n", bench->n, dev->xres, dev->yres, dev->bpp, dev->is_drm ? "DRM" : strategies[dev->strategy]);
+        double* total = malloc(bench->n * sizeof(double));
+        if(total != NULL) {
+            for(size_t n = 0; n < bench->n; ++n)
+                total[n] = bench->render[n] + bench->swap[n];
+        }
+        fb_bench_print("render:", bench->render, bench->n);
+        fb_bench_print("swap:", bench->swap, bench->n);
+        if(total != NULL)
+            fb_bench_print("frame:", total, bench->n);
+        free(total);
+    }
+    free(bench->render);
+    free(bench->swap);
+    memset(bench, 0, sizeof(struct fb_bench));
+}
+
+// Restores the screen and input mode, and closes the framebuffer. Returns 0 on failure
+int fb_close(struct fb_device* dev) {
+    if(dev->keys != NULL)
+        fb_bench_report(dev);
+    if(dev->is_mock) {
+        bitmap_free(dev->fb_mem);
+        bitmap_free(dev->fb_mem_old);
+        bitmap_free(dev->backbuffer);
+        return 1;
+    }
+
+    // Show cursor again
+    printf("\033[?25h");
+
+    // Exit noncanonical input mode
+    tcsetattr(STDIN_FILENO, TCSANOW, &dev->termio_old);
+
+    if(dev->is_drm) { // Restoring the CRTC brings the console back
+        drm_close(&dev->drm);
+        fflush(stdout);
+        return 1;
+    }
+    
+    // Restore framebuffer
+    if(dev->fb_mem_old != NULL)
+        memcpy(dev->visible_mem, dev->fb_mem_old, dev->page_len);
+    else { // Nothing to restore, leave a blank console behind
+        memset(dev->visible_mem, 0, dev->page_len);
+        printf("\033[2J\033[H");
+    }
+    fflush(stdout);
+
+    // Unmap framebuffer from memory
+    munmap(dev->fb_mem, dev->fb_buflen);
+
+    // Clean-up restore memory and backbuffer
+    bitmap_free(dev->fb_mem_old);
+    bitmap_free(dev->backbuffer);
+
+    // Restore variable framebuffer info
+    if(ioctl(dev->fd, FBIOPUT_VSCREENINFO, &dev->restore_info) == -1) {
+        close(dev->fd); // Clean-up
+        fprintf(stderr, "ioctl@fb_close: Could not set restore framebuffer info!\n");
+        return 0;
+    }
+
+    // Close framebuffer device
+    close(dev->fd);
+    return 1;
+}
+
+// Maps a pan key, meant in the direction the viewer sees, to the direction on a display showing
+// the image turned clockwise by degrees
+char fb_rotate_key(char c, int degrees) {
+    // Left, down, up and right, turned clockwise a quarter at a time
+    static const char keys[] = "hjklHJKL";
+    static const char turned[3][9] = {"khljKHLJ", "lkjhLKJH", "jlhkJLHK"};
+    const char* found = (c != '\0') ? strchr(keys, c) : NULL;
+    if(found == NULL || degrees <= 0 || degrees % 90 != 0 || degrees >= 360)
+        return c;
+    return turned[degrees / 90 - 1][found - keys];
+}
+
+// Views either a whole BGR bitmap (image_buffer), a run-length encoded image (rle) or a tiled image
+// (tiled), the others being NULL. max_mem limits the memory used by the viewer itself (0 for no limit)
+// and settings picks the display. overlay is the text toggled with 'a' and hud the performance HUD
+// toggled with 'p' (NULL for none). If image_buffer is still being decoded by progressive (NULL for
+// none), it's drawn again whenever more of it is, and from its run-length encoded copy once it's
+// done (if it has one). With a key script, frame times are reported on exit
+int draw_to_fb(unsigned char* image_buffer, struct rle_image* rle, struct tiled_image* tiled, size_t w, size_t h, size_t max_mem, const struct fb_settings* settings, struct overlay* overlay, struct hud* hud, struct progressive* progressive) {
+    struct fb_device dev;
+    if(!fb_open(&dev, max_mem, settings))
+        return 0;
+
     // Set up variables
     char running = 1;
     char show_help = 1;
+    char show_overlay = 0;
+    char show_hud = 0;
+    double key_time = -1; // When the key which caused the frame being drawn was read
+    int wake_fd = (progressive != NULL) ? progressive->wake_fd[0] : -1;
+    int retval = 1;
 
     // Constant variables for convenience (these should be optimised out by the compiler)
     const int move_speed = 10;
@@ -109,9 +620,11 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
     const float toolbar_fcolour = .15f;
     const unsigned char toolbar_colour_backed = toolbar_falpha * toolbar_fcolour * 255;
     const unsigned char toolbar_border_colour = toolbar_colour_backed * 0.75;
-    const size_t ll = fix_info.line_length;
-    const int xmax = var_info.xres;
-    const int ymax = var_info.yres;
+    const struct fb_rect empty_rect = {0, 0, 0, 0};
+    const int bpp = dev.bpp;
+    const size_t ll = dev.ll;
+    const int xmax = dev.xres;
+    const int ymax = dev.yres;
     int top_limit = toolbar_size;
     
     // Set-up offset variables
@@ -136,6 +649,8 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
 
     // Main loop
     while(running) {
+        double frame_start = fb_now();
+
         // Calculate positions (framebuffer)
         fb_l = off_x;
         if(fb_l < 0)
@@ -159,36 +674,82 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
         bmp_w = fb_r - fb_l;
         bmp_h = fb_b - fb_t;
 
+        // Clear what was drawn to this buffer last time and won't be drawn over now
+        struct fb_target* target = fb_get_target(&dev);
+        unsigned char* canvas = target->mem; // Buffer being drawn to
+        struct fb_rect image_rect = {fb_l, fb_t, fb_r, fb_b};
+        if((bmp_w <= 0) || (bmp_h <= 0))
+            image_rect = empty_rect;
+        size_t drawn = fb_clear_stale(canvas, ll, bpp, &target->drawn, &image_rect) * bpp;
+        target->drawn = image_rect;
+        if(!show_help && target->toolbar) { // Clear the toolbar's previous area
+            stride_memset(canvas, 0, 3, xmax * toolbar_size, bpp);
+            target->toolbar = 0;
+            drawn += (size_t)xmax * toolbar_size * bpp;
+        }
+        if(!show_overlay && target->overlay) { // Clear the overlay's previous area
+            for(int y = overlay->box_t; y < ymax; ++y)
+                stride_memset(canvas + (y * ll), 0, 3, xmax, bpp);
+            target->overlay = 0;
+            drawn += (size_t)xmax * (ymax - overlay->box_t) * bpp;
+        }
+        if(!show_hud && target->hud) { // Clear the HUD's previous area
+            for(int y = hud->box_t; y < hud->box_b; ++y)
+                stride_memset(canvas + (y * ll) + (hud->box_l * bpp), 0, 3, hud->box_r - hud->box_l, bpp);
+            target->hud = 0;
+            drawn += hud_box_bytes(hud, bpp);
+        }
+
         // Copy subimage to current buffer
         if((bmp_w > 0) && (bmp_h > 0)) {
-            for(size_t y = 0; y < bmp_h; ++y) // Copy the subimage row to the current buffer
-                stride_memcpy(backbuffer + (fb_l * bpp) + ((y + fb_t) * ll), image_buffer + ((y + bmp_y) * w * 3) + (bmp_x * 3), bmp_w, bpp, 3);
+            if(tiled != NULL) { // Copy tile by tile, decoding missing tiles
+                if(!tiled_image_blit(tiled, canvas, ll, bpp, fb_l, fb_t, bmp_x, bmp_y, bmp_w, bmp_h)) {
+                    retval = 0;
+                    break;
+                }
+            }
+            else if(rle != NULL) // Fill runs, copy the rest
+                rle_image_blit(rle, canvas, ll, bpp, fb_l, fb_t, bmp_x, bmp_y, bmp_w, bmp_h);
+            else {
+                if(progressive != NULL) { // Tell the decoder what to decode next
+                    progressive_set_view(progressive, bmp_x, bmp_y, bmp_w, bmp_h);
+                    pthread_mutex_lock(&progressive->lock);
+                }
+                for(size_t y = 0; y < bmp_h; ++y) // Copy the subimage row to the current buffer
+                    stride_memcpy(canvas + (fb_l * bpp) + ((y + fb_t) * ll), image_buffer + ((y + bmp_y) * w * 3) + (bmp_x * 3), bmp_w, bpp, 3);
+                if(progressive != NULL)
+                    pthread_mutex_unlock(&progressive->lock);
+            }
+            drawn += (size_t)bmp_w * bmp_h * bpp;
         }
 
         // Print .-@~:fancy:~@-. version of the help toolbar
         if(show_help) {
+            target->toolbar = 1;
+            drawn += (size_t)xmax * toolbar_size * bpp;
+
             // Do the transparent toolbar box
             for(size_t y = 0; y < toolbar_size; ++y) {
                 if(y + toolbar_border_thickness >= toolbar_size)
-                    stride_memset(backbuffer + (y * ll), toolbar_border_colour, 3, xmax, bpp);
+                    stride_memset(canvas + (y * ll), toolbar_border_colour, 3, xmax, bpp);
                 else { // This should be very expensive as it is alpha blending on CPU, so beware
-                    if((y < fb_t) || (y > fb_b)) // Cheaper, non-blending version
-                        stride_memset(backbuffer + (y * ll), toolbar_colour_backed, 3, xmax, bpp);
+                    if((y < fb_t) || (y >= fb_b)) // Cheaper, non-blending version
+                        stride_memset(canvas + (y * ll), toolbar_colour_backed, 3, xmax, bpp);
                     else {
                         // Part before image intersection
                         if(fb_l > 0)
-                            stride_memset(backbuffer + (y * ll), toolbar_colour_backed, 3, fb_l, bpp);
+                            stride_memset(canvas + (y * ll), toolbar_colour_backed, 3, fb_l, bpp);
                         // Image intersection (Blend here)
                         // Alpha blending: RGB=alpha * srcRGB + destRGB * (1 - alpha) == RGB=backed_srcRGB + destRGB * alpha_spare
-                        for(size_t x = fb_l; x <= fb_r; ++x) {
+                        for(size_t x = fb_l; x < fb_r; ++x) {
                             const size_t off = (y * ll) + (x * bpp);
-                            backbuffer[off] = toolbar_colour_backed + backbuffer[off] * toolbar_falpha_spare;
-                            backbuffer[off + 1] = toolbar_colour_backed + backbuffer[off + 1] * toolbar_falpha_spare;
-                            backbuffer[off + 2] = toolbar_colour_backed + backbuffer[off + 2] * toolbar_falpha_spare;
+                            canvas[off] = toolbar_colour_backed + canvas[off] * toolbar_falpha_spare;
+                            canvas[off + 1] = toolbar_colour_backed + canvas[off + 1] * toolbar_falpha_spare;
+                            canvas[off + 2] = toolbar_colour_backed + canvas[off + 2] * toolbar_falpha_spare;
                         }
                         // Part after image intersection
                         if(fb_r < xmax)
-                            stride_memset(backbuffer + (y * ll) + (fb_r * bpp), toolbar_colour_backed, 3, xmax - fb_r, bpp);
+                            stride_memset(canvas + (y * ll) + (fb_r * bpp), toolbar_colour_backed, 3, xmax - fb_r, bpp);
                     }
                 }
             }
@@ -198,28 +759,61 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
                 for(size_t y = 0; y < termkcd_fb_help_text_height; ++y) {
                     if(termkcd_fb_help_text[y * termkcd_fb_help_text_width + x] != 0) {
                         for(int n = 0; n < toolbar_text_thickness; ++n)
-                            stride_memset(backbuffer + ((y * toolbar_text_thickness + toolbar_text_off_y + n) * ll) + ((x * toolbar_text_thickness + toolbar_text_off_x) * bpp), 255, 3, 2, bpp);
+                            stride_memset(canvas + ((y * toolbar_text_thickness + toolbar_text_off_y + n) * ll) + ((x * toolbar_text_thickness + toolbar_text_off_x) * bpp), 255, 3, 2, bpp);
                     }
                 }
             }
         }
         // End of .-@~:fancyness:~@-. (im bad at this fancy nonsense, ok?)
 
-        // "Swap" buffers
-        memcpy(fb_mem, backbuffer, fb_buflen);
+        // Title and alt text
+        if(show_overlay) {
+            if(!overlay_draw(overlay, canvas, ll, bpp, xmax, ymax, toolbar_colour_backed)) {
+                retval = 0;
+                break;
+            }
+            target->overlay = 1;
+            drawn += (size_t)xmax * (ymax - overlay->box_t) * bpp;
+        }
 
-        // Clear screen (only in area at which the comic strip was drawn)
-        if((bmp_w > 0) && (bmp_h > 0)) {
-            for(size_t y = 0; y < bmp_h; ++y)
-                stride_memset(backbuffer + (fb_l * bpp) + ((y + fb_t) * ll), 0, 3, bmp_w, bpp);
+        // Last frame's figures
+        if(show_hud) {
+            if(!hud_draw(hud, canvas, ll, bpp, xmax, ymax, toolbar_size, toolbar_colour_backed)) {
+                retval = 0;
+                break;
+            }
+            target->hud = 1;
+            drawn += hud_box_bytes(hud, bpp);
         }
 
+        double render_end = fb_now();
+        fb_present(&dev);
+        double present_end = fb_now();
+        if(dev.keys != NULL)
+            fb_bench_add(&dev.bench, render_end - frame_start, present_end - render_end);
+        if(hud != NULL) // With a backbuffer, the whole page is copied to display memory
+            hud_frame(hud, frame_start, render_end, present_end, key_time, drawn, (dev.strategy == FB_STRATEGY_BACKBUFFER) ? dev.page_len : drawn);
+
         // Get keyboard input
         char wait_for_char = 1;
         while(wait_for_char) {
             int old_off_x = off_x;
             int old_off_y = off_y;
-            char c = getchar();
+            char c = fb_read_key(&dev, wake_fd);
+            if(c == '\0' && wake_fd >= 0) { // More of the image was decoded
+                wake_fd = progressive_woken(progressive);
+                if(wake_fd < 0) { // Done, so the bitmap won't change anymore
+                    if(hud != NULL)
+                        hud->decode = progressive->decode;
+                    if(progressive->has_rle)
+                        rle = &progressive->rle;
+                    progressive = NULL;
+                }
+                key_time = -1;
+                break;
+            }
+            c = fb_rotate_key(c, settings->rotate);
+            key_time = fb_now();
             switch(c) {
             case 'q':
             case 'Q':
@@ -267,15 +861,23 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
                 else if((off_y + (int)(h)) > ymax)
                     off_y = ymax - (int)(h);
                 break;
+            case 'a':
+            case 'A':
+                if(overlay != NULL) {
+                    show_overlay = !show_overlay;
+                    wait_for_char = 0;
+                }
+                break;
+            case 'p':
+            case 'P':
+                if(hud != NULL) {
+                    show_hud = !show_hud;
+                    wait_for_char = 0;
+                }
+                break;
             case 'w':
             case 'W':
-                if(show_help) {
-                    show_help = 0;
-                    // Clear the toolbar's previous area
-                    stride_memset(backbuffer, 0, 3, xmax * top_limit, bpp);
-                }
-                else
-                    show_help = 1;
+                show_help = !show_help;
                 // Update top_limit
                 top_limit = toolbar_size * show_help;
                 // Update Y offset according to top_limit (just like when moving up)
@@ -294,33 +896,10 @@ int draw_to_fb(unsigned char* image_buffer, size_t w, size_t h) {
         }
     }
 
-    // Show cursor again
-    printf("\033[?25h");
-
-    // Exit noncanonical input mode
-    tcsetattr(STDIN_FILENO, TCSANOW, &termio_old);
-    
-    // Restore framebuffer
-    memcpy(fb_mem, fb_mem_old, fb_buflen);
-
-    // Unmap framebuffer from memory
-    munmap(fb_mem, fb_buflen);
-
-    // Clean-up restore memory and backbuffer
-    free(fb_mem_old);
-    free(backbuffer);
-
-    // Restore variable framebuffer info
-    if(ioctl(fd, FBIOPUT_VSCREENINFO, &restore_info) == -1) {
-        close(fd); // Clean-up
-        fprintf(stderr, "ioctl@draw_to_fb: Could not set restore framebuffer info!\n");
+    if(!fb_close(&dev))
         return 0;
-    }
-
-    // Close framebuffer device
-    close(fd);
 
-    return 1;
+    return retval;
 }
 
 #endif
@@ -0,0 +1,133 @@
+#ifndef TERMKCD_HUD_H
+#define TERMKCD_HUD_H
+
+// Performance HUD for the framebuffer viewer, toggled with 'p', for finding out which stage is
+// slow on the device itself: drawing and presenting frames, the frame rate while panning, bytes
+// written per frame, the latency from a key press to its frame being presented, and where the
+// comic's time went before it reached the viewer. Figures are for the last frame presented. Text
+// is drawn with the overlay's glyph atlas into a fixed-size box, so it costs a few memcpys per
+// glyph row and never changes the area it has to clear.
+
+#include "overlay.h"
+
+#define HUD_LINES 4
+#define HUD_COLS 44         // Box width, in glyphs
+#define HUD_MARGIN 8        // Space between the box and the screen's edge, in pixels
+#define HUD_FPS_WINDOW 1.0  // Seconds of presented frames the frame rate is averaged over
+#define HUD_HISTORY 64      // Presents remembered for the frame rate
+
+struct hud {
+    // Before the viewer, in seconds (negative if the stage didn't happen, e.g. a cached comic
+    // isn't downloaded)
+    double download;        // Waiting for the image to download
+    double decode;          // Decoding it (or loading it from the cache)
+    double prepare;         // Rotating and run-length encoding it
+    // Last frame, in seconds
+    double render;
+    double present;
+    double latency;         // Key press to present, negative if the frame wasn't caused by a key
+    size_t drawn;           // Bytes drawn to the frame
+    size_t written;         // Bytes written to display memory (more than drawn with a backbuffer)
+    double presents[HUD_HISTORY]; // When recent frames were presented, as a ring
+    size_t n_presents;
+    struct overlay glyphs;  // Only its atlas is used
+    int box_l;              // Area the box was last drawn to
+    int box_t;
+    int box_r;
+    int box_b;
+};
+
+void hud_init(struct hud* hud, double download, double decode) {
+    memset(hud, 0, sizeof(struct hud));
+    hud->download = download;
+    hud->decode = decode;
+    hud->prepare = -1;
+    hud->latency = -1;
+}
+
+void hud_free(struct hud* hud) {
+    overlay_free(&hud->glyphs);
+}
+
+// Records a presented frame. key_time is when the key which caused it was read (negative for none)
+void hud_frame(struct hud* hud, double frame_start, double render_end, double present_end, double key_time, size_t drawn, size_t written) {
+    hud->render = render_end - frame_start;
+    hud->present = present_end - render_end;
+    hud->latency = (key_time >= 0) ? present_end - key_time : -1;
+    hud->drawn = drawn;
+    hud->written = written;
+    hud->presents[hud->n_presents++ % HUD_HISTORY] = present_end;
+}
+
+// Frames per second over the last HUD_FPS_WINDOW seconds of presents, 0 if there aren't enough
+double hud_fps(struct hud* hud) {
+    if(hud->n_presents < 2)
+        return 0;
+    size_t last = (hud->n_presents - 1) % HUD_HISTORY;
+    size_t n = 1;
+    double first = hud->presents[last];
+    while(n < hud->n_presents && n < HUD_HISTORY) {
+        double t = hud->presents[(hud->n_presents - 1 - n) % HUD_HISTORY];
+        if(hud->presents[last] - t > HUD_FPS_WINDOW)
+            break;
+        first = t;
+        ++n;
+    }
+    return (n < 2) ? 0 : (n - 1) / (hud->presents[last] - first);
+}
+
+// Formats a time in milliseconds, or a dash if it's negative
+void hud_format_ms(char* buf, size_t len, double seconds) {
+    if(seconds < 0)
+        snprintf(buf, len, "-");
+    else
+        snprintf(buf, len, "%.2fms", seconds * 1e3);
+}
+
+// Draws the HUD in the top right corner of a xres wide screen, below top. Returns 0 if out of memory
+int hud_draw(struct hud* hud, unsigned char* canvas, size_t ll, int bpp, int xres, int yres, int top, unsigned char bg) {
+    if(hud->glyphs.bpp != bpp && !overlay_make_atlas(&hud->glyphs, bpp, bg))
+        return 0;
+    int box_w = HUD_COLS * hud->glyphs.cell_w + 2 * OVERLAY_PADDING;
+    int box_h = HUD_LINES * hud->glyphs.cell_h + 2 * OVERLAY_PADDING;
+    hud->box_l = xres - box_w - HUD_MARGIN;
+    hud->box_t = top + HUD_MARGIN;
+    hud->box_r = xres - HUD_MARGIN;
+    hud->box_b = top + HUD_MARGIN + box_h;
+    if(hud->box_l < 0 || hud->box_b > yres) { // Doesn't fit
+        hud->box_l = hud->box_t = hud->box_r = hud->box_b = 0;
+        return 1;
+    }
+
+    // Lines longer than the box are cut
+    char lines[HUD_LINES][HUD_COLS * 2];
+    char a[16], b[16], c[16];
+    hud_format_ms(a, sizeof(a), hud->render + hud->present);
+    hud_format_ms(b, sizeof(b), hud->render);
+    hud_format_ms(c, sizeof(c), hud->present);
+    snprintf(lines[0], sizeof(lines[0]), "frame %s (draw %s, show %s)", a, b, c);
+    double fps = hud_fps(hud);
+    hud_format_ms(a, sizeof(a), hud->latency);
+    if(fps > 0)
+        snprintf(lines[1], sizeof(lines[1]), "%.1f fps, key to screen %s", fps, a);
+    else
+        snprintf(lines[1], sizeof(lines[1]), "- fps, key to screen %s", a);
+    snprintf(lines[2], sizeof(lines[2]), "drawn %.2fMB, to display %.2fMB", hud->drawn / 1048576., hud->written / 1048576.);
+    hud_format_ms(a, sizeof(a), hud->download);
+    hud_format_ms(b, sizeof(b), hud->decode);
+    hud_format_ms(c, sizeof(c), hud->prepare);
+    snprintf(lines[3], sizeof(lines[3]), "get %s, decode %s, prep %s", a, b, c);
+
+    for(int y = hud->box_t; y < hud->box_b; ++y)
+        stride_memset(canvas + (y * ll) + (hud->box_l * bpp), bg, 3, box_w, bpp);
+    for(int l = 0; l < HUD_LINES; ++l)
+        overlay_draw_text(&hud->glyphs, canvas, ll, bpp, hud->box_l + OVERLAY_PADDING, hud->box_t + OVERLAY_PADDING + l * hud->glyphs.cell_h, lines[l], (strlen(lines[l]) < HUD_COLS) ? strlen(lines[l]) : HUD_COLS);
+    return 1;
+}
+
+// Bytes the HUD's box covers
+size_t hud_box_bytes(struct hud* hud, int bpp) {
+    return (size_t)(hud->box_r - hud->box_l) * (hud->box_b - hud->box_t) * bpp;
+}
+
+#endif
@@ -13,7 +13,14 @@ enum file_ext {
     FILE_EXT_JPEG
 };
 
-void read_callback_png(png_structp png_ptr, png_bytep out_data, png_uint_32 size) {
+// Custom IO for reading PNG files from memory (or a mapped file)
+struct png_source {
+    const char* ptr;
+    size_t i;       // Next byte to read
+    size_t len;
+};
+
+void read_callback_png(png_structp png_ptr, png_bytep out_data, png_size_t size) {
     // Read the png file from memory
     // Notes:
     // - This was a pain in the ass to do as, contrary to what most online guides say,
@@ -23,20 +30,53 @@ void read_callback_png(png_structp png_ptr, png_bytep out_data, png_uint_32 size
     //   read. This must be tracked by your custom I/O system.
 
     // Get custom IO struct pointer
-    struct mem_block* io_ptr = png_get_io_ptr(png_ptr);
+    struct png_source* io_ptr = png_get_io_ptr(png_ptr);
     if(io_ptr == NULL) {
         png_error(png_ptr, "png_get_io_ptr@read_callback_png: Could not retreive io_ptr!\n");
         return;
     }
+    // Truncated files must not be read past their end (which, for mapped files, isn't even memory)
+    if(size > io_ptr->len - io_ptr->i) {
+        png_error(png_ptr, "@read_callback_png: Unexpected end of file!\n");
+        return;
+    }
     // Copy data from custom IO to out_data
     memcpy(out_data, io_ptr->ptr + io_ptr->i, size);
     // Update current char in custom IO
     io_ptr->i += size;
 }
 
-unsigned char* load_png(char* png_buf, size_t png_buf_len, png_uint_32* w, png_uint_32* h) {
+// Sets up libpng to read any PNG as 8-bit BGR, without alpha
+void png_set_bgr8(png_structp png_ptr, int colour_type, int bit_depth) {
+    // Convert to correct bit depth
+    if(bit_depth == 16)
+        png_set_strip_16(png_ptr);
+    else if(bit_depth < 8)
+        png_set_packing(png_ptr);
+
+    // Strip alpha
+    png_set_strip_alpha(png_ptr);
+
+    // Convert palette images to rgb
+    if(colour_type == PNG_COLOR_TYPE_PALETTE)
+        png_set_palette_to_rgb(png_ptr);
+
+    // Expand grayscale images to full 8 bits
+    if(colour_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+        png_set_expand_gray_1_2_4_to_8(png_ptr);
+
+    // Convert grayscale images to rgb
+    if(colour_type == PNG_COLOR_TYPE_GRAY || colour_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+        png_set_gray_to_rgb(png_ptr);
+
+    // Use bgr instead of rgb
+    png_set_bgr(png_ptr);
+}
+
+// Decodes a PNG file into a BGR bitmap allocated with allocator. Returns NULL on failure
+unsigned char* load_png_with(char* png_buf, size_t png_buf_len, png_uint_32* w, png_uint_32* h, const struct allocator* allocator) {
     // Check PNG signature
-    if(png_sig_cmp((png_bytep)png_buf, 0, 8)) {
+    if(png_buf_len < 8 || png_sig_cmp((png_bytep)png_buf, 0, 8)) {
         // Nothing initialized so no clean-up required, just exit
         fprintf(stderr, "png_sig_cmp@load_png: PNG signature invalid!\n");
         return NULL;
@@ -58,16 +98,20 @@ unsigned char* load_png(char* png_buf, size_t png_buf_len, png_uint_32* w, png_u
         return NULL;
     }
 
+    // Set before the jump point so a broken row doesn't leak it
+    unsigned char* volatile bmp_ptr = NULL;
     if(setjmp(png_jmpbuf(png_ptr))) {
         // Clean-up before erroneous exit
         png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+        if(bmp_ptr != NULL)
+            allocator->free(bmp_ptr, allocator->user);
         fprintf(stderr, "@load_png: An error occured while trying to read the PNG file!\n");
         return NULL;
     }
 
     // Prepare custom IO and set read callback to use memory instead of file
     // Note that we are skipping the first 8 bytes since we already checked the png signature
-    struct mem_block custom_io = {png_buf, 8};
+    struct png_source custom_io = {png_buf, 8, png_buf_len};
     png_set_read_fn(png_ptr, &custom_io, read_callback_png);
 
     // Tell libpng we already checked the signature
@@ -83,42 +127,25 @@ unsigned char* load_png(char* png_buf, size_t png_buf_len, png_uint_32* w, png_u
 
     png_get_IHDR(png_ptr, info_ptr, w, h, &bit_depth, &colour_type, NULL, NULL, NULL);
 
-    // Convert to correct bit depth
-    if(bit_depth == 16)
-        png_set_strip_16(png_ptr);
-    else if(bit_depth < 8)
-        png_set_packing(png_ptr);
-    
-    // Strip alpha
-    png_set_strip_alpha(png_ptr);
-    
-    // Convert palette images to rgb
-    if(colour_type == PNG_COLOR_TYPE_PALETTE)
-        png_set_palette_to_rgb(png_ptr);
-
-    // Expand grayscale images to full 8 bits
-    if(colour_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
-        png_set_expand_gray_1_2_4_to_8(png_ptr);
+    png_set_bgr8(png_ptr, colour_type, bit_depth);
 
-    // Convert grayscale images to rgb
-    if(colour_type == PNG_COLOR_TYPE_GRAY || colour_type == PNG_COLOR_TYPE_GRAY_ALPHA)
-        png_set_gray_to_rgb(png_ptr);
-
-    // Use bgr instead of rgb
-    png_set_bgr(png_ptr);
+    // Interlaced images are read a pass at a time, each pass going over every row
+    int passes = png_set_interlace_handling(png_ptr);
 
     // Update info
     png_read_update_info(png_ptr, info_ptr);
 
     // Allocate memory for rows
     size_t row_bytes = png_get_rowbytes(png_ptr, info_ptr);
-    unsigned char* bmp_ptr = malloc((*h) * row_bytes);
+    bmp_ptr = allocator->alloc((*h) * row_bytes, allocator->user);
     if(bmp_ptr == NULL)
         fprintf(stderr, "malloc@load_png: Out of memory!\n");
     else {
         // Read image (pixel data) row by row
-        for(size_t n = 0; n < *h; ++n)
-            png_read_row(png_ptr, (png_bytep)bmp_ptr + (n * row_bytes), NULL);
+        for(int pass = 0; pass < passes; ++pass) {
+            for(size_t n = 0; n < *h; ++n)
+                png_read_row(png_ptr, (png_bytep)bmp_ptr + (n * row_bytes), NULL);
+        }
     }
     // Stop reading
     png_read_end(png_ptr, info_ptr);
@@ -128,6 +155,10 @@ unsigned char* load_png(char* png_buf, size_t png_buf_len, png_uint_32* w, png_u
     return bmp_ptr;
 }
 
+unsigned char* load_png(char* png_buf, size_t png_buf_len, png_uint_32* w, png_uint_32* h) {
+    return load_png_with(png_buf, png_buf_len, w, h, &malloc_allocator);
+}
+
 struct jpeg_custom_error_mgr {
     struct jpeg_error_mgr pub;
     jmp_buf setjmp_buffer;
@@ -142,9 +173,11 @@ void jpeg_custom_error_exit(j_common_ptr cinfo) {
     longjmp(err_mgr_ptr->setjmp_buffer, 1);
 }
 
-unsigned char* load_jpeg(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int* w, long unsigned int* h) {
+// Decodes a JPEG file into a BGR bitmap allocated with allocator. Returns NULL on failure
+unsigned char* load_jpeg_with(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int* w, long unsigned int* h, const struct allocator* allocator) {
     // Initialize data
     struct jpeg_decompress_struct cinfo;
+    unsigned char* volatile bmp_ptr = NULL;
     struct jpeg_custom_error_mgr error_mgr;
     // Get regular error routines, but update error_exit function with custom one
     cinfo.err = jpeg_std_error(&error_mgr.pub);
@@ -154,6 +187,8 @@ unsigned char* load_jpeg(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int*
     if(setjmp(error_mgr.setjmp_buffer)) {
         // Clean-up
         jpeg_destroy_decompress(&cinfo);
+        if(bmp_ptr != NULL)
+            allocator->free(bmp_ptr, allocator->user);
         // Return no data
         return NULL;
     }
@@ -176,7 +211,12 @@ unsigned char* load_jpeg(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int*
 
     // Set up variables for decompression
     size_t row_stride = cinfo.output_width * cinfo.output_components;
-    unsigned char* bmp_ptr = malloc(row_stride * cinfo.output_height);
+    bmp_ptr = allocator->alloc(row_stride * cinfo.output_height, allocator->user);
+    if(bmp_ptr == NULL) {
+        fprintf(stderr, "malloc@load_jpeg: Out of memory!\n");
+        jpeg_destroy_decompress(&cinfo);
+        return NULL;
+    }
     unsigned char* row_buf[1];
 
     // Read scanlines one by one
@@ -199,6 +239,86 @@ unsigned char* load_jpeg(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int*
     return bmp_ptr;
 }
 
+unsigned char* load_jpeg(char* jpeg_buf, size_t jpeg_buf_len, long unsigned int* w, long unsigned int* h) {
+    return load_jpeg_with(jpeg_buf, jpeg_buf_len, w, h, &malloc_allocator);
+}
+
+// Writes a BGR bitmap as a PNG file. Returns 0 on failure
+int save_png(const char* path, unsigned char* bmp, size_t w, size_t h) {
+    FILE* file = fopen(path, "wb");
+    if(file == NULL) {
+        fprintf(stderr, "fopen@save_png: Could not open %s for writing!\n", path);
+        return 0;
+    }
+
+    png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = (png_ptr != NULL) ? png_create_info_struct(png_ptr) : NULL;
+    if(info_ptr == NULL) {
+        png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+        fclose(file);
+        fprintf(stderr, "png_create_write_struct@save_png: Could not create png write struct!\n");
+        return 0;
+    }
+
+    if(setjmp(png_jmpbuf(png_ptr))) {
+        // Clean-up before erroneous exit
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        fclose(file);
+        fprintf(stderr, "@save_png: An error occured while trying to write the PNG file!\n");
+        return 0;
+    }
+
+    png_init_io(png_ptr, file);
+    png_set_IHDR(png_ptr, info_ptr, w, h, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png_ptr, info_ptr);
+    // Bitmaps are BGR
+    png_set_bgr(png_ptr);
+    for(size_t n = 0; n < h; ++n)
+        png_write_row(png_ptr, (png_bytep)bmp + (n * w * 3));
+    png_write_end(png_ptr, info_ptr);
+
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return fclose(file) == 0;
+}
+
+// Writes a BGR bitmap as a binary PPM file. Returns 0 on failure
+int save_ppm(const char* path, unsigned char* bmp, size_t w, size_t h) {
+    FILE* file = fopen(path, "wb");
+    if(file == NULL) {
+        fprintf(stderr, "fopen@save_ppm: Could not open %s for writing!\n", path);
+        return 0;
+    }
+
+    unsigned char row[w * 3];
+    int ok = fprintf(file, "P6\n%zu %zu\n255\n", w, h) > 0;
+    for(size_t y = 0; y < h && ok; ++y) {
+        // PPM is RGB
+        for(size_t x = 0; x < w; ++x) {
+            row[x * 3] = bmp[(y * w + x) * 3 + 2];
+            row[x * 3 + 1] = bmp[(y * w + x) * 3 + 1];
+            row[x * 3 + 2] = bmp[(y * w + x) * 3];
+        }
+        ok = fwrite(row, 1, w * 3, file) == w * 3;
+    }
+
+    if(fclose(file) != 0)
+        ok = 0;
+    if(!ok)
+        fprintf(stderr, "fwrite@save_ppm: Could not write %s!\n", path);
+    return ok;
+}
+
+// Gets the format of an image file from its first bytes
+enum file_ext get_file_type(const struct mem_block* file) {
+    static const unsigned char png_magic[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    static const unsigned char jpeg_magic[3] = {0xFF, 0xD8, 0xFF}; // SOI, then any marker
+    if(file->i >= sizeof(png_magic) && memcmp(file->ptr, png_magic, sizeof(png_magic)) == 0)
+        return FILE_EXT_PNG;
+    if(file->i >= sizeof(jpeg_magic) && memcmp(file->ptr, jpeg_magic, sizeof(jpeg_magic)) == 0)
+        return FILE_EXT_JPEG;
+    return FILE_EXT_UNKNOWN;
+}
+
 enum file_ext get_extension(struct mem_block* str) {
     // Gets which file extension the string has
     // 0: Unknown: !Png & !Jpeg
@@ -0,0 +1,464 @@
+#ifndef TERMKCD_INGEST_H
+#define TERMKCD_INGEST_H
+
+// Bulk ingest of comic metadata dumps: every info.0.json concatenated into one file, or one per
+// line (NDJSON). The input is classified 64 bytes at a time into bitmasks of quotes, backslashes
+// and structural characters (16 or 32 bytes per instruction with SSE2 or AVX2), escaped quotes
+// and string interiors are then found with bit arithmetic, and only the remaining structural
+// characters are visited one by one, instead of every byte going through parse_json's state
+// machine.
+
+// Include stdint for the masks
+#include <stdint.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define INGEST_BLOCK 64
+
+struct ingest_record {
+    size_t start;       // Offset of the record's opening {
+    size_t len;         // Up to and including the closing }
+    unsigned long num;  // Comic number, 0 if the record has none
+};
+
+struct ingest_index {
+    struct ingest_record* records; // Sorted by comic number
+    size_t n;
+    size_t cap;
+};
+
+// Classified bytes of a block, bit i being byte i
+struct ingest_masks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t structural; // { } [ ] : ,
+};
+
+void ingest_classify(const unsigned char* block, struct ingest_masks* masks) {
+    masks->quote = 0;
+    masks->backslash = 0;
+    masks->structural = 0;
+#if defined(__AVX2__)
+    for(int i = 0; i < INGEST_BLOCK; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(block + i));
+        // Setting bit 5 turns [ and ] into { and }
+        __m256i folded = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+        __m256i structural = _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(folded, _mm256_set1_epi8('{')), _mm256_cmpeq_epi8(folded, _mm256_set1_epi8('}'))),
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(':')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8(','))));
+        masks->quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))) << i;
+        masks->structural |= (uint64_t)(uint32_t)_mm256_movemask_epi8(structural) << i;
+    }
+#elif defined(__SSE2__)
+    for(int i = 0; i < INGEST_BLOCK; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(block + i));
+        // Setting bit 5 turns [ and ] into { and }
+        __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        __m128i structural = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(folded, _mm_set1_epi8('{')), _mm_cmpeq_epi8(folded, _mm_set1_epi8('}'))),
+            _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')), _mm_cmpeq_epi8(v, _mm_set1_epi8(','))));
+        masks->quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('"'))) << i;
+        masks->backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\\'))) << i;
+        masks->structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(structural) << i;
+    }
+#else
+    for(int i = 0; i < INGEST_BLOCK; ++i) {
+        unsigned char c = block[i];
+        if(c == '"')
+            masks->quote |= (uint64_t)1 << i;
+        else if(c == '\\')
+            masks->backslash |= (uint64_t)1 << i;
+        else if(c == '{' || c == '}' || c == '[' || c == ']' || c == ':' || c == ',')
+            masks->structural |= (uint64_t)1 << i;
+    }
+#endif
+}
+
+// Characters preceded by an odd number of backslashes. prev_escaped carries whether the first
+// character of the next block is escaped
+uint64_t ingest_escaped(uint64_t backslash, uint64_t* prev_escaped) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    backslash &= ~(*prev_escaped);
+    uint64_t follows_escape = (backslash << 1) | (*prev_escaped);
+    // Adding the start of each backslash run which begins on an odd bit carries through the run,
+    // leaving the runs' ends; comparing their parity with where they started tells odd runs apart
+    uint64_t odd_starts = backslash & ~even_bits & ~follows_escape;
+    uint64_t even_starts;
+    (*prev_escaped) = __builtin_add_overflow(odd_starts, backslash, &even_starts);
+    uint64_t invert = even_starts << 1;
+    return (even_bits ^ invert) & follows_escape;
+}
+
+// Each bit becomes the XOR of itself and every lower bit, turning quote bits into string interiors
+uint64_t ingest_prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// Record walking state, only tracking the top level of each record
+struct ingest_walker {
+    const char* data;
+    int depth;
+    char in_string;
+    char in_value;          // After a top level key's :
+    char value_is_string;
+    size_t record_start;
+    size_t string_start;
+    size_t key_start;
+    size_t key_len;
+    size_t value_start;
+    size_t value_len;
+    // Called for every top level key and value, and at the end of every record
+    void (*on_pair)(void* user, const char* key, size_t key_len, const char* value, size_t value_len, int is_string);
+    void (*on_record)(void* user, size_t start, size_t len);
+    void* user;
+};
+
+void ingest_end_value(struct ingest_walker* walker, size_t pos) {
+    if(!walker->in_value)
+        return;
+    if(!walker->value_is_string) { // Bare value (a number), up to the separator
+        walker->value_len = pos - walker->value_start;
+        while(walker->value_len > 0 && (walker->data[walker->value_start] == ' ' || walker->data[walker->value_start] == '\n' || walker->data[walker->value_start] == '\r' || walker->data[walker->value_start] == '\t')) {
+            ++walker->value_start;
+            --walker->value_len;
+        }
+    }
+    if(walker->on_pair != NULL)
+        walker->on_pair(walker->user, walker->data + walker->key_start, walker->key_len, walker->data + walker->value_start, walker->value_len, walker->value_is_string);
+    walker->in_value = 0;
+}
+
+// Handles a quote or structural character. Returns 0 if the JSON is malformed
+int ingest_token(struct ingest_walker* walker, size_t pos) {
+    char c = walker->data[pos];
+    if(c == '"') {
+        walker->in_string = !walker->in_string;
+        if(walker->depth != 1)
+            return 1;
+        if(walker->in_string)
+            walker->string_start = pos + 1;
+        else if(walker->in_value) {
+            walker->value_is_string = 1;
+            walker->value_start = walker->string_start;
+            walker->value_len = pos - walker->string_start;
+        }
+        else {
+            walker->key_start = walker->string_start;
+            walker->key_len = pos - walker->string_start;
+        }
+    }
+    else if(c == '{' || c == '[') {
+        if(walker->depth == 0) {
+            if(c == '[') // Top level arrays aren't records
+                return 0;
+            walker->record_start = pos;
+        }
+        ++walker->depth;
+    }
+    else if(c == '}' || c == ']') {
+        if(walker->depth == 0)
+            return 0;
+        if(walker->depth == 1) {
+            ingest_end_value(walker, pos);
+            if(walker->on_record != NULL)
+                walker->on_record(walker->user, walker->record_start, pos + 1 - walker->record_start);
+        }
+        --walker->depth;
+    }
+    else if(walker->depth == 1) {
+        if(c == ':') {
+            walker->in_value = 1;
+            walker->value_is_string = 0;
+            walker->value_start = pos + 1;
+        }
+        else // ,
+            ingest_end_value(walker, pos);
+    }
+    return 1;
+}
+
+// Walks every record of data. Returns 0 if it's malformed or truncated
+int ingest_walk(struct ingest_walker* walker, const char* data, size_t len) {
+    walker->data = data;
+    walker->depth = 0;
+    walker->in_string = 0;
+    walker->in_value = 0;
+
+    uint64_t prev_escaped = 0;
+    uint64_t prev_in_string = 0; // All ones if the previous block ended inside a string
+    unsigned char tail[INGEST_BLOCK];
+    for(size_t offset = 0; offset < len; offset += INGEST_BLOCK) {
+        const unsigned char* block = (const unsigned char*)data + offset;
+        if(len - offset < INGEST_BLOCK) { // Pad the last block with spaces
+            memset(tail, ' ', INGEST_BLOCK);
+            memcpy(tail, block, len - offset);
+            block = tail;
+        }
+
+        struct ingest_masks masks;
+        ingest_classify(block, &masks);
+        uint64_t quotes = masks.quote & ~ingest_escaped(masks.backslash, &prev_escaped);
+        uint64_t in_string = ingest_prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+
+        // Quotes are kept so string bounds are known
+        uint64_t tokens = (masks.structural & ~in_string) | quotes;
+        while(tokens != 0) {
+            if(!ingest_token(walker, offset + __builtin_ctzll(tokens))) {
+                fprintf(stderr, "@ingest_walk: Malformed JSON at byte %zu!\n", offset + __builtin_ctzll(tokens));
+                return 0;
+            }
+            tokens &= tokens - 1;
+        }
+    }
+    if(walker->depth != 0 || walker->in_string) {
+        fprintf(stderr, "@ingest_walk: Truncated record at byte %zu!\n", walker->record_start);
+        return 0;
+    }
+    return 1;
+}
+
+// Index building
+
+struct ingest_builder {
+    struct ingest_index* index;
+    unsigned long num;
+    char failed;
+};
+
+void ingest_builder_pair(void* user, const char* key, size_t key_len, const char* value, size_t value_len, int is_string) {
+    struct ingest_builder* builder = user;
+    if(key_len == 3 && memcmp(key, "num", 3) == 0 && !is_string) {
+        builder->num = 0;
+        for(size_t n = 0; n < value_len && value[n] >= '0' && value[n] <= '9'; ++n)
+            builder->num = builder->num * 10 + (value[n] - '0');
+    }
+}
+
+void ingest_builder_record(void* user, size_t start, size_t len) {
+    struct ingest_builder* builder = user;
+    struct ingest_index* index = builder->index;
+    if(index->n == index->cap) {
+        size_t cap = (index->cap == 0) ? 1024 : index->cap * 2;
+        struct ingest_record* records = realloc(index->records, cap * sizeof(struct ingest_record));
+        if(records == NULL) {
+            builder->failed = 1;
+            return;
+        }
+        index->records = records;
+        index->cap = cap;
+    }
+    index->records[index->n++] = (struct ingest_record){start, len, builder->num};
+    builder->num = 0;
+}
+
+int ingest_record_cmp(const void* a, const void* b) {
+    unsigned long num_a = ((const struct ingest_record*)a)->num;
+    unsigned long num_b = ((const struct ingest_record*)b)->num;
+    return (num_a > num_b) - (num_a < num_b);
+}
+
+// Indexes every record of a dump. Returns 0 if it's malformed or if out of memory
+int ingest_index_build(struct ingest_index* index, const char* data, size_t len) {
+    memset(index, 0, sizeof(struct ingest_index));
+    struct ingest_builder builder = {index, 0, 0};
+    struct ingest_walker walker;
+    walker.on_pair = ingest_builder_pair;
+    walker.on_record = ingest_builder_record;
+    walker.user = &builder;
+    int ok = ingest_walk(&walker, data, len);
+    if(builder.failed)
+        fprintf(stderr, "realloc@ingest_index_build: Out of memory!\n");
+    if(!ok || builder.failed) {
+        free(index->records);
+        index->records = NULL;
+        return 0;
+    }
+    qsort(index->records, index->n, sizeof(struct ingest_record), ingest_record_cmp);
+    return 1;
+}
+
+void ingest_index_free(struct ingest_index* index) {
+    free(index->records);
+    index->records = NULL;
+    index->n = 0;
+    index->cap = 0;
+}
+
+// Record of a comic, or of the latest one if comic is 0. NULL if it's not in the index
+struct ingest_record* ingest_find(struct ingest_index* index, unsigned long comic) {
+    if(index->n == 0)
+        return NULL;
+    if(comic == 0)
+        return &index->records[index->n - 1];
+    struct ingest_record key = {0, 0, comic};
+    return bsearch(&key, index->records, index->n, sizeof(struct ingest_record), ingest_record_cmp);
+}
+
+// Record parsing
+
+struct ingest_fields {
+    struct json_parsed* parsed;
+    char* buffer;        // Unescaped value, null-terminated
+    size_t buf_len;
+    char failed;
+};
+
+void ingest_fields_pair(void* user, const char* key, size_t key_len, const char* value, size_t value_len, int is_string) {
+    struct ingest_fields* fields = user;
+    char key_str[16];
+    if(fields->failed || key_len >= sizeof(key_str))
+        return;
+    memcpy(key_str, key, key_len);
+    key_str[key_len] = '\0';
+    struct mem_block* field = json_field(fields->parsed, key_str);
+    if(field == NULL)
+        return;
+
+    if(value_len + 1 > fields->buf_len) {
+        char* buffer = realloc(fields->buffer, value_len + 1);
+        if(buffer == NULL) {
+            fields->failed = 1;
+            return;
+        }
+        fields->buffer = buffer;
+        fields->buf_len = value_len + 1;
+    }
+
+    // Same result as parse_json: strings are unescaped, and only the digits of other values are kept
+    size_t out = 0;
+    if(is_string && memchr(value, '\\', value_len) == NULL) {
+        memcpy(fields->buffer, value, value_len);
+        out = value_len;
+    }
+    else if(is_string) {
+        for(size_t n = 0; n < value_len; ++n) {
+            if(value[n] != '\\' || n + 1 == value_len) {
+                fields->buffer[out++] = value[n];
+                continue;
+            }
+            char escaped = value[++n];
+            if(escaped == 'n')
+                fields->buffer[out++] = '\n';
+            else if(escaped == 'b')
+                fields->buffer[out++] = '\b';
+            else if(escaped == 'f')
+                fields->buffer[out++] = '\f';
+            else if(escaped == 'r')
+                fields->buffer[out++] = '\r';
+            else if(escaped == 't')
+                fields->buffer[out++] = '\t';
+            else
+                fields->buffer[out++] = escaped;
+        }
+    }
+    else {
+        for(size_t n = 0; n < value_len; ++n) {
+            if(value[n] >= '0' && value[n] <= '9')
+                fields->buffer[out++] = value[n];
+        }
+    }
+    fields->buffer[out++] = '\0';
+    if(!set_string(field, fields->buffer, out))
+        fields->failed = 1;
+}
+
+// Fills parsed from a record, like parse_json would. Returns 0 if out of memory
+int ingest_record_parse(const char* data, struct ingest_record* record, struct json_parsed* parsed) {
+    json_parsed_init(parsed);
+    struct ingest_fields fields = {parsed, NULL, 0, 0};
+    struct ingest_walker walker;
+    walker.on_pair = ingest_fields_pair;
+    walker.on_record = NULL;
+    walker.user = &fields;
+    int ok = ingest_walk(&walker, data + record->start, record->len);
+    free(fields.buffer);
+    if(fields.failed)
+        fprintf(stderr, "malloc@ingest_record_parse: Out of memory!\n");
+    return ok && !fields.failed;
+}
+
+// Reads a whole file. Returns 0 if it can't be read
+int ingest_load(const char* path, struct mem_block* out) {
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        fprintf(stderr, "fopen@ingest_load: Could not open %s!\n", path);
+        return 0;
+    }
+    long len = -1;
+    if(fseek(file, 0, SEEK_END) == 0)
+        len = ftell(file);
+    rewind(file);
+    if(len < 0) {
+        fprintf(stderr, "ftell@ingest_load: Could not get the size of %s!\n", path);
+        fclose(file);
+        return 0;
+    }
+
+    out->ptr = malloc(len + 1);
+    if(out->ptr == NULL) {
+        fprintf(stderr, "malloc@ingest_load: Out of memory!\n");
+        fclose(file);
+        return 0;
+    }
+    out->i = fread(out->ptr, 1, len, file);
+    fclose(file);
+    if(out->i != (size_t)len) {
+        fprintf(stderr, "fread@ingest_load: Could not read %s!\n", path);
+        free(out->ptr);
+        (*out) = empty_mem;
+        return 0;
+    }
+    return 1;
+}
+
+// Looks a comic (or the latest one, if 0) up in a dump, giving its raw JSON and parsed fields like a
+// download would. Returns 0 on failure
+int ingest_comic(const char* path, unsigned long comic, struct mem_block* raw, struct json_parsed* parsed, int debug) {
+    struct mem_block dump;
+    if(!ingest_load(path, &dump))
+        return 0;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct ingest_index index;
+    if(!ingest_index_build(&index, dump.ptr, dump.i)) {
+        free(dump.ptr);
+        return 0;
+    }
+    if(debug) {
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        fprintf(stderr, "@ingest_comic: Indexed %zu records (%zu bytes) in %.2fms, %.0f MB/s\n", index.n, dump.i, secs * 1e3, (secs > 0) ? dump.i / secs / 1e6 : 0);
+    }
+
+    int ok = 0;
+    struct ingest_record* record = ingest_find(&index, comic);
+    if(record == NULL)
+        fprintf(stderr, "Comic %lu isn't in %s!\n", comic, path);
+    else if((raw->ptr = malloc(record->len + 1)) == NULL)
+        fprintf(stderr, "malloc@ingest_comic: Out of memory!\n");
+    else {
+        memcpy(raw->ptr, dump.ptr + record->start, record->len);
+        raw->i = record->len;
+        ok = ingest_record_parse(dump.ptr, record, parsed);
+        if(!ok)
+            free_json(parsed);
+    }
+    ingest_index_free(&index);
+    free(dump.ptr);
+    return ok;
+}
+
+#endif
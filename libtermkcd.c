@@ -0,0 +1,314 @@
+/*
+ * 2017, Rafael Fernandes, public domain software:
+ *        ///// USE AT YOUR OWN RISK! /////
+ */
+
+// libtermkcd, built from the same headers as the program. Only the functions declared in
+// libtermkcd.h are exported (build with -fvisibility=hidden), the rest stay internal. Static
+// builds also need objcopy --localize-hidden, see the README.
+
+// General includes
+#include <stdlib.h>
+#include <stdio.h>
+
+// termkcd includes
+#include "libtermkcd.h"
+#include "memory.h"
+#include "util.h"
+#include "web.h"
+#include "image.h"
+
+struct termkcd_context {
+    struct allocator allocator;
+    CURL* handle;           // Reused by every fetch, so connections are kept alive
+};
+
+// Where a fetch writes to
+struct termkcd_sink {
+    struct termkcd_context* ctx;
+    struct termkcd_buffer* buffer;
+    char owned;             // The buffer is the library's, so it may be grown
+    char too_big;
+};
+
+int termkcd_api_version(void) {
+    return TERMKCD_API_VERSION;
+}
+
+enum termkcd_status termkcd_global_init(void) {
+    if(curl_global_init(CURL_GLOBAL_DEFAULT) != CURLE_OK) {
+        fprintf(stderr, "curl_global_init@termkcd_global_init: Could not initialize cURL!\n");
+        return TERMKCD_ERROR_NETWORK;
+    }
+    return TERMKCD_OK;
+}
+
+void termkcd_global_cleanup(void) {
+    curl_global_cleanup();
+}
+
+const char* termkcd_strerror(enum termkcd_status status) {
+    switch(status) {
+        case TERMKCD_OK:
+            return "Success";
+        case TERMKCD_ERROR_MEMORY:
+            return "Out of memory";
+        case TERMKCD_ERROR_ARGUMENT:
+            return "Invalid argument";
+        case TERMKCD_ERROR_NETWORK:
+            return "Transfer failed";
+        case TERMKCD_ERROR_TOO_BIG:
+            return "Doesn't fit in the buffer";
+        case TERMKCD_ERROR_FORMAT:
+            return "Invalid comic or image";
+    }
+    return "Unknown error";
+}
+
+enum termkcd_status termkcd_context_new(const struct termkcd_allocator* allocator, termkcd_context** ctx) {
+    struct allocator chosen = malloc_allocator;
+    if(allocator != NULL) {
+        if(allocator->alloc == NULL || allocator->free == NULL)
+            return TERMKCD_ERROR_ARGUMENT;
+        chosen = (struct allocator){allocator->alloc, allocator->free, allocator->user};
+    }
+    (*ctx) = chosen.alloc(sizeof(struct termkcd_context), chosen.user);
+    if(*ctx == NULL) {
+        fprintf(stderr, "malloc@termkcd_context_new: Out of memory!\n");
+        return TERMKCD_ERROR_MEMORY;
+    }
+    (*ctx)->allocator = chosen;
+    (*ctx)->handle = curl_easy_init();
+    if((*ctx)->handle == NULL) {
+        fprintf(stderr, "curl_easy_init@termkcd_context_new: Could not initialize cURL!\n");
+        chosen.free(*ctx, chosen.user);
+        (*ctx) = NULL;
+        return TERMKCD_ERROR_NETWORK;
+    }
+    // No signals, as the caller may have other threads; HTTP errors fail the transfer
+    curl_easy_setopt((*ctx)->handle, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt((*ctx)->handle, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt((*ctx)->handle, CURLOPT_FOLLOWLOCATION, 1L);
+    // Stalled transfers fail (with TERMKCD_ERROR_NETWORK) instead of blocking the caller forever
+    set_transfer_timeouts((*ctx)->handle);
+    return TERMKCD_OK;
+}
+
+void termkcd_context_free(termkcd_context* ctx) {
+    if(ctx == NULL)
+        return;
+    curl_easy_cleanup(ctx->handle);
+    ctx->allocator.free(ctx, ctx->allocator.user);
+}
+
+// Allocates with the context's allocator
+void* termkcd_alloc(struct termkcd_context* ctx, size_t size) {
+    void* ptr = ctx->allocator.alloc(size, ctx->allocator.user);
+    if(ptr == NULL)
+        fprintf(stderr, "malloc@termkcd_alloc: Out of memory!\n");
+    return ptr;
+}
+
+void termkcd_free(struct termkcd_context* ctx, void* ptr) {
+    if(ptr != NULL)
+        ctx->allocator.free(ptr, ctx->allocator.user);
+}
+
+size_t termkcd_write_callback(char* buf, size_t size, size_t nmemb, struct termkcd_sink* sink) {
+    struct termkcd_buffer* buffer = sink->buffer;
+    size_t len = size * nmemb;
+    if(len > buffer->cap - buffer->len) {
+        if(!sink->owned) {
+            sink->too_big = 1;
+            return len + 1; // Anything != len tells curl that an error has occured
+        }
+        // Grow by x2, the allocator having no realloc
+        size_t cap = (buffer->cap > 0) ? buffer->cap * 2 : 16384;
+        while(cap - buffer->len < len)
+            cap *= 2;
+        unsigned char* data = termkcd_alloc(sink->ctx, cap);
+        if(data == NULL)
+            return len + 1;
+        if(buffer->len > 0)
+            memcpy(data, buffer->data, buffer->len);
+        termkcd_free(sink->ctx, buffer->data);
+        buffer->data = data;
+        buffer->cap = cap;
+    }
+    memcpy(buffer->data + buffer->len, buf, len);
+    buffer->len += len;
+    return len;
+}
+
+enum termkcd_status termkcd_fetch(termkcd_context* ctx, const char* url, struct termkcd_buffer* buffer) {
+    if(url == NULL || buffer == NULL)
+        return TERMKCD_ERROR_ARGUMENT;
+    struct termkcd_sink sink = {ctx, buffer, buffer->data == NULL, 0};
+    buffer->len = 0;
+    if(sink.owned)
+        buffer->cap = 0;
+    curl_easy_setopt(ctx->handle, CURLOPT_URL, url);
+    curl_easy_setopt(ctx->handle, CURLOPT_WRITEFUNCTION, termkcd_write_callback);
+    curl_easy_setopt(ctx->handle, CURLOPT_WRITEDATA, &sink);
+    CURLcode res = curl_easy_perform(ctx->handle);
+    if(res == CURLE_OK)
+        return TERMKCD_OK;
+    if(sink.owned)
+        termkcd_buffer_free(ctx, buffer);
+    if(sink.too_big)
+        return TERMKCD_ERROR_TOO_BIG;
+    fprintf(stderr, "curl_easy_perform@termkcd_fetch: %s!\n", curl_easy_strerror(res));
+    return (res == CURLE_WRITE_ERROR) ? TERMKCD_ERROR_MEMORY : TERMKCD_ERROR_NETWORK;
+}
+
+void termkcd_buffer_free(termkcd_context* ctx, struct termkcd_buffer* buffer) {
+    termkcd_free(ctx, buffer->data);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->cap = 0;
+}
+
+// Copies a parsed JSON string with the context's allocator (empty if it wasn't there)
+char* termkcd_copy_string(struct termkcd_context* ctx, const struct mem_block* str) {
+    size_t len = (str->ptr != NULL) ? str->i : 0;
+    char* copy = termkcd_alloc(ctx, len + 1);
+    if(copy == NULL)
+        return NULL;
+    if(len > 0)
+        memcpy(copy, str->ptr, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Parses a JSON number (0 if it wasn't there or isn't a number)
+unsigned int termkcd_parse_uint(const struct mem_block* str) {
+    int error_flag = 0;
+    unsigned int res = (str->ptr != NULL) ? str_to_uint(str->ptr, &error_flag) : 0;
+    return (error_flag == 1 || error_flag == 2) ? 0 : res;
+}
+
+enum termkcd_status termkcd_fetch_comic(termkcd_context* ctx, unsigned long num, struct termkcd_comic* comic) {
+    if(comic == NULL)
+        return TERMKCD_ERROR_ARGUMENT;
+    memset(comic, 0, sizeof(struct termkcd_comic));
+    char url[COMIC_JSON_URL_LEN];
+    comic_json_url(url, num);
+    struct termkcd_buffer raw = {NULL, 0, 0};
+    enum termkcd_status status = termkcd_fetch(ctx, url, &raw);
+    if(status != TERMKCD_OK)
+        return status;
+
+    struct mem_block raw_mem = {(char*)raw.data, raw.len};
+    struct json_parsed parsed;
+    int ok = parse_json(&raw_mem, &parsed, 0);
+    termkcd_buffer_free(ctx, &raw);
+    if(!ok || parsed.num.ptr == NULL) {
+        free_json(&parsed);
+        if(ok)
+            fprintf(stderr, "@termkcd_fetch_comic: Not a comic!\n");
+        return ok ? TERMKCD_ERROR_FORMAT : TERMKCD_ERROR_MEMORY;
+    }
+
+    comic->num = termkcd_parse_uint(&parsed.num);
+    comic->year = termkcd_parse_uint(&parsed.year);
+    comic->month = termkcd_parse_uint(&parsed.month);
+    comic->day = termkcd_parse_uint(&parsed.day);
+    comic->title = termkcd_copy_string(ctx, &parsed.title);
+    comic->safe_title = termkcd_copy_string(ctx, &parsed.safe_title);
+    comic->alt = termkcd_copy_string(ctx, &parsed.alt);
+    comic->img = termkcd_copy_string(ctx, &parsed.img);
+    comic->transcript = termkcd_copy_string(ctx, &parsed.transcript);
+    comic->link = termkcd_copy_string(ctx, &parsed.link);
+    comic->news = termkcd_copy_string(ctx, &parsed.news);
+    free_json(&parsed);
+    if(comic->title == NULL || comic->safe_title == NULL || comic->alt == NULL || comic->img == NULL || comic->transcript == NULL || comic->link == NULL || comic->news == NULL) {
+        termkcd_comic_free(ctx, comic);
+        return TERMKCD_ERROR_MEMORY;
+    }
+    return TERMKCD_OK;
+}
+
+void termkcd_comic_free(termkcd_context* ctx, struct termkcd_comic* comic) {
+    termkcd_free(ctx, comic->title);
+    termkcd_free(ctx, comic->safe_title);
+    termkcd_free(ctx, comic->alt);
+    termkcd_free(ctx, comic->img);
+    termkcd_free(ctx, comic->transcript);
+    termkcd_free(ctx, comic->link);
+    termkcd_free(ctx, comic->news);
+    memset(comic, 0, sizeof(struct termkcd_comic));
+}
+
+enum termkcd_status termkcd_decode(termkcd_context* ctx, const void* data, size_t len, struct termkcd_image* image) {
+    if(data == NULL || image == NULL)
+        return TERMKCD_ERROR_ARGUMENT;
+    image->pixels = NULL;
+    image->width = image->height = 0;
+    struct mem_block file = {(char*)data, len};
+    enum file_ext extension = get_file_type(&file);
+    if(extension == FILE_EXT_PNG) {
+        png_uint_32 w, h;
+        image->pixels = load_png_with(file.ptr, len, &w, &h, &ctx->allocator);
+        image->width = w;
+        image->height = h;
+    }
+    else if(extension == FILE_EXT_JPEG) {
+        long unsigned int w, h;
+        image->pixels = load_jpeg_with(file.ptr, len, &w, &h, &ctx->allocator);
+        image->width = w;
+        image->height = h;
+    }
+    else
+        fprintf(stderr, "@termkcd_decode: Unknown image type!\n");
+    if(image->pixels == NULL) {
+        image->width = image->height = 0;
+        return TERMKCD_ERROR_FORMAT;
+    }
+    return TERMKCD_OK;
+}
+
+void termkcd_image_free(termkcd_context* ctx, struct termkcd_image* image) {
+    termkcd_free(ctx, image->pixels);
+    image->pixels = NULL;
+    image->width = image->height = 0;
+}
+
+// Places the image along one axis: first is the surface position its first shown pixel goes to,
+// from the image position it starts at, n the pixels shown
+void termkcd_place(size_t image_len, size_t surface_len, long pan, size_t* first, size_t* from, size_t* n) {
+    if(image_len <= surface_len) { // Centred
+        (*first) = (surface_len - image_len) / 2;
+        (*from) = 0;
+        (*n) = image_len;
+    }
+    else if(pan < 0) { // Panned past the start
+        (*first) = ((size_t)-pan < surface_len) ? (size_t)-pan : surface_len;
+        (*from) = 0;
+        (*n) = (surface_len - *first < image_len) ? surface_len - *first : image_len;
+    }
+    else {
+        (*first) = 0;
+        (*from) = ((size_t)pan < image_len) ? (size_t)pan : image_len;
+        (*n) = (image_len - *from < surface_len) ? image_len - *from : surface_len;
+    }
+}
+
+enum termkcd_status termkcd_render(const struct termkcd_image* image, const struct termkcd_surface* surface, long x, long y) {
+    if(image == NULL || surface == NULL || surface->pixels == NULL || (surface->bpp != 3 && surface->bpp != 4) || surface->stride < surface->width * surface->bpp)
+        return TERMKCD_ERROR_ARGUMENT;
+    size_t left, from_x, n_x, top, from_y, n_y;
+    termkcd_place(image->width, surface->width, x, &left, &from_x, &n_x);
+    termkcd_place(image->height, surface->height, y, &top, &from_y, &n_y);
+    const int bpp = surface->bpp;
+    for(size_t row = 0; row < surface->height; ++row) {
+        unsigned char* dest = surface->pixels + (row * surface->stride);
+        if(row < top || row >= top + n_y) { // Nothing of the image in this row
+            stride_memset(dest, 0, 3, surface->width, bpp);
+            continue;
+        }
+        stride_memset(dest, 0, 3, left, bpp);
+        stride_memcpy(dest + (left * bpp), image->pixels + (((from_y + row - top) * image->width + from_x) * 3), n_x, bpp, 3);
+        stride_memset(dest + ((left + n_x) * bpp), 0, 3, surface->width - left - n_x, bpp);
+    }
+    return TERMKCD_OK;
+}
@@ -0,0 +1,122 @@
+#ifndef LIBTERMKCD_H
+#define LIBTERMKCD_H
+
+// libtermkcd: termkcd's comic fetching, decoding and drawing as a library, so other programs
+// can use them in-process instead of running termkcd for every lookup.
+//
+// Everything goes through a context, which owns a connection (kept alive between calls) and the
+// allocator used for all memory handed back to the caller. Contexts are independent of each
+// other, so every thread can have its own, but one context must not be used by two threads at
+// once. The library has no global state of its own, but libcurl does: call termkcd_global_init
+// once, before any thread makes a context.
+//
+// Functions return a status; on errors, a description is also printed to stderr, like in the
+// program. Within an API version, existing functions and structs don't change.
+
+// Include stddef for size_t
+#include <stddef.h>
+
+#define TERMKCD_API_VERSION 1
+
+#if defined(__GNUC__)
+#define TERMKCD_API __attribute__((visibility("default")))
+#else
+#define TERMKCD_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum termkcd_status {
+    TERMKCD_OK,
+    TERMKCD_ERROR_MEMORY,   // Out of memory
+    TERMKCD_ERROR_ARGUMENT, // Invalid argument
+    TERMKCD_ERROR_NETWORK,  // Transfer failed (including HTTP errors)
+    TERMKCD_ERROR_TOO_BIG,  // Doesn't fit in the caller's buffer
+    TERMKCD_ERROR_FORMAT    // Not a comic or an image termkcd can decode
+};
+
+// Allocator for everything the library hands back. user is passed to both functions
+struct termkcd_allocator {
+    void* (*alloc)(size_t size, void* user);
+    void (*free)(void* ptr, void* user);
+    void* user;
+};
+
+// Fetched file. If data is NULL, it's allocated with the context's allocator (and must be freed
+// with termkcd_buffer_free), otherwise it's the caller's and the file must fit in cap bytes
+struct termkcd_buffer {
+    unsigned char* data;
+    size_t len;             // Bytes fetched
+    size_t cap;             // Size of data
+};
+
+// Comic metadata. Strings are NUL terminated (empty if the comic doesn't have the field)
+struct termkcd_comic {
+    unsigned long num;
+    unsigned int year;
+    unsigned int month;
+    unsigned int day;
+    char* title;
+    char* safe_title;
+    char* alt;
+    char* img;              // Image URL
+    char* transcript;
+    char* link;
+    char* news;
+};
+
+// Decoded image, as packed BGR rows (3 bytes per pixel)
+struct termkcd_image {
+    unsigned char* pixels;
+    size_t width;
+    size_t height;
+};
+
+// Caller's pixels to draw to
+struct termkcd_surface {
+    unsigned char* pixels;
+    size_t width;
+    size_t height;
+    size_t stride;          // Bytes from a row to the next
+    int bpp;                // Bytes per pixel: 3 for BGR, 4 for BGRX (the 4th byte is left alone)
+};
+
+typedef struct termkcd_context termkcd_context;
+
+// TERMKCD_API_VERSION of the library loaded, which may differ from the header's
+TERMKCD_API int termkcd_api_version(void);
+
+// Sets up (and tears down) libcurl. Call once per process, while no other thread uses libcurl
+TERMKCD_API enum termkcd_status termkcd_global_init(void);
+TERMKCD_API void termkcd_global_cleanup(void);
+
+TERMKCD_API const char* termkcd_strerror(enum termkcd_status status);
+
+// Makes a context. allocator may be NULL for malloc and free; otherwise it's copied
+TERMKCD_API enum termkcd_status termkcd_context_new(const struct termkcd_allocator* allocator, termkcd_context** ctx);
+TERMKCD_API void termkcd_context_free(termkcd_context* ctx);
+
+// Fetches a URL into buffer
+TERMKCD_API enum termkcd_status termkcd_fetch(termkcd_context* ctx, const char* url, struct termkcd_buffer* buffer);
+TERMKCD_API void termkcd_buffer_free(termkcd_context* ctx, struct termkcd_buffer* buffer);
+
+// Fetches a comic's metadata (0 for the latest comic)
+TERMKCD_API enum termkcd_status termkcd_fetch_comic(termkcd_context* ctx, unsigned long num, struct termkcd_comic* comic);
+TERMKCD_API void termkcd_comic_free(termkcd_context* ctx, struct termkcd_comic* comic);
+
+// Decodes a PNG or JPEG file (told apart by its first bytes) into image
+TERMKCD_API enum termkcd_status termkcd_decode(termkcd_context* ctx, const void* data, size_t len, struct termkcd_image* image);
+TERMKCD_API void termkcd_image_free(termkcd_context* ctx, struct termkcd_image* image);
+
+// Draws image to surface, panned so its pixel (x, y) is at the surface's top left corner. Along
+// axes where the image is smaller than the surface, it's centred instead, like in the viewer. The
+// rest of the surface is cleared to black
+TERMKCD_API enum termkcd_status termkcd_render(const struct termkcd_image* image, const struct termkcd_surface* surface, long x, long y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,6 +3,9 @@
  *        ///// USE AT YOUR OWN RISK! /////
  */
 
+// For struct ucred, to check who runs the daemon
+#define _GNU_SOURCE
+
 // General includes
 #include <stdlib.h>
 #include <stdio.h>
@@ -10,9 +13,20 @@
 // termkcd includes
 #include "memory.h"
 #include "util.h"
+#include "bitmap.h"
 #include "web.h"
+#include "download.h"
 #include "image.h"
+#include "rle.h"
+#include "progressive.h"
+#include "tile.h"
 #include "framebuffer.h"
+#include "daemon.h"
+#include "thumbnail.h"
+#include "terminal.h"
+#include "ingest.h"
+#include "watch.h"
+#include "cache.h"
 
 // Commit changes:
 //  #1:
@@ -68,6 +82,364 @@
 // - Make code more DRY, by generalising functions (especially memory.h functions)
 // - ... basically do a major code cleanup!
 
+// Comic JSON downloaded directly, parsed while it arrives so the image download can start as soon
+// as its URL is known. xkcd puts img after the transcript and alt, with only title and day left,
+// so this only overlaps the image request with the end of the JSON transfer
+struct json_stream {
+    struct json_parser parser;
+    struct json_parsed parsed;
+    size_t fed;               // Bytes of the download parsed so far
+    char ok;                  // Parser hasn't failed
+    struct dl_scheduler* sched;
+    char prefetch;            // Start downloading the image early
+    struct dl_job* img_job;
+    const char* cache_dir;    // Image cache, where the image may not need downloading at all
+};
+
+void json_stream_on_value(struct json_parser* parser, const char* key, struct mem_block* value) {
+    struct json_stream* stream = parser->user;
+    if(stream->cache_dir != NULL && strcmp(key, "num") == 0 && cache_has(stream->cache_dir, strtoul(value->ptr, NULL, 10)))
+        stream->prefetch = 0;
+    if(stream->prefetch && stream->img_job == NULL && strcmp(key, "img") == 0 && get_extension(value) != FILE_EXT_UNKNOWN)
+        stream->img_job = dl_submit(stream->sched, value->ptr, DL_PRIORITY_VISIBLE);
+}
+
+int json_stream_reset(struct json_stream* stream, int debug) {
+    stream->fed = 0;
+    stream->ok = json_parser_init(&stream->parser, &stream->parsed, debug);
+    stream->parser.on_value = json_stream_on_value;
+    stream->parser.user = stream;
+    return stream->ok;
+}
+
+void json_stream_on_data(struct dl_job* job, size_t from) {
+    struct json_stream* stream = job->user;
+    if(from < stream->fed) { // Download started over
+        json_parser_free(&stream->parser);
+        free_json(&stream->parsed);
+        json_stream_reset(stream, stream->parser.debug);
+    }
+    if(stream->ok) {
+        stream->ok = json_parser_feed(&stream->parser, job->data.ptr + stream->fed, job->data.i - stream->fed);
+        stream->fed = job->data.i;
+    }
+}
+
+// Prints the comic info selected by the switches
+void print_comic_info(struct json_parsed* json_parsed, const char* switches) {
+    if(get_bit(switches[1], 0))    // Comic number
+        printf("%s\n", json_parsed->num.ptr);
+
+    if(get_bit(switches[0], 1)) {  // Date
+        printf("%s/%s/%s\n", (json_parsed->day.i == 0) ? "?" : json_parsed->day.ptr
+                           , (json_parsed->month.i == 0) ? "?" : json_parsed->month.ptr
+                           , (json_parsed->year.i == 0) ? "?" : json_parsed->year.ptr);
+    }
+
+    if(get_bit(switches[0], 7)) {
+        if(get_bit(switches[0], 2))// Safe-title
+            printf("%s:\n", json_parsed->safe_title.ptr);
+        else                       // Title
+            printf("%s:\n", json_parsed->title.ptr);
+    }
+
+    if(get_bit(switches[0], 6))    // Transcript
+        printf("%s\n", json_parsed->transcript.ptr);
+
+    if(get_bit(switches[0], 3))    // Alt text
+        printf("%s\n", json_parsed->alt.ptr);
+
+    if(get_bit(switches[0], 4))    // Comic strip image link
+        printf("%s\n", json_parsed->img.ptr);
+}
+
+enum watch_action {
+    WATCH_ACTION_PRINT,    // Print the selected info
+    WATCH_ACTION_PREFETCH, // Warm the daemon's caches
+    WATCH_ACTION_DISPLAY   // Run termkcd again to view it
+};
+
+// Watches for new comics and acts on each one. Only returns on failure
+int run_watch(enum watch_action action, const char* switches, const int argc, const char* argv[]) {
+    int debug = get_bit(switches[0], 0);
+    int daemon_fd = -1;
+    if(action == WATCH_ACTION_PREFETCH) { // Only checked here, each comic gets its own connection
+        if((daemon_fd = daemon_connect()) < 0) {
+            fprintf(stderr, "daemon_connect@run_watch: Prefetching needs a running daemon (termkcd --daemon)!\n");
+            return 0;
+        }
+        close(daemon_fd);
+    }
+
+    // Viewing runs termkcd with the same arguments, minus the watch ones, plus the comic number
+    const char** view_argv = NULL;
+    int view_argc = 0;
+    char num[32];
+    if(action == WATCH_ACTION_DISPLAY) {
+        view_argv = malloc((argc + 2) * sizeof(char*));
+        if(view_argv == NULL) {
+            fprintf(stderr, "malloc@run_watch: Out of memory!\n");
+            return 0;
+        }
+        for(int n = 0; n < argc; ++n) {
+            if(strcmp(argv[n], "--watch") == 0)
+                continue;
+            else if(strcmp(argv[n], "--on-new") == 0)
+                ++n;
+            else
+                view_argv[view_argc++] = argv[n];
+        }
+        view_argv[view_argc++] = num;
+        view_argv[view_argc] = NULL;
+    }
+
+    struct watch w;
+    if(!watch_init(&w, debug)) {
+        free(view_argv);
+        return 0;
+    }
+    while(1) {
+        struct json_parsed json_parsed;
+        watch_next(&w, &json_parsed);
+        if(action == WATCH_ACTION_PRINT) {
+            print_comic_info(&json_parsed, switches);
+            fflush(stdout);
+        }
+        else if(action == WATCH_ACTION_PREFETCH && json_parsed.img.ptr != NULL) {
+            unsigned char* bitmap = NULL;
+            struct mem_block file_buffer = empty_mem;
+            size_t width, height;
+            CURLcode err;
+            long http_status;
+            daemon_fd = daemon_connect();
+            int fetched = daemon_fd >= 0 && daemon_fetch_image(daemon_fd, json_parsed.img.ptr, &bitmap, &file_buffer, &width, &height, &err, &http_status);
+            if(daemon_fd >= 0)
+                close(daemon_fd);
+            if(!fetched) {
+                fprintf(stderr, "daemon_fetch_image@run_watch: Lost connection to daemon!\n");
+                free_json(&json_parsed);
+                break;
+            }
+            if(debug)
+                fprintf(stderr, "@run_watch: Prefetched %s (HTTP status code: %li)\n", json_parsed.img.ptr, http_status);
+            bitmap_free(bitmap);
+            free(file_buffer.ptr);
+        }
+        else if(action == WATCH_ACTION_DISPLAY) {
+            snprintf(num, sizeof(num), "%s", json_parsed.num.ptr);
+            pid_t pid = fork();
+            if(pid == 0) {
+                execv("/proc/self/exe", (char* const*)view_argv);
+                fprintf(stderr, "execv@run_watch: Could not run termkcd!\n");
+                _exit(EXIT_FAILURE);
+            }
+            else if(pid < 0)
+                fprintf(stderr, "fork@run_watch: Could not run termkcd!\n");
+            else
+                waitpid(pid, NULL, 0);
+        }
+        free_json(&json_parsed);
+    }
+
+    watch_cleanup(&w);
+    free(view_argv);
+    return 0;
+}
+
+// Degrees the image is turned by for viewing. Auto only follows the console's rotation on a real
+// framebuffer
+int view_rotation(const struct fb_settings* fb_settings, const char* switches) {
+    if(fb_settings->rotate != FB_ROTATE_AUTO)
+        return fb_settings->rotate;
+    return (get_bit(switches[0], 5) && fb_settings->backend != FB_BACKEND_MOCK) ? fb_query_rotation() : 0;
+}
+
+// Whether images can be shown while they're decoded, see progressive.h (which also decides
+// whether it's worth it for each image). Only the framebuffer viewer draws them more than once, and
+// rotation needs the whole bitmap
+int view_progressive(const struct fb_settings* fb_settings, const char* switches) {
+    return !get_bit(switches[2], 0) && !get_bit(switches[1], 5) && view_rotation(fb_settings, switches) == 0;
+}
+
+// Views an opened image (see open_image: opened is 1 for a bitmap, 2 for a tiled image, 3 for a
+// progressive decode and 0 if it failed to open) in the framebuffer or terminal, taking over the
+// bitmap (unless lent, then the caller frees it afterwards) or tiled image. Progressive decodes are
+// stopped, but not freed. file_len is the size of the compressed image, which tiled images keep
+// around. overlay and hud are the text and performance HUD toggled in the framebuffer viewer (NULL
+// for none). Returns 0 on failure
+int view_image(int opened, unsigned char* bitmap, char lent, struct tiled_image* tiled, struct progressive* progressive, size_t file_len, size_t width, size_t height, struct overlay* overlay, struct hud* hud, size_t max_mem, const struct fb_settings* fb_settings, enum term_backend term_backend, const char* switches) {
+    // With a memory limit, half of it goes to the image and the rest to the viewer
+    size_t tile_budget = (max_mem == 0) ? TILE_DEFAULT_BUDGET : max_mem / 2;
+    int retval = 1;
+    struct fb_settings settings = *fb_settings;
+    double prepare_start = fb_now();
+    // A lent bitmap stays in memory while viewing, even when a rotated or encoded copy is drawn
+    size_t lent_mem = (opened == 1 && lent) ? width * height * 3 : 0;
+    char owned = !lent;
+
+    // Rotated displays get the bitmap turned once, up front
+    settings.rotate = view_rotation(fb_settings, switches);
+    if(opened == 3) {
+        // Drawn straight from the bitmap being decoded
+        size_t image_mem = width * height * 3;
+        size_t viewer_mem = (max_mem == 0) ? 0 : (max_mem > image_mem) ? max_mem - image_mem : 1;
+        // Once decoded, it's drawn run-length encoded like whole bitmaps. The bitmap itself is kept
+        // for the cache, so there's no room for the encoded copy under a memory limit
+        pthread_mutex_lock(&progressive->lock);
+        progressive->encode = max_mem == 0;
+        pthread_mutex_unlock(&progressive->lock);
+        retval = draw_to_fb(progressive->bitmap, NULL, NULL, width, height, viewer_mem, &settings, overlay, hud, progressive);
+        // Broken images are shown as far as they could be decoded, but still fail
+        pthread_mutex_lock(&progressive->lock);
+        if(progressive->state == PROGRESSIVE_FAILED)
+            retval = 0;
+        pthread_mutex_unlock(&progressive->lock);
+        char decoded = progressive_stop(progressive, 0);
+        if(get_bit(switches[0], 0) && progressive->passes > 0)
+            fprintf(stderr, "@view_image: First pass shown after %.2fms, %s after %.2fms\n", progressive->first_pass * 1e3, decoded ? "decoded" : "stopped", progressive->decode * 1e3);
+        return retval;
+    }
+    if(opened == 2 && settings.rotate != 0) {
+        if(get_bit(switches[0], 0))
+            fprintf(stderr, "@view_image: Tiled images can't be rotated, showing it unrotated\n");
+        settings.rotate = 0;
+    }
+    else if(opened == 1 && settings.rotate != 0) {
+        size_t rotated_w, rotated_h;
+        unsigned char* rotated = rotate_bitmap(bitmap, width, height, settings.rotate, &rotated_w, &rotated_h);
+        if(rotated != NULL) {
+            if(owned)
+                bitmap_free(bitmap);
+            bitmap = rotated;
+            owned = 1;
+            width = rotated_w;
+            height = rotated_h;
+        }
+        else
+            settings.rotate = 0;
+    }
+
+    // Line art is much smaller (and faster to draw) run-length encoded
+    struct rle_image rle;
+    char use_rle = 0;
+    if(opened == 1 && rle_encode(&rle, bitmap, width, height)) {
+        if(owned)
+            bitmap_free(bitmap);
+        bitmap = NULL;
+        use_rle = 1;
+    }
+    if(hud != NULL && opened == 1)
+        hud->prepare = fb_now() - prepare_start;
+
+    size_t viewer_mem = 0;
+    if(max_mem != 0) {
+        size_t image_mem = (opened == 2) ? tile_budget + file_len : use_rle ? rle_image_size(&rle) : width * height * 3;
+        image_mem += lent_mem;
+        viewer_mem = (max_mem > image_mem) ? max_mem - image_mem : 1;
+    }
+
+    // Draw comic strip from bitmap buffer (or tiles) to framebuffer
+    if(opened != 0) {
+        struct rle_image* rle_ptr = use_rle ? &rle : NULL;
+        struct tiled_image* tiled_ptr = (opened == 2) ? tiled : NULL;
+        int drawn;
+        if(get_bit(switches[1], 5))
+            drawn = view_in_terminal(bitmap, rle_ptr, tiled_ptr, width, height, term_backend);
+        else
+            drawn = draw_to_fb(bitmap, rle_ptr, tiled_ptr, width, height, viewer_mem, &settings, overlay, hud, NULL);
+        if(!drawn)
+            retval = 0;
+    }
+    else
+        retval = 0;
+
+    if(opened == 2)
+        tiled_image_free(tiled);
+    if(use_rle)
+        rle_image_free(&rle);
+    if(owned)
+        bitmap_free(bitmap);
+    return retval;
+}
+
+// Starts the download scheduler for direct mode. Unless disabled, it shares a network cache with
+// other direct mode runs, so DNS results and TLS sessions are reused between them. Returns 0 on
+// failure
+int start_direct(struct dl_scheduler* sched, struct net_cache* net, const char* switches) {
+    char net_ready = !get_bit(switches[1], 7) && net_cache_open(net, get_bit(switches[0], 0));
+    if(!dl_scheduler_init(sched, net_ready ? net->share : NULL, get_bit(switches[0], 0))) {
+        if(net_ready)
+            net_cache_close(net);
+        return 0;
+    }
+    sched->net = net_ready ? net : NULL;
+    return 1;
+}
+
+// Stops the download scheduler, saving the network cache
+void stop_direct(struct dl_scheduler* sched) {
+    struct net_cache* net = sched->net;
+    dl_scheduler_cleanup(sched);
+    if(net != NULL)
+        net_cache_close(net);
+}
+
+// Views a local PNG or JPEG file, detecting the format from its contents. The file is mapped
+// instead of read into memory, so the decoders work straight from the page cache. Returns 0 on
+// failure
+int view_file(const char* path, size_t max_mem, const struct fb_settings* fb_settings, enum term_backend term_backend, const char* switches) {
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        fprintf(stderr, "open@view_file: Could not open %s!\n", path);
+        return 0;
+    }
+    struct stat st;
+    if(fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
+        fprintf(stderr, "fstat@view_file: %s is empty or unreadable!\n", path);
+        return 0;
+    }
+    char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+        fprintf(stderr, "mmap@view_file: Could not map %s!\n", path);
+        return 0;
+    }
+    madvise(map, st.st_size, MADV_WILLNEED);
+
+    struct mem_block file = {map, st.st_size};
+    enum file_ext extension = get_file_type(&file);
+    if(extension == FILE_EXT_UNKNOWN) {
+        munmap(map, st.st_size);
+        fprintf(stderr, "get_file_type@view_file: %s isn't a PNG or JPEG file!\n", path);
+        return 0;
+    }
+    if(get_bit(switches[0], 0))
+        fprintf(stderr, "@view_file: %s is a %s file (%zu bytes)\n", path, (extension == FILE_EXT_PNG) ? "PNG" : "JPEG", file.i);
+
+    // Tiled images and progressive decodes keep decoding from the mapping, whole ones don't need it
+    // once decoded
+    size_t tile_budget = (max_mem == 0) ? TILE_DEFAULT_BUDGET : max_mem / 2;
+    struct tiled_image tiled;
+    struct progressive progressive;
+    unsigned char* bitmap;
+    size_t width = 0;
+    size_t height = 0;
+    double decode_start = fb_now();
+    int opened = open_image(&file, extension, tile_budget, &bitmap, &bitmap_allocator, &tiled, view_progressive(fb_settings, switches) ? &progressive : NULL, &width, &height);
+    struct hud hud;
+    hud_init(&hud, -1, (opened == 1) ? fb_now() - decode_start : -1);
+    if(opened < 2)
+        munmap(map, st.st_size);
+    int retval = view_image(opened, bitmap, 0, &tiled, &progressive, file.i, width, height, NULL, &hud, max_mem, fb_settings, term_backend, switches);
+    if(opened == 3)
+        progressive_free(&progressive);
+    if(opened >= 2)
+        munmap(map, st.st_size);
+    hud_free(&hud);
+    return retval;
+}
+
 void print_help(const char* bin_name) {
     printf("termkdc - A terminal utility for getting xkcd comics\n\n");
     printf("Program arguments:\n");
@@ -82,7 +454,29 @@ void print_help(const char* bin_name) {
     printf("  -T; --transcript         : Show comic's transcript\n");
     printf("  -a; --alt                : Show comic's alt\n");
     printf("  -i; --img                : Show comic's image link\n");
-    printf("  -f; --framebuffer        : Render comic strip on framebuffer interactively (fbi-like viewer)\n\n");
+    printf("  -f; --framebuffer        : Render comic strip on framebuffer interactively (fbi-like viewer, 'a' toggles title and alt text, 'p' a performance HUD)\n");
+    printf("      --display <backend>  : Framebuffer backend: auto (default, DRM/KMS if possible), drm, fbdev or mock (in memory,\n");
+    printf("                             optionally with a mode, e.g. mock:1280x720x3,4096 for 3 bytes per pixel and 4096 byte lines)\n");
+    printf("      --keys <script>      : Replay keys in the viewer instead of reading them (e.g. 40l20ja40hq), then report frame times\n");
+    printf("      --rotate <degrees>   : Turn the comic strip clockwise by 0, 90, 180 or 270 degrees, or auto (default) to follow\n");
+    printf("                             the console's rotation on the framebuffer\n");
+    printf("      --terminal <backend> : View comic strip in the terminal instead, using halfblock (truecolour), sixel or kitty graphics\n");
+    printf("      --daemon             : Run as a daemon which keeps connections and caches warm for other invocations\n");
+    printf("      --no-daemon          : Don't use a running daemon, fetch everything directly\n");
+    printf("      --no-net-cache       : Don't reuse DNS results and TLS sessions saved by earlier runs (direct mode only)\n");
+    printf("      --no-progressive     : Don't show comic strips while they're decoded, only once they're whole\n");
+    printf("      --max-mem <size>     : Limit the viewer's memory usage (suffixes: K, M, G), using cheaper rendering if needed\n");
+    printf("      --thumbnails <dir>   : Write thumbnails of a range of comics to a directory, using every core\n");
+    printf("      --contact-sheet      : View thumbnails of a range of comics in a grid on the framebuffer (j/k to scroll)\n");
+    printf("      --range <A-B>        : Comic range for thumbnails (default: 1 to the latest comic)\n");
+    printf("      --thumb-size <px>    : Maximum thumbnail width and height (default: %i)\n", THUMB_DEFAULT_SIZE);
+    printf("      --thumb-format <fmt> : Thumbnail file format, ppm (default) or png\n");
+    printf("      --ingest <file>      : Read comic info from a dump of info.0.json files (concatenated or one per line) instead\n");
+    printf("      --cache <dir>        : Keep viewed comic strips in a directory, in a format which is much faster to decode\n");
+    printf("      --file <path>        : View a local PNG or JPEG file (in the framebuffer, unless --terminal is used). Can be\n");
+    printf("                             repeated to view several files one after another\n");
+    printf("      --watch              : Keep polling for new comics, acting on each one (see --on-new)\n");
+    printf("      --on-new <action>    : Watch action: print (default) the selected info, prefetch into the daemon, or display\n\n");
     printf("Return values:\n");
     printf("  %i (EXIT_SUCCESS) when no errors occur (warnings don't count as errors)\n", EXIT_SUCCESS);
     printf("  %i (EXIT_FAILURE) when errors occur or when showing this screen involuntarily\n\n", EXIT_FAILURE);
@@ -95,7 +489,7 @@ void print_help(const char* bin_name) {
 // Will only fail on a parse error, memory error, connection failure or device open failure.
 int main(const int argc, const char* argv[]) {
     // Program argument switches
-    // 2*8-bit, 16 bools max. Bitmap order:
+    // 3*8-bit, 24 bools max. Bitmap order:
     // 0: Debug; -D, --debug
     // 1: Date; -d, --date
     // 2: Safe title; -s, --safe-title
@@ -105,8 +499,29 @@ int main(const int argc, const char* argv[]) {
     // 6: Transcript; -T, --transcript
     // 7: Title; -t, --title
     // 8: Comic; -c, --comic
-    char switches[2] = {0, 0};
+    // 9: Daemon; --daemon
+    // 10: No daemon; --no-daemon
+    // 11: Thumbnails; --thumbnails
+    // 12: Contact sheet; --contact-sheet
+    // 13: Terminal viewer; --terminal
+    // 14: Watch; --watch
+    // 15: No network cache; --no-net-cache
+    // 16: No progressive decoding; --no-progressive
+    char switches[3] = {0, 0, 0};
     unsigned long comic = 0;
+    size_t max_mem = 0; // Viewer memory limit, 0 for none
+    const char* thumb_dir = NULL;
+    unsigned long range_first = 1;
+    unsigned long range_last = 0; // 0 for the latest comic
+    size_t thumb_size = THUMB_DEFAULT_SIZE;
+    enum thumb_format thumb_format = THUMB_FORMAT_PPM;
+    enum term_backend term_backend = TERM_BACKEND_HALFBLOCK;
+    struct fb_settings fb_settings = {FB_BACKEND_AUTO, FB_MOCK_XRES, FB_MOCK_YRES, FB_MOCK_BPP, 0, NULL, FB_ROTATE_AUTO};
+    const char* ingest_path = NULL; // Metadata dump to read instead of downloading
+    const char* cache_dir = NULL;   // Decoded image cache
+    const char* file_paths[argc];   // Local images to view instead of comics
+    int n_files = 0;
+    enum watch_action watch_action = WATCH_ACTION_PRINT;
     int exitcode = EXIT_SUCCESS;
 
     // Program argument parsing
@@ -142,6 +557,165 @@ int main(const int argc, const char* argv[]) {
                     set_bit(&switches[0], 7, 1);
                 else if(strcmp(this_arg, "--comic") == 0)
                     set_bit(&switches[1], 0, 1);
+                else if(strcmp(this_arg, "--daemon") == 0)
+                    set_bit(&switches[1], 1, 1);
+                else if(strcmp(this_arg, "--no-daemon") == 0)
+                    set_bit(&switches[1], 2, 1);
+                else if(strcmp(this_arg, "--no-net-cache") == 0)
+                    set_bit(&switches[1], 7, 1);
+                else if(strcmp(this_arg, "--no-progressive") == 0)
+                    set_bit(&switches[2], 0, 1);
+                else if(strcmp(this_arg, "--max-mem") == 0) {
+                    if(n + 1 >= argc || (max_mem = str_to_size(argv[++n])) == 0) {
+                        fprintf(stderr, "Invalid value: --max-mem needs a size, e.g. 8M\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                }
+                else if(strcmp(this_arg, "--display") == 0) {
+                    char mock_end = 0;
+                    if(n + 1 < argc && strcmp(argv[n + 1], "auto") == 0)
+                        fb_settings.backend = FB_BACKEND_AUTO;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "drm") == 0)
+                        fb_settings.backend = FB_BACKEND_DRM;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "fbdev") == 0)
+                        fb_settings.backend = FB_BACKEND_FBDEV;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "mock") == 0)
+                        fb_settings.backend = FB_BACKEND_MOCK;
+                    else if(n + 1 < argc && (sscanf(argv[n + 1], "mock:%ix%ix%i%c", &fb_settings.mock_xres, &fb_settings.mock_yres, &fb_settings.mock_bpp, &mock_end) == 3
+                                             || (sscanf(argv[n + 1], "mock:%ix%ix%i,%zu%c", &fb_settings.mock_xres, &fb_settings.mock_yres, &fb_settings.mock_bpp, &fb_settings.mock_ll, &mock_end) == 4)))
+                        fb_settings.backend = FB_BACKEND_MOCK;
+                    else {
+                        fprintf(stderr, "Invalid value: --display needs auto, drm, fbdev or mock[:<W>x<H>x<bytes per pixel>[,<line length>]]\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ++n;
+                }
+                else if(strcmp(this_arg, "--keys") == 0) {
+                    if(n + 1 >= argc) {
+                        fprintf(stderr, "Invalid value: --keys needs a key script, e.g. 40l20ja40hq\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    fb_settings.keys = argv[++n];
+                }
+                else if(strcmp(this_arg, "--rotate") == 0) {
+                    if(n + 1 < argc && strcmp(argv[n + 1], "auto") == 0)
+                        fb_settings.rotate = FB_ROTATE_AUTO;
+                    else if(n + 1 < argc && (strcmp(argv[n + 1], "0") == 0 || strcmp(argv[n + 1], "90") == 0 || strcmp(argv[n + 1], "180") == 0 || strcmp(argv[n + 1], "270") == 0))
+                        fb_settings.rotate = atoi(argv[n + 1]);
+                    else {
+                        fprintf(stderr, "Invalid value: --rotate needs 0, 90, 180, 270 or auto\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ++n;
+                }
+                else if(strcmp(this_arg, "--terminal") == 0) {
+                    if(n + 1 < argc && strcmp(argv[n + 1], "halfblock") == 0)
+                        term_backend = TERM_BACKEND_HALFBLOCK;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "sixel") == 0)
+                        term_backend = TERM_BACKEND_SIXEL;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "kitty") == 0)
+                        term_backend = TERM_BACKEND_KITTY;
+                    else {
+                        fprintf(stderr, "Invalid value: --terminal needs halfblock, sixel or kitty\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    set_bit(&switches[1], 5, 1);
+                    ++n;
+                }
+                else if(strcmp(this_arg, "--thumbnails") == 0) {
+                    if(n + 1 >= argc) {
+                        fprintf(stderr, "Invalid value: --thumbnails needs a directory\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    thumb_dir = argv[++n];
+                    set_bit(&switches[1], 3, 1);
+                }
+                else if(strcmp(this_arg, "--contact-sheet") == 0)
+                    set_bit(&switches[1], 4, 1);
+                else if(strcmp(this_arg, "--range") == 0) {
+                    const char* dash = (n + 1 < argc) ? strchr(argv[n + 1], '-') : NULL;
+                    int errored = 0;
+                    if(dash != NULL) {
+                        char first_str[dash - argv[n + 1] + 1];
+                        memcpy(first_str, argv[n + 1], dash - argv[n + 1]);
+                        first_str[dash - argv[n + 1]] = '\0';
+                        range_first = str_to_uint(first_str, &errored);
+                        if(!errored)
+                            range_last = str_to_uint(dash + 1, &errored);
+                    }
+                    if(dash == NULL || errored || range_first == 0 || range_last < range_first) {
+                        fprintf(stderr, "Invalid value: --range needs a comic range, e.g. 1-100\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ++n;
+                }
+                else if(strcmp(this_arg, "--thumb-size") == 0) {
+                    int errored = 0;
+                    if(n + 1 >= argc || (thumb_size = str_to_uint(argv[++n], &errored)) == 0 || errored) {
+                        fprintf(stderr, "Invalid value: --thumb-size needs a size in pixels, e.g. 160\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                }
+                else if(strcmp(this_arg, "--thumb-format") == 0) {
+                    if(n + 1 < argc && strcmp(argv[n + 1], "ppm") == 0)
+                        thumb_format = THUMB_FORMAT_PPM;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "png") == 0)
+                        thumb_format = THUMB_FORMAT_PNG;
+                    else {
+                        fprintf(stderr, "Invalid value: --thumb-format needs ppm or png\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ++n;
+                }
+                else if(strcmp(this_arg, "--ingest") == 0) {
+                    if(n + 1 >= argc) {
+                        fprintf(stderr, "Invalid value: --ingest needs a file\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ingest_path = argv[++n];
+                }
+                else if(strcmp(this_arg, "--cache") == 0) {
+                    if(n + 1 >= argc) {
+                        fprintf(stderr, "Invalid value: --cache needs a directory\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    cache_dir = argv[++n];
+                }
+                else if(strcmp(this_arg, "--file") == 0) {
+                    if(n + 1 >= argc) {
+                        fprintf(stderr, "Invalid value: --file needs a path\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    file_paths[n_files++] = argv[++n];
+                }
+                else if(strcmp(this_arg, "--watch") == 0)
+                    set_bit(&switches[1], 6, 1);
+                else if(strcmp(this_arg, "--on-new") == 0) {
+                    if(n + 1 < argc && strcmp(argv[n + 1], "print") == 0)
+                        watch_action = WATCH_ACTION_PRINT;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "prefetch") == 0)
+                        watch_action = WATCH_ACTION_PREFETCH;
+                    else if(n + 1 < argc && strcmp(argv[n + 1], "display") == 0)
+                        watch_action = WATCH_ACTION_DISPLAY;
+                    else {
+                        fprintf(stderr, "Invalid value: --on-new needs print, prefetch or display\n");
+                        print_help(argv[0]);
+                        return EXIT_FAILURE;
+                    }
+                    ++n;
+                }
                 else {
                     fprintf(stderr, "Unknown argument: %s\n", this_arg);
                     print_help(argv[0]);
@@ -202,155 +776,238 @@ int main(const int argc, const char* argv[]) {
         }
     }
 
-    CURL* curl_handle = curl_easy_init();
-    if(curl_handle) {
-        struct mem_block json_raw = empty_mem;
-
-        long http_status = 0; // HTTP status. Codes which will be checked: 200, 404. Any other status code results in a abort
-        if(comic == 0)
-            curl_easy_setopt(curl_handle, CURLOPT_URL, "https://xkcd.com/info.0.json"); // Make sure link is https, not http, since it results in a 301
-        else {
-            char formatted[40]; // 40 chars should be enough, as the max comics would be 4,294,967,295 (max u_int val)
-            sprintf(formatted, "https://xkcd.com/%lu/info.0.json", comic);
-            curl_easy_setopt(curl_handle, CURLOPT_URL, formatted);
+    // Freed image buffers are kept for reuse, unless that would break the memory limit
+    bitmap_pool_limit(max_mem);
+
+    if(get_bit(switches[1], 1)) // Daemon mode
+        return run_daemon(get_bit(switches[0], 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if(get_bit(switches[1], 6)) // Watch mode
+        return run_watch(watch_action, switches, argc, argv) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if(get_bit(switches[1], 3) || get_bit(switches[1], 4)) // Thumbnails and/or contact sheet
+        return run_thumbnails(range_first, range_last, thumb_size, thumb_dir, thumb_format, get_bit(switches[1], 4), max_mem, &fb_settings, get_bit(switches[0], 0)) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if(n_files > 0) { // Local files, no network involved
+        if(!get_bit(switches[1], 5))
+            set_bit(&switches[0], 5, 1);
+        for(int f = 0; f < n_files; ++f) {
+            if(!view_file(file_paths[f], max_mem, &fb_settings, term_backend, switches))
+                exitcode = EXIT_FAILURE;
         }
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback_curl);
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &json_raw);
-        if(get_bit(switches[0], 0))
-            curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-        CURLcode err = curl_easy_perform(curl_handle);
-        curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_status);
-        if(http_status == 200 && err == CURLE_OK) {
-            if(json_raw.i > 0 && json_raw.ptr[0] == '{') {
-                struct json_parsed json_parsed;
-                if(parse_json(&json_raw, &json_parsed, get_bit(switches[0], 0))) {
-                    if(get_bit(switches[1], 0))    // Comic number
-                        printf("%s\n", json_parsed.num.ptr);
-
-                    if(get_bit(switches[0], 1)) {  // Date
-                        printf("%s/%s/%s\n", (json_parsed.day.i == 0) ? "?" : json_parsed.day.ptr
-                                           , (json_parsed.month.i == 0) ? "?" : json_parsed.month.ptr
-                                           , (json_parsed.year.i == 0) ? "?" : json_parsed.year.ptr);
-                    }
+        return exitcode;
+    }
 
-                    if(get_bit(switches[0], 7)) {
-                        if(get_bit(switches[0], 2))// Safe-title
-                            printf("%s:\n", json_parsed.safe_title.ptr);
-                        else                       // Title
-                            printf("%s:\n", json_parsed.title.ptr);
-                    }
+    // Use a running daemon if possible, otherwise everything is fetched directly
+    int daemon_fd = -1;
+    if(!get_bit(switches[1], 2) && ingest_path == NULL) {
+        daemon_fd = daemon_connect();
+        if(daemon_fd < 0 && get_bit(switches[0], 0))
+            fprintf(stderr, "@main: No daemon running, using direct mode\n");
+    }
+    struct dl_scheduler sched;
+    struct net_cache net;
+    char sched_ready = 0;
 
-                    if(get_bit(switches[0], 6))    // Transcript
-                        printf("%s\n", json_parsed.transcript.ptr);
+    struct mem_block json_raw = empty_mem;
+    struct json_stream stream;
+    stream.img_job = NULL;
+    stream.cache_dir = cache_dir;
+    char streamed = 0;
 
-                    if(get_bit(switches[0], 3))    // Alt text
-                        printf("%s\n", json_parsed.alt.ptr);
+    long http_status = 0; // HTTP status. Codes which will be checked: 200, 404. Any other status code results in a abort
+    CURLcode err = CURLE_OK;
+    if(ingest_path != NULL) {
+        if(!ingest_comic(ingest_path, comic, &json_raw, &stream.parsed, get_bit(switches[0], 0))) {
+            free(json_raw.ptr);
+            return EXIT_FAILURE;
+        }
+        stream.ok = 1;
+        streamed = 1;
+        http_status = 200;
+    }
+    else if(daemon_fd >= 0 && !daemon_fetch_json(daemon_fd, comic, &json_raw, &err, &http_status)) {
+        fprintf(stderr, "daemon_fetch_json@main: Lost connection to daemon, using direct mode\n");
+        close(daemon_fd);
+        daemon_fd = -1;
+    }
+    if(daemon_fd < 0 && ingest_path == NULL) {
+        if(!start_direct(&sched, &net, switches))
+            return EXIT_FAILURE;
+        sched_ready = 1;
 
-                    if(get_bit(switches[0], 4))    // Comic strip image link
-                        printf("%s\n", json_parsed.img.ptr);
+        char url[COMIC_JSON_URL_LEN];
+        comic_json_url(url, comic);
+        struct dl_job* job = dl_submit(&sched, url, DL_PRIORITY_VISIBLE);
+        if(job == NULL || !json_stream_reset(&stream, get_bit(switches[0], 0))) {
+            dl_job_free(&sched, job);
+            stop_direct(&sched);
+            return EXIT_FAILURE;
+        }
+        streamed = 1;
+        stream.sched = &sched;
+        stream.prefetch = get_bit(switches[0], 5) || get_bit(switches[1], 5);
+        job->on_data = json_stream_on_data;
+        job->user = &stream;
+        err = dl_wait(&sched, job, &json_raw, &http_status);
+        json_parser_free(&stream.parser);
+    }
 
-                    if(get_bit(switches[0], 5)) {  // Display comic strip to framebuffer
-                        enum file_ext extension = get_extension(&json_parsed.img); // Check file extension
-                        if(extension == FILE_EXT_UNKNOWN) { // Unknown file extension
-                            fprintf(stderr, "get_extension@main: The image has an unsupported extension!\n");
-                            exitcode = EXIT_FAILURE;
+    if(http_status == 200 && err == CURLE_OK) {
+        if(json_raw.i > 0 && json_raw.ptr[0] == '{') {
+            struct json_parsed json_parsed;
+            int parsed = 0;
+            if(streamed) { // Already parsed while downloading (or read from a dump)
+                json_parsed = stream.parsed;
+                parsed = stream.ok;
+                streamed = 0;
+            }
+            else
+                parsed = parse_json(&json_raw, &json_parsed, get_bit(switches[0], 0));
+            if(parsed) {
+                print_comic_info(&json_parsed, switches);
+
+                if(get_bit(switches[0], 5) || get_bit(switches[1], 5)) { // Display comic strip to framebuffer or terminal
+                    enum file_ext extension = get_extension(&json_parsed.img); // Check file extension
+                    if(extension == FILE_EXT_UNKNOWN) { // Unknown file extension
+                        fprintf(stderr, "get_extension@main: The image has an unsupported extension!\n");
+                        exitcode = EXIT_FAILURE;
+                    }
+                    else { // Valid file extension
+                        // Set up variables
+                        struct mem_block file_buffer = empty_mem;
+                        // RGB bitmap, if the daemon already decoded it
+                        unsigned char* bitmap_buffer = NULL;
+                        size_t width = 0;
+                        size_t height = 0;
+
+                        // Cached comics skip both the download and the decoding
+                        double download_start = fb_now();
+                        double download_time = -1;
+                        double decode_time = -1;
+                        unsigned long num = strtoul(json_parsed.num.ptr != NULL ? json_parsed.num.ptr : "0", NULL, 10);
+                        char cached = num != 0 && cache_dir != NULL && cache_load(cache_dir, num, &bitmap_buffer, &width, &height, get_bit(switches[0], 0));
+                        if(cached) {
+                            http_status = 200;
+                            decode_time = fb_now() - download_start;
                         }
-                        else { // Valid file extension
-                            // Reset handle props
-                            curl_easy_reset(curl_handle);
-
-                            // Set up variables
-                            struct mem_block file_buffer = empty_mem;
-
-                            // Configure curl to download comic strip
-                            curl_easy_setopt(curl_handle, CURLOPT_URL, json_parsed.img.ptr);
-                            curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, write_callback_curl);
-                            curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, &file_buffer);
-                            if(get_bit(switches[0], 0))
-                                curl_easy_setopt(curl_handle, CURLOPT_VERBOSE, 1L);
-
-                            // Perform curl action
-                            err = curl_easy_perform(curl_handle);
-                            curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE, &http_status);
-
-                            // Check if everything went OK
-                            if(http_status == 200 && err == CURLE_OK) {
-                                // Prepare data for reading file retreived
-                                long unsigned int width = 0;
-                                long unsigned int height = 0;
-                                // RGB bitmap
-                                unsigned char* bitmap_buffer = NULL;
-
-                                if(extension == FILE_EXT_PNG) { // Load using libpng, as it has a PNG file extension
-                                    // Load png from memory
-                                    bitmap_buffer = load_png(file_buffer.ptr, file_buffer.i, &width, &height);
-                                }
-                                // Note: this else statement may be a problem in the future when more file types are used
-                                else { // Load using libjpeg, as it has a JPEG file extension.
-                                    bitmap_buffer = load_jpeg(file_buffer.ptr, file_buffer.i, &width, &height);
-                                }
-
-                                // Draw comic strip from bitmap buffer to framebuffer
-                                if(bitmap_buffer != NULL) {
-                                    if(!draw_to_fb(bitmap_buffer, width, height))
-                                        exitcode = EXIT_FAILURE;
-                                    free(bitmap_buffer);
-                                }
+                        else if(daemon_fd >= 0 && !daemon_fetch_image(daemon_fd, json_parsed.img.ptr, &bitmap_buffer, &file_buffer, &width, &height, &err, &http_status)) {
+                            fprintf(stderr, "daemon_fetch_image@main: Lost connection to daemon, using direct mode\n");
+                            close(daemon_fd);
+                            daemon_fd = -1;
+                        }
+                        if(daemon_fd < 0 && !cached) {
+                            if(!sched_ready)
+                                sched_ready = start_direct(&sched, &net, switches);
+                            if(!sched_ready)
+                                err = CURLE_FAILED_INIT;
+                            else if(stream.img_job != NULL) { // Already downloading since the URL was parsed
+                                err = dl_wait(&sched, stream.img_job, &file_buffer, &http_status);
+                                stream.img_job = NULL;
                             }
-                            else {
-                                if(err == CURLE_WRITE_ERROR)
-                                    fprintf(stderr, "curl_easy_perform@main: Failed to copy received data to memory!\n");
-                                else
-                                    fprintf(stderr, "curl_easy_perform@main: Failed to retrieve comic strip image! HTTP status code: %li\n", http_status);
-                                exitcode = EXIT_FAILURE;
+                            else // Download comic strip
+                                err = dl_fetch(&sched, json_parsed.img.ptr, DL_PRIORITY_VISIBLE, &file_buffer, &http_status);
+                        }
+                        // A prefetched image only counts the part which wasn't done by now, and the
+                        // daemon's includes decoding
+                        if(!cached)
+                            download_time = fb_now() - download_start;
+
+                        // Don't hold on to the daemon while viewing, other invocations need it too
+                        if(daemon_fd >= 0) {
+                            close(daemon_fd);
+                            daemon_fd = -1;
+                        }
+
+                        // Check if everything went OK
+                        if(http_status == 200 && err == CURLE_OK) {
+                            // With a memory limit, half of it goes to the image and the rest to the viewer
+                            size_t tile_budget = (max_mem == 0) ? TILE_DEFAULT_BUDGET : max_mem / 2;
+                            struct tiled_image tiled;
+                            struct progressive progressive;
+                            int opened = 1;
+                            if(bitmap_buffer == NULL) {
+                                double decode_start = fb_now();
+                                opened = open_image(&file_buffer, extension, tile_budget, &bitmap_buffer, &bitmap_allocator, &tiled, view_progressive(&fb_settings, switches) ? &progressive : NULL, &width, &height);
+                                if(opened == 1)
+                                    decode_time = fb_now() - decode_start;
+                            }
+                            if(opened == 1) { // Compressed image isn't needed anymore
+                                free(file_buffer.ptr);
+                                file_buffer = empty_mem;
                             }
+                            // Stored once the viewer is closed, so writing it doesn't delay the first
+                            // frame. Until then, the viewer borrows the bitmap
+                            char store = opened == 1 && num != 0 && cache_dir != NULL && !cached;
 
-                            // Free file_buffer mem_block
-                            free(file_buffer.ptr);
+                            struct overlay overlay;
+                            char has_overlay = !get_bit(switches[1], 5) && overlay_init(&overlay, json_parsed.num.ptr, get_bit(switches[0], 2) ? json_parsed.safe_title.ptr : json_parsed.title.ptr, json_parsed.alt.ptr);
+                            struct hud hud;
+                            hud_init(&hud, download_time, decode_time);
+                            if(!view_image(opened, bitmap_buffer, store, &tiled, &progressive, file_buffer.i, width, height, has_overlay ? &overlay : NULL, &hud, max_mem, &fb_settings, term_backend, switches))
+                                exitcode = EXIT_FAILURE;
+                            if(store) {
+                                cache_store(cache_dir, num, bitmap_buffer, width, height, get_bit(switches[0], 0));
+                                bitmap_free(bitmap_buffer);
+                            }
+                            if(opened == 3) { // Only cached if it was decoded before the viewer was closed
+                                if(progressive.state == PROGRESSIVE_DONE && num != 0 && cache_dir != NULL)
+                                    cache_store(cache_dir, num, progressive.bitmap, width, height, get_bit(switches[0], 0));
+                                progressive_free(&progressive);
+                            }
+                            if(has_overlay)
+                                overlay_free(&overlay);
+                            hud_free(&hud);
                         }
+                        else {
+                            if(err == CURLE_WRITE_ERROR)
+                                fprintf(stderr, "curl_easy_perform@main: Failed to copy received data to memory!\n");
+                            else if(err == CURLE_FAILED_INIT)
+                                fprintf(stderr, "curl_easy_init@main: Could not initialize cURL!\n");
+                            else
+                                fprintf(stderr, "curl_easy_perform@main: Failed to retrieve comic strip image! HTTP status code: %li\n", http_status);
+                            bitmap_free(bitmap_buffer);
+                            exitcode = EXIT_FAILURE;
+                        }
+
+                        // Free file_buffer mem_block
+                        free(file_buffer.ptr);
                     }
                 }
-                else {
-                    fprintf(stderr, "parse_json@main: Failed to parse JSON!\n");
-                    exitcode = EXIT_FAILURE;
-                }
-
-                // Free all strings
-                free(json_parsed.month.ptr);
-                free(json_parsed.num.ptr);
-                free(json_parsed.link.ptr);
-                free(json_parsed.year.ptr);
-                free(json_parsed.news.ptr);
-                free(json_parsed.safe_title.ptr);
-                free(json_parsed.transcript.ptr);
-                free(json_parsed.alt.ptr);
-                free(json_parsed.img.ptr);
-                free(json_parsed.title.ptr);
-                free(json_parsed.day.ptr);
             }
-            else
-                fprintf(stderr, "@main: JSON file doesn't start as a table!\n");
-        }
-        else {
-            if(err == CURLE_WRITE_ERROR)
-                fprintf(stderr, "curl_easy_perform@main: Failed to copy received data to memory!\n");
-            else if(comic != 0 && http_status == 404)
-                fprintf(stderr, "Comic %lu doesn't exist!\n", comic);
-            else
-                fprintf(stderr, "curl_easy_perform@main: Failed to retreive comic %lu! HTTP status code: %li\n", comic, http_status);
-            exitcode = EXIT_FAILURE;
-        }
-
-        // Free downloaded data buffer
-        free(json_raw.ptr);
+            else {
+                fprintf(stderr, "parse_json@main: Failed to parse JSON!\n");
+                exitcode = EXIT_FAILURE;
+            }
 
-        // Perform curl cleanup
-        curl_easy_cleanup(curl_handle);
+            // Free all strings
+            free_json(&json_parsed);
+        }
+        else
+            fprintf(stderr, "@main: JSON file doesn't start as a table!\n");
     }
     else {
-        fprintf(stderr, "curl_easy_init@main: Could not initialize cURL!\n");
+        if(err == CURLE_WRITE_ERROR)
+            fprintf(stderr, "curl_easy_perform@main: Failed to copy received data to memory!\n");
+        else if(comic != 0 && http_status == 404)
+            fprintf(stderr, "Comic %lu doesn't exist!\n", comic);
+        else
+            fprintf(stderr, "curl_easy_perform@main: Failed to retreive comic %lu! HTTP status code: %li\n", comic, http_status);
         exitcode = EXIT_FAILURE;
     }
 
+    // Free downloaded data buffer, and the parsed JSON if it wasn't used
+    free(json_raw.ptr);
+    if(streamed)
+        free_json(&stream.parsed);
+
+    // Perform curl cleanup
+    if(sched_ready) {
+        dl_job_free(&sched, stream.img_job);
+        stop_direct(&sched);
+    }
+    if(daemon_fd >= 0)
+        close(daemon_fd);
+
     return exitcode;
 }
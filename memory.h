@@ -7,7 +7,28 @@
 struct mem_block {
     char* ptr;
     size_t i;
-} empty_mem = {NULL, 0};
+};
+
+// Constant rather than a global, so the library build has no shared mutable state
+static const struct mem_block empty_mem = {NULL, 0};
+
+// Allocator for memory handed over to library users, who may supply their own. user is passed to
+// both functions
+struct allocator {
+    void* (*alloc)(size_t size, void* user);
+    void (*free)(void* ptr, void* user);
+    void* user;
+};
+
+void* allocator_malloc(size_t size, void* user) {
+    return malloc(size);
+}
+
+void allocator_free(void* ptr, void* user) {
+    free(ptr);
+}
+
+static const struct allocator malloc_allocator = {allocator_malloc, allocator_free, NULL};
 
 char* memapp(void* src, size_t src_size, void* dest, size_t dest_offset, size_t dest_padding) {
     if(dest == NULL) // First time allocating memory: malloc
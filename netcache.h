@@ -0,0 +1,436 @@
+#ifndef TERMKCD_NETCACHE_H
+#define TERMKCD_NETCACHE_H
+
+// Network cache shared by invocations which don't use a daemon, so short-lived runs skip DNS
+// resolution and resume TLS sessions instead of doing full handshakes. Addresses that transfers
+// connected to (and, with libcurl 8.12 or later, TLS sessions) are written to a small file on
+// exit, and loaded into a curl share on start: addresses through CURLOPT_RESOLVE, sessions through
+// libcurl's session import. Readers and writers of the file are serialized with a lock file, and
+// entries written by other processes in the meantime are merged rather than overwritten: addresses
+// by host, sessions by their data (sessions this process imported are its own to keep or drop, as
+// TLS 1.3 tickets are used up).
+//
+// File format, one entry per line (hex for binary data, - for none):
+//   dns <expires> <host> <port> <address>
+//   tls <expires> <session key> <shmac> <session data>
+
+// Includes for the cache file and its lock
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+// TLS session export and import appeared in libcurl 8.12.0
+#if LIBCURL_VERSION_NUM >= 0x080c00
+#define NET_CACHE_TLS 1
+#else
+#define NET_CACHE_TLS 0
+#endif
+
+#define NET_CACHE_PATH_LEN 4096
+#define NET_CACHE_DNS_N 16
+#define NET_CACHE_DNS_TTL 300         // Seconds an address is trusted for
+#define NET_CACHE_TLS_N 16
+#define NET_CACHE_TLS_TTL 86400       // Cap on how long a session is kept, whatever the server says
+#define NET_CACHE_LINE_MAX 65536
+
+struct net_cache_dns {
+    char host[256];
+    long port;
+    char addr[64];
+    time_t expires;             // 0 if the address stopped working
+    char from_file;             // Loaded rather than seen by this process
+};
+
+struct net_cache_tls {
+    char* line;                 // Entry as written in the file
+    time_t expires;
+    char imported;              // Loaded into the share, so exported again if still usable
+};
+
+struct net_cache {
+    CURLSH* share;
+    struct curl_slist* resolve; // Addresses for CURLOPT_RESOLVE
+    struct net_cache_dns dns[NET_CACHE_DNS_N];
+    int n_dns;
+    struct net_cache_tls tls[NET_CACHE_TLS_N];
+    int n_tls;
+    char changed;               // Something worth writing back
+    char path[NET_CACHE_PATH_LEN];
+    int debug;
+#if NET_CACHE_TLS
+    char* exported[NET_CACHE_TLS_N]; // Sessions exported on exit, as "tls" entries
+    int n_exported;
+#endif
+};
+
+// Gets the cache file's path ($XDG_CACHE_HOME/termkcd/net, or ~/.cache/termkcd/net), creating its
+// directory. Returns 0 if there's nowhere to put it
+int net_cache_path(char* path) {
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if(xdg != NULL && xdg[0] != '\0')
+        snprintf(path, NET_CACHE_PATH_LEN, "%s", xdg);
+    else if(home != NULL && home[0] != '\0')
+        snprintf(path, NET_CACHE_PATH_LEN, "%s/.cache", home);
+    else
+        return 0;
+    if(mkdir(path, 0700) == -1 && errno != EEXIST)
+        return 0;
+    size_t len = strlen(path);
+    snprintf(path + len, NET_CACHE_PATH_LEN - len, "/termkcd");
+    if(mkdir(path, 0700) == -1 && errno != EEXIST)
+        return 0;
+    len = strlen(path);
+    snprintf(path + len, NET_CACHE_PATH_LEN - len, "/net");
+    return 1;
+}
+
+// Takes the cache's lock file, shared for reading or exclusive for writing. Returns its file
+// descriptor, or -1 on failure
+int net_cache_lock(struct net_cache* nc, int operation) {
+    char lock_path[NET_CACHE_PATH_LEN + 8];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", nc->path);
+    int fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if(fd == -1)
+        return -1;
+    if(flock(fd, operation) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void net_cache_unlock(int fd) {
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Finds the address entry for host and port, or NULL
+struct net_cache_dns* net_cache_find(struct net_cache* nc, const char* host, long port) {
+    for(int n = 0; n < nc->n_dns; ++n) {
+        if(nc->dns[n].port == port && strcmp(nc->dns[n].host, host) == 0)
+            return &nc->dns[n];
+    }
+    return NULL;
+}
+
+// Adds (or replaces) an address entry. Full tables drop the entry expiring first
+void net_cache_put_dns(struct net_cache* nc, const char* host, long port, const char* addr, time_t expires, char from_file) {
+    struct net_cache_dns* entry = net_cache_find(nc, host, port);
+    if(entry == NULL) {
+        if(nc->n_dns < NET_CACHE_DNS_N)
+            entry = &nc->dns[nc->n_dns++];
+        else {
+            entry = &nc->dns[0];
+            for(int n = 1; n < nc->n_dns; ++n) {
+                if(nc->dns[n].expires < entry->expires)
+                    entry = &nc->dns[n];
+            }
+        }
+    }
+    snprintf(entry->host, sizeof(entry->host), "%s", host);
+    entry->port = port;
+    snprintf(entry->addr, sizeof(entry->addr), "%s", addr);
+    entry->expires = expires;
+    entry->from_file = from_file;
+}
+
+int net_cache_put_tls(struct net_cache* nc, const char* line, time_t expires) {
+    if(nc->n_tls == NET_CACHE_TLS_N)
+        return 0;
+    char* copy = strdup(line);
+    if(copy == NULL) {
+        fprintf(stderr, "strdup@net_cache_put_tls: Out of memory!\n");
+        return 0;
+    }
+    nc->tls[nc->n_tls++] = (struct net_cache_tls){copy, expires, 0};
+    return 1;
+}
+
+// Writes len bytes as hex (or - if there are none) to file
+void net_cache_write_hex(FILE* file, const unsigned char* data, size_t len) {
+    if(data == NULL || len == 0)
+        fputc('-', file);
+    for(size_t n = 0; data != NULL && n < len; ++n)
+        fprintf(file, "%02x", data[n]);
+}
+
+// Decodes hex in place, returning the length (0 for -). Returns -1 if it isn't hex
+long net_cache_read_hex(char* hex) {
+    if(strcmp(hex, "-") == 0)
+        return 0;
+    size_t len = strlen(hex);
+    if(len % 2 != 0)
+        return -1;
+    for(size_t n = 0; n < len / 2; ++n) {
+        unsigned int byte;
+        if(sscanf(hex + n * 2, "%2x", &byte) != 1)
+            return -1;
+        hex[n] = byte;
+    }
+    return len / 2;
+}
+
+#if NET_CACHE_TLS
+// Imports a session from a "tls" entry's fields (key already decoded, NULL if there's none)
+int net_cache_import_tls(struct net_cache* nc, CURL* handle, const char* key, char* shmac, char* sdata) {
+    long shmac_len = net_cache_read_hex(shmac);
+    long sdata_len = net_cache_read_hex(sdata);
+    if(shmac_len < 0 || sdata_len <= 0)
+        return 0;
+    CURLcode err = curl_easy_ssls_import(handle, key, (unsigned char*)shmac, shmac_len, (unsigned char*)sdata, sdata_len);
+    if(err != CURLE_OK && nc->debug)
+        fprintf(stderr, "curl_easy_ssls_import@net_cache_import_tls: %s\n", curl_easy_strerror(err));
+    return err == CURLE_OK;
+}
+
+CURLcode net_cache_export_tls(CURL* handle, void* userptr, const char* session_key, const unsigned char* shmac, size_t shmac_len, const unsigned char* sdata, size_t sdata_len, curl_off_t valid_until, int ietf_tls_id, const char* alpn, size_t earlydata_max) {
+    struct net_cache* nc = userptr;
+    if(nc->n_exported == NET_CACHE_TLS_N)
+        return CURLE_OK;
+    char* line = NULL;
+    size_t line_len = 0;
+    FILE* file = open_memstream(&line, &line_len);
+    if(file == NULL) {
+        fprintf(stderr, "open_memstream@net_cache_export_tls: Out of memory!\n");
+        return CURLE_OK;
+    }
+    time_t now = time(NULL);
+    time_t expires = (valid_until > now + NET_CACHE_TLS_TTL || valid_until <= 0) ? now + NET_CACHE_TLS_TTL : (time_t)valid_until;
+    fprintf(file, "tls %lld ", (long long)expires);
+    if(session_key != NULL)
+        net_cache_write_hex(file, (const unsigned char*)session_key, strlen(session_key));
+    else
+        fputc('-', file);
+    fputc(' ', file);
+    net_cache_write_hex(file, shmac, shmac_len);
+    fputc(' ', file);
+    net_cache_write_hex(file, sdata, sdata_len);
+    if(fclose(file) == 0)
+        nc->exported[nc->n_exported++] = line;
+    else
+        free(line);
+    return CURLE_OK;
+}
+#endif
+
+// Whether a "tls" entry holds the same session as one of n others (sessions are told apart by
+// their data, the last field)
+int net_cache_tls_listed(const char* line, char* const* others, int n) {
+    const char* sdata = strrchr(line, ' ');
+    for(int i = 0; sdata != NULL && i < n; ++i) {
+        const char* other = strrchr(others[i], ' ');
+        if(other != NULL && strcmp(sdata, other) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Reads the cache file's entries into nc. With import set, also loads TLS sessions into the share
+void net_cache_read(struct net_cache* nc, int import) {
+    FILE* file = fopen(nc->path, "r");
+    if(file == NULL)
+        return;
+#if NET_CACHE_TLS
+    CURL* handle = NULL;
+    if(import && (handle = curl_easy_init()) != NULL)
+        curl_easy_setopt(handle, CURLOPT_SHARE, nc->share);
+#endif
+    time_t now = time(NULL);
+    char* line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while((len = getline(&line, &cap, file)) > 0) {
+        if(len > NET_CACHE_LINE_MAX)
+            continue;
+        if(line[len - 1] == '\n')
+            line[--len] = '\0';
+        long long expires;
+        char host[256], addr[64];
+        long port;
+        if(sscanf(line, "dns %lld %255s %ld %63s", &expires, host, &port, addr) == 4) {
+            if(expires > now && net_cache_find(nc, host, port) == NULL)
+                net_cache_put_dns(nc, host, port, addr, expires, 1);
+        }
+        else if(sscanf(line, "tls %lld", &expires) == 1 && expires > now) {
+            // Kept as is for writing back
+            if(!net_cache_put_tls(nc, line, expires))
+                continue;
+#if NET_CACHE_TLS
+            char key[len], shmac[len], sdata[len];
+            long key_len;
+            if(handle != NULL && sscanf(line, "tls %*d %s %s %s", key, shmac, sdata) == 3 && (key_len = net_cache_read_hex(key)) >= 0) {
+                key[key_len] = '\0';
+                nc->tls[nc->n_tls - 1].imported = net_cache_import_tls(nc, handle, (key_len > 0) ? key : NULL, shmac, sdata);
+            }
+#endif
+        }
+    }
+    free(line);
+    fclose(file);
+#if NET_CACHE_TLS
+    if(handle != NULL)
+        curl_easy_cleanup(handle);
+#endif
+}
+
+// Builds the CURLOPT_RESOLVE list from the address entries. Entries which stopped working are
+// removed from the shared DNS cache instead
+void net_cache_build_resolve(struct net_cache* nc) {
+    curl_slist_free_all(nc->resolve);
+    nc->resolve = NULL;
+    char entry[sizeof(nc->dns[0].host) + sizeof(nc->dns[0].addr) + 32];
+    for(int n = 0; n < nc->n_dns; ++n) {
+        if(nc->dns[n].expires == 0)
+            snprintf(entry, sizeof(entry), "-%s:%ld", nc->dns[n].host, nc->dns[n].port);
+        else if(nc->dns[n].from_file)
+            snprintf(entry, sizeof(entry), "%s:%ld:%s", nc->dns[n].host, nc->dns[n].port, nc->dns[n].addr);
+        else
+            continue;
+        struct curl_slist* appended = curl_slist_append(nc->resolve, entry);
+        if(appended != NULL)
+            nc->resolve = appended;
+    }
+}
+
+// Creates the share and loads the cache file into it. Returns 0 on failure
+int net_cache_open(struct net_cache* nc, int debug) {
+    memset(nc, 0, sizeof(struct net_cache));
+    nc->debug = debug;
+    if(!net_cache_path(nc->path)) {
+        if(debug)
+            fprintf(stderr, "@net_cache_open: No cache directory, network cache disabled\n");
+        return 0;
+    }
+    nc->share = curl_share_init();
+    if(nc->share == NULL) {
+        fprintf(stderr, "curl_share_init@net_cache_open: Could not initialize cURL!\n");
+        return 0;
+    }
+    curl_share_setopt(nc->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(nc->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+
+    int lock = net_cache_lock(nc, LOCK_SH);
+    net_cache_read(nc, 1);
+    if(lock != -1)
+        net_cache_unlock(lock);
+    net_cache_build_resolve(nc);
+    if(debug)
+        fprintf(stderr, "@net_cache_open: Loaded %i addresses and %i TLS sessions from %s\n", nc->n_dns, NET_CACHE_TLS ? nc->n_tls : 0, nc->path);
+    return 1;
+}
+
+// Records where a finished transfer connected to, or forgets the address if connecting to it
+// failed
+void net_cache_record(struct net_cache* nc, CURL* handle, CURLcode err) {
+    // The host and port are taken from the URL, as there's no connection to get them from on failure
+    char* url = NULL;
+    curl_easy_getinfo(handle, CURLINFO_EFFECTIVE_URL, &url);
+    CURLU* parts = curl_url();
+    char* host = NULL;
+    char* port_str = NULL;
+    if(url == NULL || parts == NULL || curl_url_set(parts, CURLUPART_URL, url, 0) != CURLUE_OK ||
+       curl_url_get(parts, CURLUPART_HOST, &host, 0) != CURLUE_OK || curl_url_get(parts, CURLUPART_PORT, &port_str, CURLU_DEFAULT_PORT) != CURLUE_OK) {
+        curl_free(host);
+        curl_url_cleanup(parts);
+        return;
+    }
+    long port = strtol(port_str, NULL, 10);
+    curl_free(port_str);
+    curl_url_cleanup(parts);
+
+    struct net_cache_dns* entry = net_cache_find(nc, host, port);
+    char* ip = NULL;
+    curl_easy_getinfo(handle, CURLINFO_PRIMARY_IP, &ip);
+    if(err == CURLE_COULDNT_CONNECT || err == CURLE_OPERATION_TIMEDOUT) {
+        if(entry != NULL && entry->expires != 0) {
+            entry->expires = 0;
+            nc->changed = 1;
+            net_cache_build_resolve(nc);
+        }
+    }
+    // Hosts which are addresses already aren't worth keeping, and using a loaded address doesn't
+    // make it any fresher
+    else if(ip != NULL && ip[0] != '\0' && strcmp(ip, host) != 0 && (entry == NULL || !entry->from_file || strcmp(entry->addr, ip) != 0)) {
+        net_cache_put_dns(nc, host, port, ip, time(NULL) + NET_CACHE_DNS_TTL, 0);
+        nc->changed = 1;
+    }
+    curl_free(host);
+}
+
+// Writes the cache back (merging what other processes wrote since it was read) and frees it
+void net_cache_close(struct net_cache* nc) {
+    int lock = -1;
+    FILE* file = NULL;
+    char tmp_path[NET_CACHE_PATH_LEN + 16];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%li", nc->path, (long)getpid());
+    if(nc->changed || NET_CACHE_TLS)
+        lock = net_cache_lock(nc, LOCK_EX);
+    if(lock != -1)
+        file = fopen(tmp_path, "w");
+    if(file != NULL) {
+        fchmod(fileno(file), 0600);
+        // Sessions imported on start are set aside: they're exported again if still usable
+        int n_loaded = 0;
+        char* loaded[NET_CACHE_TLS_N];
+        for(int n = 0; n < nc->n_tls; ++n) {
+            if(nc->tls[n].imported)
+                loaded[n_loaded++] = nc->tls[n].line;
+            else
+                free(nc->tls[n].line);
+        }
+        nc->n_tls = 0;
+        net_cache_read(nc, 0);
+        int n_tls = 0;
+#if NET_CACHE_TLS
+        CURL* handle = curl_easy_init();
+        if(handle != NULL) {
+            curl_easy_setopt(handle, CURLOPT_SHARE, nc->share);
+            curl_easy_ssls_export(handle, net_cache_export_tls, nc);
+            curl_easy_cleanup(handle);
+        }
+        for(; n_tls < nc->n_exported; ++n_tls)
+            fprintf(file, "%s\n", nc->exported[n_tls]);
+#endif
+        // Then the rest of the file (sessions other processes saved since, or ones which couldn't
+        // be imported), while there's room
+        for(int n = 0; n < nc->n_tls && n_tls < NET_CACHE_TLS_N; ++n) {
+#if NET_CACHE_TLS
+            if(net_cache_tls_listed(nc->tls[n].line, nc->exported, nc->n_exported) || net_cache_tls_listed(nc->tls[n].line, loaded, n_loaded))
+                continue;
+#endif
+            fprintf(file, "%s\n", nc->tls[n].line);
+            ++n_tls;
+        }
+        for(int n = 0; n < n_loaded; ++n)
+            free(loaded[n]);
+
+        time_t now = time(NULL);
+        for(int n = 0; n < nc->n_dns; ++n) {
+            if(nc->dns[n].expires > now)
+                fprintf(file, "dns %lld %s %ld %s\n", (long long)nc->dns[n].expires, nc->dns[n].host, nc->dns[n].port, nc->dns[n].addr);
+        }
+        if(fclose(file) != 0 || rename(tmp_path, nc->path) != 0) {
+            unlink(tmp_path);
+            fprintf(stderr, "fopen@net_cache_close: Could not write %s!\n", nc->path);
+        }
+        else if(nc->debug)
+            fprintf(stderr, "@net_cache_close: Saved %i addresses and %i TLS sessions\n", nc->n_dns, n_tls);
+    }
+    if(lock != -1)
+        net_cache_unlock(lock);
+
+    for(int n = 0; n < nc->n_tls; ++n)
+        free(nc->tls[n].line);
+#if NET_CACHE_TLS
+    for(int n = 0; n < nc->n_exported; ++n)
+        free(nc->exported[n]);
+#endif
+    curl_slist_free_all(nc->resolve);
+    curl_share_cleanup(nc->share);
+}
+
+#endif
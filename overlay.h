@@ -0,0 +1,153 @@
+#ifndef TERMKCD_OVERLAY_H
+#define TERMKCD_OVERLAY_H
+
+// Text overlay for the framebuffer viewer, showing the comic's number, title and alt text at the
+// bottom of the screen. Glyphs are rasterized once from the embedded font into an atlas, already
+// in the framebuffer's pixel format and with the box's background, so drawing text is only a
+// memcpy per glyph row. The word-wrapped layout only depends on the screen size, so it's also
+// computed once.
+
+#include "font.h"
+
+#define OVERLAY_SCALE 2     // Font pixels are drawn as OVERLAY_SCALE * OVERLAY_SCALE squares
+#define OVERLAY_PADDING 8   // Space between the box's edge and the text, in pixels
+#define OVERLAY_MAX_LINES 16
+
+struct overlay_line {
+    size_t start; // Offset into the overlay's text
+    size_t len;
+};
+
+struct overlay {
+    char* text;             // "#num: title", a newline, then the alt text
+    int bpp;                // Format the atlas was made for, 0 if not made yet
+    int cell_w;             // Glyph cell size, including spacing
+    int cell_h;
+    unsigned char* atlas;   // Every glyph's cell, in framebuffer format
+    int layout_cols;        // Width the layout was wrapped to, in glyphs
+    struct overlay_line lines[OVERLAY_MAX_LINES];
+    int n_lines;
+    int box_t;              // First screen row it covers, down to the bottom
+};
+
+// Copies the text to show. Returns 0 if out of memory
+int overlay_init(struct overlay* ov, const char* num, const char* title, const char* alt) {
+    memset(ov, 0, sizeof(struct overlay));
+    size_t len = strlen(num) + strlen(title) + strlen(alt) + 5;
+    ov->text = malloc(len);
+    if(ov->text == NULL) {
+        fprintf(stderr, "malloc@overlay_init: Out of memory!\n");
+        return 0;
+    }
+    snprintf(ov->text, len, "#%s: %s\n%s", num, title, alt);
+    return 1;
+}
+
+void overlay_free(struct overlay* ov) {
+    free(ov->text);
+    free(ov->atlas);
+    ov->text = NULL;
+    ov->atlas = NULL;
+}
+
+// Rasterizes every glyph, white on the box's colour, for bpp bytes per pixel. Returns 0 if out of memory
+int overlay_make_atlas(struct overlay* ov, int bpp, unsigned char bg) {
+    ov->cell_w = (FONT_GLYPH_W + 1) * OVERLAY_SCALE;
+    ov->cell_h = (FONT_GLYPH_H + 2) * OVERLAY_SCALE;
+    size_t glyph_len = ov->cell_w * ov->cell_h * bpp;
+    unsigned char* atlas = malloc(glyph_len * FONT_GLYPHS);
+    if(atlas == NULL) {
+        fprintf(stderr, "malloc@overlay_make_atlas: Out of memory!\n");
+        return 0;
+    }
+
+    memset(atlas, bg, glyph_len * FONT_GLYPHS);
+    for(int g = 0; g < FONT_GLYPHS; ++g) {
+        for(int y = 0; y < FONT_GLYPH_H * OVERLAY_SCALE; ++y) {
+            unsigned char bits = termkcd_font[g * FONT_GLYPH_H + y / OVERLAY_SCALE];
+            unsigned char* row = atlas + (g * glyph_len) + (y * ov->cell_w * bpp);
+            for(int x = 0; x < FONT_GLYPH_W * OVERLAY_SCALE; ++x) {
+                if(bits & (1 << (FONT_GLYPH_W - 1 - x / OVERLAY_SCALE)))
+                    memset(row + (x * bpp), 255, 3);
+            }
+        }
+    }
+    free(ov->atlas);
+    ov->atlas = atlas;
+    ov->bpp = bpp;
+    return 1;
+}
+
+// Word-wraps the text to cols glyphs per line
+void overlay_layout(struct overlay* ov, int cols) {
+    ov->layout_cols = cols;
+    ov->n_lines = 0;
+    size_t len = strlen(ov->text);
+    size_t pos = 0;
+    while(pos < len && ov->n_lines < OVERLAY_MAX_LINES) {
+        // As much as fits, going back to the last space if that ends inside a word. Words longer
+        // than a whole line are broken anywhere
+        size_t end = pos;
+        while(end < len && ov->text[end] != '\n' && end - pos < (size_t)cols)
+            ++end;
+        size_t line_end = end;
+        if(end < len && ov->text[end] != '\n' && ov->text[end] != ' ') {
+            size_t space = end;
+            while(space > pos && ov->text[space] != ' ')
+                --space;
+            if(space > pos)
+                line_end = space;
+        }
+
+        ov->lines[ov->n_lines++] = (struct overlay_line){pos, line_end - pos};
+        pos = line_end;
+        // Skip the space or newline the line was broken at
+        if(pos < len && (ov->text[pos] == ' ' || ov->text[pos] == '\n'))
+            ++pos;
+    }
+}
+
+// Draws len characters of text with their top left corner at (x, y), using the atlas (which must
+// have been made for bpp)
+void overlay_draw_text(struct overlay* ov, unsigned char* canvas, size_t ll, int bpp, int x, int y, const char* text, size_t len) {
+    size_t glyph_len = ov->cell_w * ov->cell_h * bpp;
+    size_t row_len = ov->cell_w * bpp;
+    for(size_t c = 0; c < len; ++c) {
+        unsigned char ch = text[c];
+        if(ch < FONT_FIRST || ch > FONT_LAST)
+            ch = '?';
+        const unsigned char* glyph = ov->atlas + ((ch - FONT_FIRST) * glyph_len);
+        unsigned char* dest = canvas + (y * ll) + ((x + c * ov->cell_w) * bpp);
+        for(int row = 0; row < ov->cell_h; ++row)
+            memcpy(dest + (row * ll), glyph + (row * row_len), row_len);
+    }
+}
+
+// Draws the overlay at the bottom of a xres * yres screen, making the atlas and layout first if
+// needed. Returns 0 if out of memory
+int overlay_draw(struct overlay* ov, unsigned char* canvas, size_t ll, int bpp, int xres, int yres, unsigned char bg) {
+    if(ov->bpp != bpp && !overlay_make_atlas(ov, bpp, bg))
+        return 0;
+    int cols = (xres - 2 * OVERLAY_PADDING) / ov->cell_w;
+    if(cols < 1)
+        return 1;
+    if(cols != ov->layout_cols)
+        overlay_layout(ov, cols);
+
+    int box_h = ov->n_lines * ov->cell_h + 2 * OVERLAY_PADDING;
+    if(box_h > yres)
+        box_h = yres;
+    ov->box_t = yres - box_h;
+    for(int y = ov->box_t; y < yres; ++y)
+        stride_memset(canvas + (y * ll), bg, 3, xres, bpp);
+
+    for(int l = 0; l < ov->n_lines; ++l) {
+        int y = ov->box_t + OVERLAY_PADDING + l * ov->cell_h;
+        if(y + ov->cell_h > yres)
+            break;
+        overlay_draw_text(ov, canvas, ll, bpp, OVERLAY_PADDING, y, ov->text + ov->lines[l].start, ov->lines[l].len);
+    }
+    return 1;
+}
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef TERMKCD_POOL_H
+#define TERMKCD_POOL_H
+
+// Fixed-size thread pool running tasks from a FIFO queue
+
+// Include pthreads
+#include <pthread.h>
+#include <unistd.h>
+
+struct pool_task {
+    void (*fn)(void*);
+    void* arg;
+    struct pool_task* next;
+};
+
+struct thread_pool {
+    pthread_t* threads;
+    size_t n_threads;
+    pthread_mutex_t lock;
+    pthread_cond_t task_ready; // Signaled when a task is queued or the pool is stopping
+    pthread_cond_t idle;       // Signaled when the last pending task finishes
+    struct pool_task* head;
+    struct pool_task* tail;
+    size_t pending;            // Queued and running tasks
+    char stopping;
+};
+
+void* thread_pool_worker(void* arg) {
+    struct thread_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    while(1) {
+        while(pool->head == NULL && !pool->stopping)
+            pthread_cond_wait(&pool->task_ready, &pool->lock);
+        if(pool->head == NULL) // Stopping and nothing left to do
+            break;
+
+        struct pool_task* task = pool->head;
+        pool->head = task->next;
+        if(pool->head == NULL)
+            pool->tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        task->fn(task->arg);
+        free(task);
+
+        pthread_mutex_lock(&pool->lock);
+        if(--pool->pending == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+// Starts n_threads workers, or one per online CPU if 0. Returns 0 on failure
+int thread_pool_init(struct thread_pool* pool, size_t n_threads) {
+    if(n_threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = (cpus > 0) ? cpus : 1;
+    }
+
+    memset(pool, 0, sizeof(struct thread_pool));
+    pool->threads = malloc(n_threads * sizeof(pthread_t));
+    if(pool->threads == NULL) {
+        fprintf(stderr, "malloc@thread_pool_init: Out of memory!\n");
+        return 0;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->task_ready, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+
+    for(; pool->n_threads < n_threads; ++pool->n_threads) {
+        if(pthread_create(&pool->threads[pool->n_threads], NULL, thread_pool_worker, pool) != 0) {
+            fprintf(stderr, "pthread_create@thread_pool_init: Could not start worker thread!\n");
+            break;
+        }
+    }
+    // Making do with fewer threads is fine, none isn't
+    return pool->n_threads > 0;
+}
+
+// Queues fn(arg) to be run by a worker. Returns 0 if out of memory
+int thread_pool_submit(struct thread_pool* pool, void (*fn)(void*), void* arg) {
+    struct pool_task* task = malloc(sizeof(struct pool_task));
+    if(task == NULL) {
+        fprintf(stderr, "malloc@thread_pool_submit: Out of memory!\n");
+        return 0;
+    }
+    task->fn = fn;
+    task->arg = arg;
+    task->next = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    if(pool->tail != NULL)
+        pool->tail->next = task;
+    else
+        pool->head = task;
+    pool->tail = task;
+    ++pool->pending;
+    pthread_cond_signal(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+    return 1;
+}
+
+// Waits until every queued task has finished
+void thread_pool_wait(struct thread_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    while(pool->pending > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Finishes every queued task and stops the workers
+void thread_pool_destroy(struct thread_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->task_ready);
+    pthread_mutex_unlock(&pool->lock);
+
+    for(size_t n = 0; n < pool->n_threads; ++n)
+        pthread_join(pool->threads[n], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->task_ready);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+}
+
+#endif
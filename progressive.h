@@ -0,0 +1,576 @@
+#ifndef TERMKCD_PROGRESSIVE_H
+#define TERMKCD_PROGRESSIVE_H
+
+// Progressive decoding for the framebuffer viewer, so a comic is shown as soon as a coarse
+// version of it is decoded instead of once all of it is. The image is decoded by a background
+// thread into a bitmap the viewer draws from, and the viewer is woken up through a pipe whenever
+// there's more to show:
+// - Progressive JPEGs are decoded in buffered-image mode, and shown once the first scan is in
+//   (a smoothed version made from the DC coefficients) and again once all scans are
+// - Baseline JPEGs are decoded at 1/8 scale first, which skips most of the IDCT and colour
+//   conversion, then at full size starting from the rows in view, following the view as the
+//   user pans
+// - Baseline JPEGs much larger than the screen have the part in view decoded at full size before
+//   anything else, cropping columns with jpeg_crop_scanline and skipping rows above the view with
+//   jpeg_skip_scanlines (which doesn't IDCT them). The decoder waits briefly for the viewer to
+//   report its first view
+// - Interlaced (Adam7) PNGs are shown after each pass, with the pass' pixels drawn as blocks
+//   ("rectangle" effect), so the first pass already covers the whole bitmap
+// - Other PNGs can only be shown from the top down, as they are decoded
+// The bitmap is only written to and drawn from with the lock held, a band of rows at a time.
+// Images which are neither interlaced nor multi-scan are only decoded this way if they're big
+// enough to take a while, smaller ones are quicker to decode whole than to hand over band by band.
+// Once decoded, the bitmap is also run-length encoded if asked to, so the viewer can switch to
+// drawing that.
+
+// Includes for the decoder thread and the viewer's wake-up pipe
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#define PROGRESSIVE_BAND 16         // Rows decoded per lock
+#define PROGRESSIVE_INTERVAL 0.05   // Least seconds between wake-ups inside a pass
+#define PROGRESSIVE_VIEW_WAIT 500   // Longest wait for the viewer's first view, in milliseconds
+#define PROGRESSIVE_OVERSIZED 2     // Images this many times the view's size are decoded view first
+#define PROGRESSIVE_MIN_PIXELS (4 << 20) // Smaller single-pass images are decoded whole instead
+
+enum progressive_state {
+    PROGRESSIVE_RUNNING,
+    PROGRESSIVE_DONE,
+    PROGRESSIVE_FAILED              // Or stopped early
+};
+
+// Image rectangle. Right and bottom are exclusive
+struct progressive_rect {
+    size_t l;
+    size_t t;
+    size_t r;
+    size_t b;
+};
+
+struct progressive {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake_fd[2];                 // The decoder writes here when there's more to show
+    const char* file;               // Compressed image. Not owned, must outlive the decode
+    size_t file_len;
+    enum file_ext extension;
+    unsigned char* bitmap;          // BGR, black where nothing was decoded yet
+    size_t w;
+    size_t h;
+    char joined;                    // Whether the decoder thread ended and was joined
+    // Shared with the viewer, under the lock
+    pthread_cond_t viewed;          // Signaled when the view changes or decoding is cancelled
+    struct progressive_rect view;   // Part of the image in view, empty until drawn
+    enum progressive_state state;
+    char cancel;
+    char encode;                    // Run-length encode the bitmap once decoded
+    char has_rle;                   // rle holds the whole decoded image (once state is done)
+    struct rle_image rle;
+    int passes;                     // Passes shown so far
+    double first_pass;              // Seconds until the first pass was ready
+    double decode;                  // Seconds the whole decode took
+    // Decoder thread only
+    char locked;                    // Whether the decoder holds the lock (for error exits)
+    struct progressive_rect sharp;  // Part decoded at full size before the rest
+    double start;
+    double last_wake;
+};
+
+double progressive_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void progressive_lock(struct progressive* prog) {
+    pthread_mutex_lock(&prog->lock);
+    prog->locked = 1;
+}
+
+void progressive_unlock(struct progressive* prog) {
+    prog->locked = 0;
+    pthread_mutex_unlock(&prog->lock);
+}
+
+int progressive_cancelled(struct progressive* prog) {
+    pthread_mutex_lock(&prog->lock);
+    char cancel = prog->cancel;
+    pthread_mutex_unlock(&prog->lock);
+    return cancel;
+}
+
+// Wakes the viewer up, at most every PROGRESSIVE_INTERVAL seconds unless forced
+void progressive_wake(struct progressive* prog, int force) {
+    double now = progressive_now();
+    if(!force && now - prog->last_wake < PROGRESSIVE_INTERVAL)
+        return;
+    prog->last_wake = now;
+    char byte = 0;
+    if(write(prog->wake_fd[1], &byte, 1) != 1) {
+        // Pipe full, so the viewer has a wake-up pending anyway
+    }
+}
+
+void progressive_pass_done(struct progressive* prog) {
+    double elapsed = progressive_now() - prog->start;
+    pthread_mutex_lock(&prog->lock);
+    if(prog->passes++ == 0)
+        prog->first_pass = elapsed;
+    pthread_mutex_unlock(&prog->lock);
+    progressive_wake(prog, 1);
+}
+
+void progressive_end(struct progressive* prog, int ok) {
+    double elapsed = progressive_now() - prog->start;
+    pthread_mutex_lock(&prog->lock);
+    char encode = ok && prog->encode && !prog->cancel;
+    pthread_mutex_unlock(&prog->lock);
+    // Only read from here on, so no lock is needed while encoding
+    char has_rle = encode && rle_encode(&prog->rle, prog->bitmap, prog->w, prog->h);
+    pthread_mutex_lock(&prog->lock);
+    prog->has_rle = has_rle;
+    prog->state = ok ? PROGRESSIVE_DONE : PROGRESSIVE_FAILED;
+    prog->decode = elapsed;
+    char cancel = prog->cancel;
+    pthread_mutex_unlock(&prog->lock);
+    if(!ok && !cancel)
+        fprintf(stderr, "@progressive_end: Could not decode the whole image!\n");
+    progressive_wake(prog, 1);
+}
+
+void progressive_decode_png(struct progressive* prog) {
+    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_infop info_ptr = (png_ptr != NULL) ? png_create_info_struct(png_ptr) : NULL;
+    if(info_ptr == NULL) {
+        png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+        fprintf(stderr, "png_create_read_struct@progressive_decode_png: Could not create png read struct!\n");
+        progressive_end(prog, 0);
+        return;
+    }
+
+    if(setjmp(png_jmpbuf(png_ptr))) {
+        if(prog->locked)
+            progressive_unlock(prog);
+        png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+        progressive_end(prog, 0);
+        return;
+    }
+
+    // The signature was checked by progressive_start
+    struct png_source custom_io = {prog->file, 8, prog->file_len};
+    png_set_read_fn(png_ptr, &custom_io, read_callback_png);
+    png_set_sig_bytes(png_ptr, 8);
+    png_read_info(png_ptr, info_ptr);
+    png_set_bgr8(png_ptr, png_get_color_type(png_ptr, info_ptr), png_get_bit_depth(png_ptr, info_ptr));
+    int passes = png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
+    if(png_get_rowbytes(png_ptr, info_ptr) != prog->w * 3)
+        png_error(png_ptr, "Unexpected row size");
+
+    for(int pass = 0; pass < passes; ++pass) {
+        for(size_t y = 0; y < prog->h; y += PROGRESSIVE_BAND) {
+            if(progressive_cancelled(prog)) {
+                png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+                progressive_end(prog, 0);
+                return;
+            }
+            progressive_lock(prog);
+            for(size_t n = y; n < y + PROGRESSIVE_BAND && n < prog->h; ++n) {
+                png_bytep row = prog->bitmap + (n * prog->w * 3);
+                // Interlaced passes are drawn as blocks, covering what later passes fill in
+                if(passes > 1)
+                    png_read_row(png_ptr, NULL, row);
+                else
+                    png_read_row(png_ptr, row, NULL);
+            }
+            progressive_unlock(prog);
+            progressive_wake(prog, 0);
+        }
+        progressive_pass_done(prog);
+    }
+    png_read_end(png_ptr, info_ptr);
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    progressive_end(prog, 1);
+}
+
+// Reads the header (again), for a decode of the whole image
+void progressive_jpeg_header(struct progressive* prog, j_decompress_ptr cinfo) {
+    jpeg_mem_src(cinfo, (unsigned char*)prog->file, prog->file_len);
+    jpeg_read_header(cinfo, 1);
+    cinfo->out_color_space = JCS_EXT_BGR;
+}
+
+// Decodes an output pass into the bitmap, a band at a time (in buffered-image mode, from the scans
+// up to scan). Returns 0 if cancelled
+int progressive_jpeg_output(struct progressive* prog, j_decompress_ptr cinfo, int scan) {
+    if(cinfo->buffered_image)
+        jpeg_start_output(cinfo, scan);
+    JSAMPROW rows[PROGRESSIVE_BAND];
+    while(cinfo->output_scanline < cinfo->output_height) {
+        if(progressive_cancelled(prog))
+            return 0;
+        size_t y = cinfo->output_scanline;
+        size_t n = 0;
+        for(; n < PROGRESSIVE_BAND && y + n < prog->h; ++n)
+            rows[n] = prog->bitmap + ((y + n) * prog->w * 3);
+        progressive_lock(prog);
+        while(cinfo->output_scanline < y + n)
+            jpeg_read_scanlines(cinfo, rows + (cinfo->output_scanline - y), y + n - cinfo->output_scanline);
+        progressive_unlock(prog);
+        progressive_wake(prog, 0);
+    }
+    if(cinfo->buffered_image)
+        jpeg_finish_output(cinfo);
+    progressive_pass_done(prog);
+    return 1;
+}
+
+// Shows the first scan of a multi-scan image, then all of them. The first one is only a rough
+// version anyway, so it's output without smoothing and with the fast IDCT, which halves its cost.
+// Returns 0 if cancelled
+int progressive_jpeg_scans(struct progressive* prog, j_decompress_ptr cinfo) {
+    cinfo->buffered_image = 1;
+    jpeg_start_decompress(cinfo);
+    int status;
+    do
+        status = jpeg_consume_input(cinfo);
+    while(status != JPEG_SCAN_COMPLETED && status != JPEG_REACHED_EOI && status != JPEG_SUSPENDED);
+    J_DCT_METHOD dct_method = cinfo->dct_method;
+    cinfo->do_block_smoothing = 0;
+    cinfo->dct_method = JDCT_IFAST;
+    if(!progressive_jpeg_output(prog, cinfo, cinfo->input_scan_number))
+        return 0;
+    cinfo->do_block_smoothing = 1;
+    cinfo->dct_method = dct_method;
+    while(!jpeg_input_complete(cinfo) && status != JPEG_SUSPENDED) {
+        status = jpeg_consume_input(cinfo);
+        if(status == JPEG_SCAN_COMPLETED && progressive_cancelled(prog))
+            return 0;
+    }
+    if(!progressive_jpeg_output(prog, cinfo, cinfo->input_scan_number))
+        return 0;
+    jpeg_finish_decompress(cinfo);
+    return 1;
+}
+
+// Decodes only the part of the image in view, with its columns cropped (to whole iMCUs) and the
+// rows above it skipped, so it costs about as much as the view's size. Returns 0 if cancelled
+int progressive_jpeg_view(struct progressive* prog, j_decompress_ptr cinfo, struct progressive_rect* view) {
+    jpeg_start_decompress(cinfo);
+    JDIMENSION x = view->l;
+    JDIMENSION w = view->r - view->l;
+    jpeg_crop_scanline(cinfo, &x, &w);
+    if(view->t > 0)
+        jpeg_skip_scanlines(cinfo, view->t);
+    JSAMPROW rows[PROGRESSIVE_BAND];
+    while(cinfo->output_scanline < view->b) {
+        if(progressive_cancelled(prog))
+            return 0;
+        size_t y = cinfo->output_scanline;
+        size_t n = 0;
+        for(; n < PROGRESSIVE_BAND && y + n < view->b; ++n)
+            rows[n] = prog->bitmap + ((y + n) * prog->w * 3) + (x * 3);
+        progressive_lock(prog);
+        while(cinfo->output_scanline < y + n)
+            jpeg_read_scanlines(cinfo, rows + (cinfo->output_scanline - y), y + n - cinfo->output_scanline);
+        progressive_unlock(prog);
+        progressive_wake(prog, 0);
+    }
+    prog->sharp = (struct progressive_rect){x, view->t, x + w, view->b};
+    progressive_pass_done(prog);
+    // Start over for the rest
+    jpeg_abort_decompress(cinfo);
+    progressive_jpeg_header(prog, cinfo);
+    return 1;
+}
+
+// Decodes a baseline JPEG at 1/8 scale, drawing each pixel as an 8x8 block (except over the part
+// already decoded at full size). Returns 0 if cancelled
+int progressive_jpeg_preview(struct progressive* prog, j_decompress_ptr cinfo) {
+    cinfo->scale_num = 1;
+    cinfo->scale_denom = 8;
+    jpeg_start_decompress(cinfo);
+    unsigned char small[cinfo->output_width * 3];
+    unsigned char wide[prog->w * 3];
+    JSAMPROW row = small;
+    const struct progressive_rect* sharp = &prog->sharp;
+    while(cinfo->output_scanline < cinfo->output_height) {
+        if(progressive_cancelled(prog))
+            return 0;
+        size_t y = cinfo->output_scanline * 8;
+        jpeg_read_scanlines(cinfo, &row, 1);
+        for(size_t x = 0; x < prog->w; ++x)
+            memcpy(wide + (x * 3), small + ((x / 8) * 3), 3);
+        progressive_lock(prog);
+        for(size_t n = y; n < y + 8 && n < prog->h; ++n) {
+            unsigned char* dest = prog->bitmap + (n * prog->w * 3);
+            if(n < sharp->t || n >= sharp->b)
+                memcpy(dest, wide, prog->w * 3);
+            else {
+                memcpy(dest, wide, sharp->l * 3);
+                memcpy(dest + (sharp->r * 3), wide + (sharp->r * 3), (prog->w - sharp->r) * 3);
+            }
+        }
+        progressive_unlock(prog);
+    }
+    progressive_pass_done(prog);
+    // Start over for the full size decode
+    jpeg_abort_decompress(cinfo);
+    progressive_jpeg_header(prog, cinfo);
+    return 1;
+}
+
+// First row from y (wrapping around to the top) which isn't decoded yet
+size_t progressive_next_row(struct progressive* prog, const char* decoded, size_t y) {
+    for(size_t n = 0; n < prog->h; ++n) {
+        if(!decoded[(y + n) % prog->h])
+            return (y + n) % prog->h;
+    }
+    return prog->h;
+}
+
+// Decodes a baseline JPEG at full size, a band at a time. Whenever the view has rows which
+// aren't decoded yet, those come first: the decoder skips ahead to them (which only costs
+// entropy decoding), and starts over from the top later for the rows it skipped. Returns 0 if
+// cancelled
+int progressive_jpeg_rows(struct progressive* prog, j_decompress_ptr cinfo) {
+    char* decoded = calloc(prog->h, 1);
+    if(decoded == NULL) {
+        fprintf(stderr, "malloc@progressive_jpeg_rows: Out of memory!\n");
+        return 0;
+    }
+    jpeg_start_decompress(cinfo);
+    JSAMPROW rows[PROGRESSIVE_BAND];
+    size_t left = prog->h;
+    while(left > 0) {
+        pthread_mutex_lock(&prog->lock);
+        char cancel = prog->cancel;
+        struct progressive_rect view = prog->view;
+        pthread_mutex_unlock(&prog->lock);
+        if(cancel) {
+            free(decoded);
+            return 0;
+        }
+
+        // Rows in view come first, then the ones below the decoder
+        size_t y = progressive_next_row(prog, decoded, view.t);
+        if(y < view.t || y >= view.b)
+            y = progressive_next_row(prog, decoded, cinfo->output_scanline);
+        if(y < cinfo->output_scanline) {
+            jpeg_abort_decompress(cinfo);
+            progressive_jpeg_header(prog, cinfo);
+            jpeg_start_decompress(cinfo);
+        }
+        if(y > cinfo->output_scanline)
+            jpeg_skip_scanlines(cinfo, y - cinfo->output_scanline);
+
+        size_t n = 0;
+        for(; n < PROGRESSIVE_BAND && y + n < prog->h && !decoded[y + n]; ++n)
+            rows[n] = prog->bitmap + ((y + n) * prog->w * 3);
+        progressive_lock(prog);
+        while(cinfo->output_scanline < y + n)
+            jpeg_read_scanlines(cinfo, rows + (cinfo->output_scanline - y), y + n - cinfo->output_scanline);
+        progressive_unlock(prog);
+        memset(decoded + y, 1, n);
+        left -= n;
+        progressive_wake(prog, 0);
+    }
+    free(decoded);
+    // The last rows decoded aren't necessarily the bottom ones
+    jpeg_abort_decompress(cinfo);
+    progressive_pass_done(prog);
+    return 1;
+}
+
+// Waits (briefly) for the viewer to report which part of the image is in view. Returns 0 if it
+// didn't
+int progressive_wait_view(struct progressive* prog, struct progressive_rect* view) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += PROGRESSIVE_VIEW_WAIT * 1000000L;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+    deadline.tv_nsec %= 1000000000L;
+    pthread_mutex_lock(&prog->lock);
+    while(prog->view.r == 0 && !prog->cancel) {
+        if(pthread_cond_timedwait(&prog->viewed, &prog->lock, &deadline) != 0)
+            break;
+    }
+    (*view) = prog->view;
+    pthread_mutex_unlock(&prog->lock);
+    return view->r != 0;
+}
+
+void progressive_decode_jpeg(struct progressive* prog) {
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_custom_error_mgr error_mgr;
+    cinfo.err = jpeg_std_error(&error_mgr.pub);
+    error_mgr.pub.error_exit = jpeg_custom_error_exit;
+    if(setjmp(error_mgr.setjmp_buffer)) {
+        if(prog->locked)
+            progressive_unlock(prog);
+        jpeg_destroy_decompress(&cinfo);
+        progressive_end(prog, 0);
+        return;
+    }
+    jpeg_create_decompress(&cinfo);
+    progressive_jpeg_header(prog, &cinfo);
+
+    // Multi-scan images can't skip ahead cheaply (every scan is entropy decoded before the first
+    // row comes out), so their first scan beats decoding the view first
+    int ok;
+    if(jpeg_has_multiple_scans(&cinfo))
+        ok = progressive_jpeg_scans(prog, &cinfo);
+    else {
+        // Images much bigger than the screen show what's in view first, at full size
+        struct progressive_rect view;
+        ok = 1;
+        if(progressive_wait_view(prog, &view) && (view.r - view.l) * (view.b - view.t) * PROGRESSIVE_OVERSIZED <= prog->w * prog->h)
+            ok = progressive_jpeg_view(prog, &cinfo, &view);
+        if(ok)
+            ok = progressive_jpeg_preview(prog, &cinfo);
+        if(ok)
+            ok = progressive_jpeg_rows(prog, &cinfo);
+    }
+    jpeg_destroy_decompress(&cinfo);
+    progressive_end(prog, ok);
+}
+
+// Tells the decoder which part of the image (in image coordinates) is in view
+void progressive_set_view(struct progressive* prog, size_t x, size_t y, size_t w, size_t h) {
+    pthread_mutex_lock(&prog->lock);
+    prog->view = (struct progressive_rect){x, y, x + w, y + h};
+    pthread_cond_signal(&prog->viewed);
+    pthread_mutex_unlock(&prog->lock);
+}
+
+void* progressive_thread(void* arg) {
+    struct progressive* prog = arg;
+    if(prog->extension == FILE_EXT_PNG)
+        progressive_decode_png(prog);
+    else
+        progressive_decode_jpeg(prog);
+    return NULL;
+}
+
+// Gets an image's size from its header, and whether it's stored in passes (interlaced PNGs and
+// multi-scan JPEGs). Returns 0 if it's unreadable
+int progressive_read_header(const struct mem_block* file, enum file_ext extension, size_t* w, size_t* h, int* passes) {
+    if(extension == FILE_EXT_PNG) {
+        // The IHDR chunk comes first, right after the signature
+        const unsigned char* ihdr = (const unsigned char*)file->ptr + 8;
+        if(file->i < 33 || png_sig_cmp((png_bytep)file->ptr, 0, 8) || memcmp(ihdr + 4, "IHDR", 4) != 0)
+            return 0;
+        (*w) = png_get_uint_32(ihdr + 8);
+        (*h) = png_get_uint_32(ihdr + 12);
+        (*passes) = ihdr[20] == PNG_INTERLACE_ADAM7;
+    }
+    else {
+        struct jpeg_decompress_struct cinfo;
+        struct jpeg_custom_error_mgr error_mgr;
+        cinfo.err = jpeg_std_error(&error_mgr.pub);
+        error_mgr.pub.error_exit = jpeg_custom_error_exit;
+        if(setjmp(error_mgr.setjmp_buffer)) {
+            jpeg_destroy_decompress(&cinfo);
+            return 0;
+        }
+        jpeg_create_decompress(&cinfo);
+        jpeg_mem_src(&cinfo, (unsigned char*)file->ptr, file->i);
+        jpeg_read_header(&cinfo, 1);
+        (*w) = cinfo.image_width;
+        (*h) = cinfo.image_height;
+        (*passes) = jpeg_has_multiple_scans(&cinfo);
+        jpeg_destroy_decompress(&cinfo);
+    }
+    return (*w) > 0 && (*h) > 0;
+}
+
+// Starts decoding an image in the background, setting w and h to its size. file must outlive
+// the decode. Returns 0 if it can't be decoded or isn't worth decoding progressively (and nothing
+// was started)
+int progressive_start(struct progressive* prog, const struct mem_block* file, enum file_ext extension, size_t* w, size_t* h) {
+    memset(prog, 0, sizeof(struct progressive));
+    prog->file = file->ptr;
+    prog->file_len = file->i;
+    prog->extension = extension;
+    prog->first_pass = -1;
+    prog->decode = -1;
+    int passes;
+    if(!progressive_read_header(file, extension, &prog->w, &prog->h, &passes))
+        return 0;
+    if(!passes && prog->w * prog->h < PROGRESSIVE_MIN_PIXELS)
+        return 0;
+
+    prog->bitmap = bitmap_calloc(prog->w * prog->h * 3);
+    if(prog->bitmap == NULL) {
+        fprintf(stderr, "malloc@progressive_start: Out of memory!\n");
+        return 0;
+    }
+    if(pipe(prog->wake_fd) == -1) {
+        bitmap_free(prog->bitmap);
+        fprintf(stderr, "pipe@progressive_start: Could not create wake-up pipe!\n");
+        return 0;
+    }
+    // Neither side ever waits on the pipe itself
+    fcntl(prog->wake_fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(prog->wake_fd[1], F_SETFL, O_NONBLOCK);
+
+    pthread_mutex_init(&prog->lock, NULL);
+    pthread_cond_init(&prog->viewed, NULL);
+    prog->start = progressive_now();
+    if(pthread_create(&prog->thread, NULL, progressive_thread, prog) != 0) {
+        pthread_cond_destroy(&prog->viewed);
+        pthread_mutex_destroy(&prog->lock);
+        close(prog->wake_fd[0]);
+        close(prog->wake_fd[1]);
+        bitmap_free(prog->bitmap);
+        fprintf(stderr, "pthread_create@progressive_start: Could not start decoder thread!\n");
+        return 0;
+    }
+    (*w) = prog->w;
+    (*h) = prog->h;
+    return 1;
+}
+
+// Handles a wake-up in the viewer. Returns the descriptor to wait on for the next one, or -1 once
+// decoding has ended
+int progressive_woken(struct progressive* prog) {
+    char buf[64];
+    while(read(prog->wake_fd[0], buf, sizeof(buf)) > 0);
+    pthread_mutex_lock(&prog->lock);
+    enum progressive_state state = prog->state;
+    pthread_mutex_unlock(&prog->lock);
+    return (state == PROGRESSIVE_RUNNING) ? prog->wake_fd[0] : -1;
+}
+
+// Waits for the decoder to end, stopping it first unless finish is set. Returns 1 if the whole
+// image was decoded
+int progressive_stop(struct progressive* prog, int finish) {
+    if(!prog->joined) {
+        if(!finish) {
+            pthread_mutex_lock(&prog->lock);
+            prog->cancel = 1;
+            pthread_cond_signal(&prog->viewed);
+            pthread_mutex_unlock(&prog->lock);
+        }
+        pthread_join(prog->thread, NULL);
+        prog->joined = 1;
+    }
+    return prog->state == PROGRESSIVE_DONE;
+}
+
+// Stops decoding and frees everything but the file
+void progressive_free(struct progressive* prog) {
+    progressive_stop(prog, 0);
+    pthread_cond_destroy(&prog->viewed);
+    pthread_mutex_destroy(&prog->lock);
+    close(prog->wake_fd[0]);
+    close(prog->wake_fd[1]);
+    if(prog->has_rle)
+        rle_image_free(&prog->rle);
+    bitmap_free(prog->bitmap);
+}
+
+#endif
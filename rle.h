@@ -0,0 +1,164 @@
+#ifndef TERMKCD_RLE_H
+#define TERMKCD_RLE_H
+
+// Run-length encoded bitmaps. Comics are mostly line art on white, so each row is stored as spans
+// which are either a run of a single colour or literal pixels. Blitting fills runs with wide
+// stores instead of copying pixel by pixel.
+
+// Include stdint for span fields and wide stores
+#include <stdint.h>
+
+// Shorter runs are kept as literal pixels, as a span costs more than a few pixels
+#define RLE_MIN_RUN 8
+// Colour value marking a literal span
+#define RLE_LITERAL UINT32_MAX
+
+struct rle_span {
+    uint32_t len;    // Pixels covered
+    uint32_t colour; // 0x00RRGGBB colour of a run (BGR0 in little-endian memory), or RLE_LITERAL
+    size_t literal;  // Offset of a literal span's pixels in literals (in pixels)
+};
+
+struct rle_image {
+    size_t w;
+    size_t h;
+    size_t* rows;            // Index of each row's first span, plus one past the last span
+    struct rle_span* spans;
+    unsigned char* literals; // BGR pixels of literal spans
+    size_t n_spans;
+    size_t n_literals;
+};
+
+// Length of the run of identical pixels starting at x
+size_t rle_run_length(const unsigned char* row, size_t x, size_t w) {
+    size_t end = x + 1;
+    while(end < w && memcmp(row + (end * 3), row + (x * 3), 3) == 0)
+        ++end;
+    return end - x;
+}
+
+// Encodes (or, if img is NULL, only measures) a BGR bitmap's rows
+void rle_encode_rows(struct rle_image* img, const unsigned char* bmp, size_t w, size_t h, size_t* n_spans, size_t* n_literals) {
+    size_t spans = 0;
+    size_t literals = 0;
+    for(size_t y = 0; y < h; ++y) {
+        const unsigned char* row = bmp + (y * w * 3);
+        if(img != NULL)
+            img->rows[y] = spans;
+
+        size_t x = 0;
+        size_t lit_start = x;
+        while(x <= w) {
+            size_t run = (x < w) ? rle_run_length(row, x, w) : 0;
+            if(x == w || run >= RLE_MIN_RUN) {
+                // Flush pending literal pixels
+                if(x > lit_start) {
+                    if(img != NULL) {
+                        img->spans[spans] = (struct rle_span){x - lit_start, RLE_LITERAL, literals};
+                        memcpy(img->literals + (literals * 3), row + (lit_start * 3), (x - lit_start) * 3);
+                    }
+                    ++spans;
+                    literals += x - lit_start;
+                }
+                if(x == w)
+                    break;
+
+                if(img != NULL) {
+                    const unsigned char* px = row + (x * 3);
+                    img->spans[spans] = (struct rle_span){run, px[0] | (px[1] << 8) | ((uint32_t)px[2] << 16), 0};
+                }
+                ++spans;
+                lit_start = x + run;
+            }
+            x += run;
+        }
+    }
+    if(img != NULL)
+        img->rows[h] = spans;
+    (*n_spans) = spans;
+    (*n_literals) = literals;
+}
+
+// Memory used by an encoded image
+size_t rle_image_size(struct rle_image* img) {
+    return (img->h + 1) * sizeof(size_t) + img->n_spans * sizeof(struct rle_span) + img->n_literals * 3;
+}
+
+// Encodes a BGR bitmap. Returns 0 if out of memory, or if the encoded image wouldn't be smaller
+// than the bitmap, in which case the bitmap should be used as is
+int rle_encode(struct rle_image* img, const unsigned char* bmp, size_t w, size_t h) {
+    memset(img, 0, sizeof(struct rle_image));
+    img->w = w;
+    img->h = h;
+
+    // Measure first so everything is allocated once, at its exact size
+    rle_encode_rows(NULL, bmp, w, h, &img->n_spans, &img->n_literals);
+    if(rle_image_size(img) >= w * h * 3)
+        return 0;
+
+    img->rows = malloc((h + 1) * sizeof(size_t));
+    img->spans = malloc(img->n_spans * sizeof(struct rle_span));
+    img->literals = malloc(img->n_literals * 3 + 1);
+    if(img->rows == NULL || img->spans == NULL || img->literals == NULL) {
+        free(img->rows);
+        free(img->spans);
+        free(img->literals);
+        fprintf(stderr, "malloc@rle_encode: Out of memory!\n");
+        return 0;
+    }
+
+    rle_encode_rows(img, bmp, w, h, &img->n_spans, &img->n_literals);
+    return 1;
+}
+
+void rle_image_free(struct rle_image* img) {
+    free(img->rows);
+    free(img->spans);
+    free(img->literals);
+    img->rows = NULL;
+    img->spans = NULL;
+    img->literals = NULL;
+}
+
+// Fills n pixels with a colour
+void rle_fill(unsigned char* dest, uint32_t colour, size_t n, int bpp) {
+    if(bpp == 4) { // One store per pixel
+        uint32_t* px = (uint32_t*)dest;
+        for(size_t i = 0; i < n; ++i)
+            px[i] = colour;
+    }
+    else if(n > 0) { // Write the first pixel, then keep doubling it
+        memcpy(dest, &colour, 3);
+        for(size_t i = 3; i < bpp * n; ) {
+            size_t chunk = i;
+            if(chunk > bpp * n - i)
+                chunk = bpp * n - i;
+            memcpy(dest + i, dest, chunk);
+            i += chunk;
+        }
+    }
+}
+
+// Copies the w * h area at (x, y) of the image to dest (framebuffer-like memory with line length
+// ll and bpp bytes per pixel) at (dest_x, dest_y)
+void rle_image_blit(struct rle_image* img, unsigned char* dest, size_t ll, int bpp, size_t dest_x, size_t dest_y, size_t x, size_t y, size_t w, size_t h) {
+    for(size_t row = 0; row < h; ++row) {
+        unsigned char* out = dest + ((dest_y + row) * ll) + (dest_x * bpp);
+        size_t span_x = 0; // Image X of the current span
+        for(size_t s = img->rows[y + row]; s < img->rows[y + row + 1] && span_x < x + w; ++s) {
+            struct rle_span* span = &img->spans[s];
+            size_t span_end = span_x + span->len;
+            if(span_end > x) { // Clip the span against the viewport
+                size_t from = (span_x > x) ? span_x : x;
+                size_t to = (span_end < x + w) ? span_end : x + w;
+                if(span->colour == RLE_LITERAL)
+                    stride_memcpy(out + ((from - x) * bpp), img->literals + ((span->literal + from - span_x) * 3), to - from, bpp, 3);
+                else
+                    rle_fill(out + ((from - x) * bpp), span->colour, to - from, bpp);
+            }
+            span_x = span_end;
+        }
+    }
+}
+
+#endif
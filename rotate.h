@@ -0,0 +1,121 @@
+#ifndef TERMKCD_ROTATE_H
+#define TERMKCD_ROTATE_H
+
+// Bitmap rotation, for displays mounted sideways or upside down. The bitmap is rotated once after
+// decoding, so the viewer keeps copying plain rows. 90 and 270 degree rotations are transposes,
+// done in square blocks which fit in L1 cache: each block's rows are widened to 32-bit pixels,
+// transposed 4x4 pixels at a time in SSE2 registers, and narrowed back into the output's rows, so
+// both bitmaps are only ever walked along rows.
+
+// Include stdint for the widened pixels
+#include <stdint.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Block size, in pixels. Must be a multiple of 4
+#define ROTATE_BLOCK 32
+
+// Transposes an n * n block of 32-bit pixels (n a multiple of 4, rows ROTATE_BLOCK apart)
+void rotate_transpose_block(const uint32_t* in, uint32_t* out, int n) {
+    for(int by = 0; by < n; by += 4) {
+        for(int bx = 0; bx < n; bx += 4) {
+            const uint32_t* src = in + (by * ROTATE_BLOCK) + bx;
+            uint32_t* dest = out + (bx * ROTATE_BLOCK) + by;
+#if defined(__SSE2__)
+            __m128i r0 = _mm_loadu_si128((const __m128i*)(src));
+            __m128i r1 = _mm_loadu_si128((const __m128i*)(src + ROTATE_BLOCK));
+            __m128i r2 = _mm_loadu_si128((const __m128i*)(src + 2 * ROTATE_BLOCK));
+            __m128i r3 = _mm_loadu_si128((const __m128i*)(src + 3 * ROTATE_BLOCK));
+            __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+            __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+            __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+            __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+            _mm_storeu_si128((__m128i*)(dest), _mm_unpacklo_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(dest + ROTATE_BLOCK), _mm_unpackhi_epi64(t0, t1));
+            _mm_storeu_si128((__m128i*)(dest + 2 * ROTATE_BLOCK), _mm_unpacklo_epi64(t2, t3));
+            _mm_storeu_si128((__m128i*)(dest + 3 * ROTATE_BLOCK), _mm_unpackhi_epi64(t2, t3));
+#else
+            for(int y = 0; y < 4; ++y) {
+                for(int x = 0; x < 4; ++x)
+                    dest[x * ROTATE_BLOCK + y] = src[y * ROTATE_BLOCK + x];
+            }
+#endif
+        }
+    }
+}
+
+// Rotates a w * h BGR bitmap clockwise by 90, 180 or 270 degrees into out
+void rotate_bitmap_to(const unsigned char* bmp, unsigned char* out, size_t w, size_t h, int degrees) {
+    if(degrees == 180) { // Rows in reverse order, pixels in reverse order
+        for(size_t y = 0; y < h; ++y) {
+            const unsigned char* src = bmp + (y * w * 3);
+            unsigned char* dest = out + ((h - 1 - y) * w * 3) + ((w - 1) * 3);
+            for(size_t x = 0; x < w; ++x, src += 3, dest -= 3)
+                memcpy(dest, src, 3);
+        }
+        return;
+    }
+
+    // Source (x, y) goes to (h - 1 - y, x) when turning clockwise, (y, w - 1 - x) otherwise
+    const int clockwise = degrees == 90;
+    uint32_t in_block[ROTATE_BLOCK * ROTATE_BLOCK];
+    uint32_t out_block[ROTATE_BLOCK * ROTATE_BLOCK];
+    for(size_t by = 0; by < h; by += ROTATE_BLOCK) {
+        size_t bh = (h - by < ROTATE_BLOCK) ? h - by : ROTATE_BLOCK;
+        for(size_t bx = 0; bx < w; bx += ROTATE_BLOCK) {
+            size_t bw = (w - bx < ROTATE_BLOCK) ? w - bx : ROTATE_BLOCK;
+
+            // Widen the block's rows, loading 4 bytes per pixel except for the last one
+            for(size_t y = 0; y < bh; ++y) {
+                const unsigned char* src = bmp + (((by + y) * w + bx) * 3);
+                uint32_t* row = in_block + (y * ROTATE_BLOCK);
+                for(size_t x = 0; x + 1 < bw; ++x, src += 3) {
+                    memcpy(&row[x], src, 4);
+                    row[x] &= 0xFFFFFF;
+                }
+                row[bw - 1] = src[0] | (src[1] << 8) | ((uint32_t)src[2] << 16);
+            }
+
+            // Edge blocks are transposed whole, only their valid part is written back
+            rotate_transpose_block(in_block, out_block, (bw > bh ? bw + 3 : bh + 3) & ~3);
+
+            // Row x of the transposed block holds source column bx + x. It goes to output row
+            // bx + x from column h - bh - by backwards when turning clockwise, or to output row
+            // w - 1 - (bx + x) from column by otherwise. Each pixel is stored as 4 bytes, the
+            // extra one being overwritten by the next pixel
+            for(size_t x = 0; x < bw; ++x) {
+                const uint32_t* row = out_block + (x * ROTATE_BLOCK);
+                unsigned char* dest;
+                if(clockwise) {
+                    dest = out + (((bx + x) * h + (h - bh - by)) * 3);
+                    for(size_t y = bh - 1; y > 0; --y, dest += 3)
+                        memcpy(dest, &row[y], 4);
+                    memcpy(dest, &row[0], 3);
+                }
+                else {
+                    dest = out + (((w - 1 - bx - x) * h + by) * 3);
+                    for(size_t y = 0; y + 1 < bh; ++y, dest += 3)
+                        memcpy(dest, &row[y], 4);
+                    memcpy(dest, &row[bh - 1], 3);
+                }
+            }
+        }
+    }
+}
+
+// Rotates a BGR bitmap clockwise by 90, 180 or 270 degrees into a new bitmap, setting out_w and
+// out_h to its size. Returns NULL if out of memory
+unsigned char* rotate_bitmap(const unsigned char* bmp, size_t w, size_t h, int degrees, size_t* out_w, size_t* out_h) {
+    unsigned char* out = bitmap_alloc(w * h * 3);
+    if(out == NULL) {
+        fprintf(stderr, "malloc@rotate_bitmap: Out of memory!\n");
+        return NULL;
+    }
+    rotate_bitmap_to(bmp, out, w, h, degrees);
+    (*out_w) = (degrees == 180) ? w : h;
+    (*out_h) = (degrees == 180) ? h : w;
+    return out;
+}
+
+#endif
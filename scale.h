@@ -0,0 +1,117 @@
+#ifndef TERMKCD_SCALE_H
+#define TERMKCD_SCALE_H
+
+// Bitmap downscaling with a box filter (every destination pixel is the average of the source
+// pixels it covers). Rows are pushed one at a time, so images can be scaled while they're being
+// decoded without ever holding the full-size bitmap. Only downscaling is supported.
+
+// Include stdint for fixed-size accumulators
+#include <stdint.h>
+
+struct box_scaler {
+    size_t src_w;
+    size_t src_h;
+    size_t dst_w;
+    size_t dst_h;
+    size_t src_y;       // Next source row
+    size_t* x_map;      // Destination column of each source column
+    size_t* col_count;  // Source columns per destination column
+    uint32_t* acc;      // Channel sums of each destination pixel
+};
+
+// Gets the size of a w * h image scaled down to fit in max_w * max_h, keeping its aspect ratio.
+// Images which already fit aren't scaled up
+void scale_fit(size_t w, size_t h, size_t max_w, size_t max_h, size_t* out_w, size_t* out_h) {
+    (*out_w) = w;
+    (*out_h) = h;
+    if(w > max_w) {
+        (*out_w) = max_w;
+        (*out_h) = h * max_w / w;
+    }
+    if(*out_h > max_h) {
+        (*out_h) = max_h;
+        (*out_w) = w * max_h / h;
+    }
+    if(*out_w == 0)
+        (*out_w) = 1;
+    if(*out_h == 0)
+        (*out_h) = 1;
+}
+
+int box_scaler_init(struct box_scaler* scaler, size_t src_w, size_t src_h, size_t dst_w, size_t dst_h) {
+    scaler->src_w = src_w;
+    scaler->src_h = src_h;
+    scaler->dst_w = dst_w > src_w ? src_w : dst_w;
+    scaler->dst_h = dst_h > src_h ? src_h : dst_h;
+    scaler->src_y = 0;
+    scaler->x_map = malloc(src_w * sizeof(size_t));
+    scaler->col_count = calloc(scaler->dst_w, sizeof(size_t));
+    scaler->acc = calloc(scaler->dst_w * scaler->dst_h * 3, sizeof(uint32_t));
+    if(scaler->x_map == NULL || scaler->col_count == NULL || scaler->acc == NULL) {
+        free(scaler->x_map);
+        free(scaler->col_count);
+        free(scaler->acc);
+        fprintf(stderr, "malloc@box_scaler_init: Out of memory!\n");
+        return 0;
+    }
+
+    for(size_t x = 0; x < src_w; ++x) {
+        scaler->x_map[x] = x * scaler->dst_w / src_w;
+        ++scaler->col_count[scaler->x_map[x]];
+    }
+    return 1;
+}
+
+// Adds the next source row (src_w BGR pixels)
+void box_scaler_push_row(struct box_scaler* scaler, const unsigned char* row) {
+    if(scaler->src_y >= scaler->src_h)
+        return;
+    uint32_t* acc_row = scaler->acc + (scaler->src_y * scaler->dst_h / scaler->src_h) * scaler->dst_w * 3;
+    for(size_t x = 0; x < scaler->src_w; ++x) {
+        uint32_t* acc = acc_row + scaler->x_map[x] * 3;
+        acc[0] += row[x * 3];
+        acc[1] += row[x * 3 + 1];
+        acc[2] += row[x * 3 + 2];
+    }
+    ++scaler->src_y;
+}
+
+// Frees the scaler and returns the scaled BGR bitmap (dst_w * dst_h), or NULL if out of memory
+unsigned char* box_scaler_finish(struct box_scaler* scaler) {
+    unsigned char* dst = malloc(scaler->dst_w * scaler->dst_h * 3);
+    if(dst == NULL)
+        fprintf(stderr, "malloc@box_scaler_finish: Out of memory!\n");
+    else {
+        size_t src_y = 0;
+        for(size_t y = 0; y < scaler->dst_h; ++y) {
+            // Source rows covered by this destination row
+            size_t rows = 0;
+            while(src_y < scaler->src_h && src_y * scaler->dst_h / scaler->src_h == y) {
+                ++rows;
+                ++src_y;
+            }
+            for(size_t x = 0; x < scaler->dst_w; ++x) {
+                size_t count = rows * scaler->col_count[x];
+                size_t off = (y * scaler->dst_w + x) * 3;
+                for(int c = 0; c < 3; ++c)
+                    dst[off + c] = count ? scaler->acc[off + c] / count : 0;
+            }
+        }
+    }
+    free(scaler->x_map);
+    free(scaler->col_count);
+    free(scaler->acc);
+    return dst;
+}
+
+// Scales a whole BGR bitmap down to dst_w * dst_h
+unsigned char* scale_bitmap(const unsigned char* src, size_t w, size_t h, size_t dst_w, size_t dst_h) {
+    struct box_scaler scaler;
+    if(!box_scaler_init(&scaler, w, h, dst_w, dst_h))
+        return NULL;
+    for(size_t y = 0; y < h; ++y)
+        box_scaler_push_row(&scaler, src + (y * w * 3));
+    return box_scaler_finish(&scaler);
+}
+
+#endif
@@ -0,0 +1,525 @@
+#ifndef TERMKCD_TERMINAL_H
+#define TERMKCD_TERMINAL_H
+
+// Viewer for terminals, for when the framebuffer isn't available (e.g. over SSH or in a terminal
+// emulator). Images are scaled to fit the terminal's width and drawn with truecolour half-block
+// characters, sixel or the kitty graphics protocol. Every frame is built in memory and written at
+// once, and only what changed since the last frame is sent: scrolling moves what's already on
+// screen with the terminal's own scrolling, so only the newly exposed rows are drawn.
+
+// Includes for terminal size, raw input and output
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+// zlib, for compressing kitty image data
+#include <zlib.h>
+
+enum term_backend {
+    TERM_BACKEND_HALFBLOCK, // Two pixels per cell, as the foreground and background of a "▀"
+    TERM_BACKEND_SIXEL,
+    TERM_BACKEND_KITTY
+};
+
+// Kitty image and placement IDs
+#define TERM_KITTY_ID 7101
+// Unknown cell or strip, always redrawn
+#define TERM_UNKNOWN UINT64_MAX
+
+// Output buffer. Unlike memapp, this grows geometrically, as it's appended to in tiny pieces
+struct term_buf {
+    char* ptr;
+    size_t i;
+    size_t cap;
+};
+
+int term_buf_reserve(struct term_buf* buf, size_t len) {
+    if(buf->i + len <= buf->cap)
+        return 1;
+    size_t cap = buf->cap ? buf->cap : 4096;
+    while(cap < buf->i + len)
+        cap *= 2;
+    char* ptr = realloc(buf->ptr, cap);
+    if(ptr == NULL) {
+        fprintf(stderr, "realloc@term_buf_reserve: Out of memory!\n");
+        return 0;
+    }
+    buf->ptr = ptr;
+    buf->cap = cap;
+    return 1;
+}
+
+int term_buf_append(struct term_buf* buf, const void* data, size_t len) {
+    if(!term_buf_reserve(buf, len))
+        return 0;
+    memcpy(buf->ptr + buf->i, data, len);
+    buf->i += len;
+    return 1;
+}
+
+int term_buf_printf(struct term_buf* buf, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(len < 0 || !term_buf_reserve(buf, len + 1))
+        return 0;
+    va_start(args, format);
+    vsnprintf(buf->ptr + buf->i, len + 1, format, args);
+    va_end(args);
+    buf->i += len;
+    return 1;
+}
+
+// Writes the whole buffer to stdout and empties it. Returns 0 on failure
+int term_buf_flush(struct term_buf* buf) {
+    size_t done = 0;
+    while(done < buf->i) {
+        ssize_t n = write(STDOUT_FILENO, buf->ptr + done, buf->i - done);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "write@term_buf_flush: Could not write to terminal!\n");
+            return 0;
+        }
+        done += n;
+    }
+    buf->i = 0;
+    return 1;
+}
+
+struct term_view {
+    enum term_backend backend;
+    int cols;
+    int rows;
+    int cell_w;            // Cell size, in pixels
+    int cell_h;
+    int unit_h;            // Image pixels per screen row
+    const unsigned char* img; // Scaled BGR bitmap
+    size_t img_w;
+    size_t img_h;
+    int pad_x;             // Columns left of the image, to center it
+    int img_rows;          // Screen rows the image spans
+    int off_row;           // First image row on screen, in screen rows
+    uint64_t* cells;       // What is on each cell (half-block) or screen row (sixel)
+    struct term_buf buf;
+};
+
+// Gets the terminal size in cells and the size of a cell in pixels, guessing when unknown
+void term_get_size(int* cols, int* rows, int* cell_w, int* cell_h) {
+    struct winsize ws;
+    memset(&ws, 0, sizeof(struct winsize));
+    ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws);
+    (*cols) = ws.ws_col ? ws.ws_col : 80;
+    (*rows) = ws.ws_row ? ws.ws_row : 24;
+    (*cell_w) = (ws.ws_xpixel && ws.ws_col) ? ws.ws_xpixel / ws.ws_col : 10;
+    (*cell_h) = (ws.ws_ypixel && ws.ws_row) ? ws.ws_ypixel / ws.ws_row : 20;
+}
+
+// Scales down any kind of decoded image (only one of image_buffer, rle and tiled is used) to
+// dst_w * dst_h, row by row
+unsigned char* term_scale_image(unsigned char* image_buffer, struct rle_image* rle, struct tiled_image* tiled, size_t w, size_t h, size_t dst_w, size_t dst_h) {
+    struct box_scaler scaler;
+    if(!box_scaler_init(&scaler, w, h, dst_w, dst_h))
+        return NULL;
+
+    unsigned char* row_buf = (image_buffer == NULL && tiled == NULL) ? malloc(w * 3) : NULL;
+    for(size_t y = 0; y < h; ++y) {
+        const unsigned char* row;
+        if(image_buffer != NULL)
+            row = image_buffer + (y * w * 3);
+        else if(tiled != NULL)
+            row = tiled_image_read_row(tiled);
+        else if(row_buf != NULL) {
+            rle_image_blit(rle, row_buf, w * 3, 3, 0, 0, 0, y, w, 1);
+            row = row_buf;
+        }
+        else
+            row = NULL;
+
+        if(row == NULL) { // Out of memory or decoding error
+            free(box_scaler_finish(&scaler));
+            free(row_buf);
+            return NULL;
+        }
+        box_scaler_push_row(&scaler, row);
+    }
+    free(row_buf);
+    return box_scaler_finish(&scaler);
+}
+
+// Colour of an image pixel as 0xRRGGBB, black outside the image
+uint32_t term_pixel(struct term_view* view, long x, long y) {
+    if(x < 0 || y < 0 || x >= (long)view->img_w || y >= (long)view->img_h)
+        return 0;
+    const unsigned char* px = view->img + ((y * view->img_w + x) * 3);
+    return px[0] | (px[1] << 8) | ((uint32_t)px[2] << 16);
+}
+
+// Half-block cells hold a foreground (top pixel) and background (bottom pixel) colour. Cells only
+// need moving to when they don't follow the previous one, and colours only need setting when they
+// differ from the previous cell's. Cells with both pixels equal are drawn as spaces, so they
+// don't need a foreground colour at all
+void term_draw_halfblock(struct term_view* view) {
+    int cur_row = -1;
+    int cur_col = -1;
+    uint32_t fg = UINT32_MAX;
+    uint32_t bg = UINT32_MAX;
+    for(int r = 0; r < view->rows; ++r) {
+        long y = (long)(view->off_row + r) * 2;
+        for(int c = 0; c < view->cols; ++c) {
+            uint32_t top = term_pixel(view, c - view->pad_x, y);
+            uint32_t bottom = term_pixel(view, c - view->pad_x, y + 1);
+            uint64_t cell = ((uint64_t)top << 32) | bottom;
+            uint64_t* old = &view->cells[r * view->cols + c];
+            if(*old == cell)
+                continue;
+            (*old) = cell;
+
+            if(cur_row != r || cur_col != c)
+                term_buf_printf(&view->buf, "\033[%i;%iH", r + 1, c + 1);
+            if(bg != bottom) {
+                term_buf_printf(&view->buf, "\033[48;2;%u;%u;%um", bottom >> 16, (bottom >> 8) & 0xff, bottom & 0xff);
+                bg = bottom;
+            }
+            if(top == bottom)
+                term_buf_append(&view->buf, " ", 1);
+            else {
+                if(fg != top) {
+                    term_buf_printf(&view->buf, "\033[38;2;%u;%u;%um", top >> 16, (top >> 8) & 0xff, top & 0xff);
+                    fg = top;
+                }
+                term_buf_append(&view->buf, "\xe2\x96\x80", 3); // U+2580 upper half block
+            }
+            cur_row = r;
+            cur_col = c + 1;
+        }
+    }
+    term_buf_append(&view->buf, "\033[0m", 4);
+}
+
+// Index of a colour in the 6x6x6 sixel palette
+int term_sixel_index(uint32_t colour) {
+    int r = ((colour >> 16) * 5 + 127) / 255;
+    int g = (((colour >> 8) & 0xff) * 5 + 127) / 255;
+    int b = ((colour & 0xff) * 5 + 127) / 255;
+    return r * 36 + g * 6 + b;
+}
+
+// Hashes the pixels of a screen row (FNV-1a), to tell whether it has to be redrawn
+uint64_t term_sixel_hash(struct term_view* view, long y0, long y1) {
+    uint64_t hash = 14695981039346656037ULL;
+    if(y1 > (long)view->img_h)
+        y1 = view->img_h;
+    for(long y = y0; y < y1; ++y) {
+        const unsigned char* row = view->img + (y * view->img_w * 3);
+        for(size_t n = 0; n < view->img_w * 3; ++n)
+            hash = (hash ^ row[n]) * 1099511628211ULL;
+    }
+    return hash ^ (uint64_t)(y1 - y0);
+}
+
+// Appends a sixel run, using the repeat introducer when shorter
+void term_sixel_run(struct term_buf* buf, char sixel, int count) {
+    if(count > 3)
+        term_buf_printf(buf, "!%i%c", count, sixel);
+    else {
+        while(count-- > 0)
+            term_buf_append(buf, &sixel, 1);
+    }
+}
+
+// Draws one screen row's worth of image as its own sixel image, so that rows can be redrawn
+// independently and the terminal's scrolling moves them like text
+void term_draw_sixel_row(struct term_view* view, int r) {
+    long y0 = (long)(view->off_row + r) * view->cell_h;
+    long y1 = y0 + view->cell_h;
+    if(y1 > (long)view->img_h)
+        y1 = view->img_h;
+    if(y0 >= y1) { // Past the end of the image
+        term_buf_printf(&view->buf, "\033[%i;1H\033[2K", r + 1);
+        return;
+    }
+
+    size_t w = view->img_w;
+    unsigned char used[216];
+    memset(used, 0, sizeof(used));
+    unsigned char* index = malloc(w * (y1 - y0));
+    if(index == NULL) {
+        fprintf(stderr, "malloc@term_draw_sixel_row: Out of memory!\n");
+        return;
+    }
+    for(long y = y0; y < y1; ++y) {
+        for(size_t x = 0; x < w; ++x) {
+            index[(y - y0) * w + x] = term_sixel_index(term_pixel(view, x, y));
+            used[index[(y - y0) * w + x]] = 1;
+        }
+    }
+
+    // Only the colours used by this row are defined
+    term_buf_printf(&view->buf, "\033[%i;%iH\033P0;1q\"1;1;%zu;%li", r + 1, view->pad_x + 1, w, y1 - y0);
+    for(int n = 0; n < 216; ++n) {
+        if(used[n])
+            term_buf_printf(&view->buf, "#%i;2;%i;%i;%i", n, (n / 36) * 20, ((n / 6) % 6) * 20, (n % 6) * 20);
+    }
+
+    // Each band is 6 pixels tall, drawn once per colour in it
+    for(long band = 0; band < y1 - y0; band += 6) {
+        long band_h = (y1 - y0 - band < 6) ? y1 - y0 - band : 6;
+        unsigned char in_band[216];
+        memset(in_band, 0, sizeof(in_band));
+        for(long y = band; y < band + band_h; ++y) {
+            for(size_t x = 0; x < w; ++x)
+                in_band[index[y * w + x]] = 1;
+        }
+
+        char first = 1;
+        for(int n = 0; n < 216; ++n) {
+            if(!in_band[n])
+                continue;
+            if(!first)
+                term_buf_append(&view->buf, "$", 1);
+            first = 0;
+            term_buf_printf(&view->buf, "#%i", n);
+
+            char run_sixel = 0;
+            int run = 0;
+            for(size_t x = 0; x < w; ++x) {
+                int bits = 0;
+                for(long y = 0; y < band_h; ++y) {
+                    if(index[(band + y) * w + x] == n)
+                        bits |= 1 << y;
+                }
+                char sixel = '?' + bits;
+                if(sixel != run_sixel && run > 0) {
+                    term_sixel_run(&view->buf, run_sixel, run);
+                    run = 0;
+                }
+                run_sixel = sixel;
+                ++run;
+            }
+            if(run_sixel != '?') // Trailing empty sixels are implied
+                term_sixel_run(&view->buf, run_sixel, run);
+        }
+        term_buf_append(&view->buf, "-", 1);
+    }
+    term_buf_append(&view->buf, "\033\\", 2);
+    free(index);
+}
+
+void term_draw_sixel(struct term_view* view) {
+    for(int r = 0; r < view->rows; ++r) {
+        long y0 = (long)(view->off_row + r) * view->cell_h;
+        uint64_t hash = term_sixel_hash(view, y0, y0 + view->cell_h);
+        if(view->cells[r] == hash)
+            continue;
+        view->cells[r] = hash;
+        term_draw_sixel_row(view, r);
+    }
+}
+
+// Sends the whole image to the terminal once (zlib compressed RGB, base64 encoded in chunks). Panning
+// only changes which part of it is shown
+int term_kitty_transmit(struct term_view* view) {
+    size_t raw_len = view->img_w * view->img_h * 3;
+    unsigned char* raw = malloc(raw_len);
+    uLongf packed_len = compressBound(raw_len);
+    unsigned char* packed = malloc(packed_len);
+    if(raw == NULL || packed == NULL) {
+        free(raw);
+        free(packed);
+        fprintf(stderr, "malloc@term_kitty_transmit: Out of memory!\n");
+        return 0;
+    }
+
+    // Kitty wants RGB
+    for(size_t n = 0; n < raw_len; n += 3) {
+        raw[n] = view->img[n + 2];
+        raw[n + 1] = view->img[n + 1];
+        raw[n + 2] = view->img[n];
+    }
+    int err = compress2(packed, &packed_len, raw, raw_len, Z_BEST_SPEED);
+    free(raw);
+    if(err != Z_OK) {
+        free(packed);
+        fprintf(stderr, "compress2@term_kitty_transmit: Could not compress image!\n");
+        return 0;
+    }
+
+    static const char base64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const size_t chunk_len = 3072; // 4096 bytes once encoded, the protocol's maximum
+    for(size_t off = 0; off < packed_len; off += chunk_len) {
+        size_t len = (packed_len - off < chunk_len) ? packed_len - off : chunk_len;
+        int more = off + len < packed_len;
+        if(off == 0)
+            term_buf_printf(&view->buf, "\033_Ga=t,t=d,f=24,o=z,s=%zu,v=%zu,i=%i,q=2,m=%i;", view->img_w, view->img_h, TERM_KITTY_ID, more);
+        else
+            term_buf_printf(&view->buf, "\033_Gm=%i;", more);
+
+        term_buf_reserve(&view->buf, (len + 2) / 3 * 4);
+        for(size_t n = 0; n < len; n += 3) {
+            const unsigned char* in = packed + off + n;
+            unsigned long triple = (in[0] << 16) | ((n + 1 < len ? in[1] : 0) << 8) | (n + 2 < len ? in[2] : 0);
+            char out[4] = {base64[(triple >> 18) & 63], base64[(triple >> 12) & 63], n + 1 < len ? base64[(triple >> 6) & 63] : '=', n + 2 < len ? base64[triple & 63] : '='};
+            term_buf_append(&view->buf, out, 4);
+        }
+        term_buf_append(&view->buf, "\033\\", 2);
+
+        // Don't hold several megabytes of escape codes at once
+        if(!term_buf_flush(&view->buf)) {
+            free(packed);
+            return 0;
+        }
+    }
+    free(packed);
+    return 1;
+}
+
+void term_draw_kitty(struct term_view* view) {
+    long y = (long)view->off_row * view->cell_h;
+    long h = (long)view->rows * view->cell_h;
+    if(y + h > (long)view->img_h)
+        h = view->img_h - y;
+    // Placing again with the same placement ID replaces the previous one
+    term_buf_printf(&view->buf, "\033[1;%iH\033_Ga=p,i=%i,p=1,x=0,y=%li,w=%zu,h=%li,C=1,q=2\033\\", view->pad_x + 1, TERM_KITTY_ID, y, view->img_w, h);
+}
+
+// Views a decoded image (only one of image_buffer, rle and tiled is used) in the terminal
+int view_in_terminal(unsigned char* image_buffer, struct rle_image* rle, struct tiled_image* tiled, size_t w, size_t h, enum term_backend backend) {
+    struct term_view view;
+    memset(&view, 0, sizeof(struct term_view));
+    view.backend = backend;
+    term_get_size(&view.cols, &view.rows, &view.cell_w, &view.cell_h);
+    int unit_w = (backend == TERM_BACKEND_HALFBLOCK) ? 1 : view.cell_w;
+    view.unit_h = (backend == TERM_BACKEND_HALFBLOCK) ? 2 : view.cell_h;
+
+    // Fit the terminal's width, reusing the decoded bitmap if it already does
+    size_t dst_w;
+    size_t dst_h;
+    scale_fit(w, h, view.cols * unit_w, (size_t)-1, &dst_w, &dst_h);
+    unsigned char* scaled = NULL;
+    if(image_buffer != NULL && dst_w == w)
+        view.img = image_buffer;
+    else {
+        scaled = term_scale_image(image_buffer, rle, tiled, w, h, dst_w, dst_h);
+        if(scaled == NULL)
+            return 0;
+        view.img = scaled;
+    }
+    view.img_w = dst_w;
+    view.img_h = dst_h;
+    view.img_rows = (dst_h + view.unit_h - 1) / view.unit_h;
+    view.pad_x = (view.cols - (int)((dst_w + unit_w - 1) / unit_w)) / 2;
+    if(view.pad_x < 0)
+        view.pad_x = 0;
+
+    size_t n_cells = (backend == TERM_BACKEND_HALFBLOCK) ? view.cols * view.rows : view.rows;
+    view.cells = malloc(n_cells * sizeof(uint64_t));
+    if(view.cells == NULL) {
+        free(scaled);
+        fprintf(stderr, "malloc@view_in_terminal: Out of memory!\n");
+        return 0;
+    }
+    for(size_t n = 0; n < n_cells; ++n)
+        view.cells[n] = TERM_UNKNOWN;
+
+    // Enter noncanonical input mode
+    struct termios termio_old;
+    struct termios termio_new;
+    tcgetattr(STDIN_FILENO, &termio_old);
+    termio_new = termio_old;
+    termio_new.c_lflag &= ~(ICANON | ECHO);
+    tcsetattr(STDIN_FILENO, TCSANOW, &termio_new);
+
+    // Alternate screen, hidden cursor
+    term_buf_printf(&view.buf, "\033[?1049h\033[?25l\033[2J");
+    int retval = 1;
+    if(backend == TERM_BACKEND_KITTY)
+        retval = term_kitty_transmit(&view);
+
+    const int max_off = (view.img_rows > view.rows) ? view.img_rows - view.rows : 0;
+    char running = retval;
+    while(running) {
+        if(backend == TERM_BACKEND_HALFBLOCK)
+            term_draw_halfblock(&view);
+        else if(backend == TERM_BACKEND_SIXEL)
+            term_draw_sixel(&view);
+        else
+            term_draw_kitty(&view);
+        if(!term_buf_flush(&view.buf)) {
+            retval = 0;
+            break;
+        }
+
+        // Get keyboard input
+        int old_off = view.off_row;
+        while(running && old_off == view.off_row) {
+            char c;
+            if(read(STDIN_FILENO, &c, 1) != 1)
+                c = 'q';
+            switch(c) {
+            case 'q':
+            case 'Q':
+                running = 0;
+                break;
+            case 'j':
+            case 'J':
+                if(view.off_row < max_off)
+                    ++view.off_row;
+                break;
+            case 'k':
+            case 'K':
+                if(view.off_row > 0)
+                    --view.off_row;
+                break;
+            case ' ':
+                view.off_row += view.rows - 1;
+                if(view.off_row > max_off)
+                    view.off_row = max_off;
+                break;
+            case 'b':
+            case 'B':
+                view.off_row -= view.rows - 1;
+                if(view.off_row < 0)
+                    view.off_row = 0;
+                break;
+            }
+        }
+
+        // Let the terminal move what's already on screen, and forget what scrolled out of it
+        int delta = view.off_row - old_off;
+        if(running && backend != TERM_BACKEND_KITTY && delta != 0 && abs(delta) < view.rows) {
+            size_t stride = (backend == TERM_BACKEND_HALFBLOCK) ? view.cols : 1;
+            size_t keep = (view.rows - abs(delta)) * stride;
+            if(delta > 0) { // Scroll up
+                term_buf_printf(&view.buf, "\033[0m\033[%iS", delta);
+                memmove(view.cells, view.cells + (delta * stride), keep * sizeof(uint64_t));
+                for(size_t n = keep; n < n_cells; ++n)
+                    view.cells[n] = TERM_UNKNOWN;
+            }
+            else { // Scroll down
+                term_buf_printf(&view.buf, "\033[0m\033[%iT", -delta);
+                memmove(view.cells + (-delta * stride), view.cells, keep * sizeof(uint64_t));
+                for(size_t n = 0; n < n_cells - keep; ++n)
+                    view.cells[n] = TERM_UNKNOWN;
+            }
+        }
+    }
+
+    // Clean up the terminal
+    if(backend == TERM_BACKEND_KITTY)
+        term_buf_printf(&view.buf, "\033_Ga=d,d=I,i=%i,q=2\033\\", TERM_KITTY_ID);
+    term_buf_printf(&view.buf, "\033[0m\033[?25h\033[?1049l");
+    if(!term_buf_flush(&view.buf))
+        retval = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &termio_old);
+
+    free(view.buf.ptr);
+    free(view.cells);
+    free(scaled);
+    return retval;
+}
+
+#endif
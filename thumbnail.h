@@ -0,0 +1,466 @@
+#ifndef TERMKCD_THUMBNAIL_H
+#define TERMKCD_THUMBNAIL_H
+
+// Thumbnail pipeline for a range of comics. The main thread drives the downloads (JSON, then the
+// image) through the scheduler, and every downloaded image is handed to a thread pool which
+// decodes, scales and encodes it. Workers report finished comics by writing their index to a
+// pipe, which the main thread polls together with the transfers (and stdin, when interactive).
+
+// Includes for the notification pipe and output directory
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+// Includes for the pipeline
+#include "scale.h"
+#include "pool.h"
+
+#define THUMB_DEFAULT_SIZE 160
+// Memory a worker may use for a decoded image before it's streamed through the scaler instead
+#define THUMB_DECODE_BUDGET (32 * 1024 * 1024)
+// Gap between contact sheet cells, in pixels
+#define THUMB_MARGIN 8
+
+enum thumb_format {
+    THUMB_FORMAT_PPM,
+    THUMB_FORMAT_PNG
+};
+
+enum thumb_state {
+    THUMB_STATE_IDLE,     // Not requested (or forgotten)
+    THUMB_STATE_JSON,     // Fetching the comic's JSON
+    THUMB_STATE_IMAGE,    // Fetching the comic's image
+    THUMB_STATE_DECODING, // Owned by a worker
+    THUMB_STATE_DONE,
+    THUMB_STATE_FAILED
+};
+
+struct thumb_pipeline;
+
+struct thumb_item {
+    unsigned long comic;
+    enum thumb_state state;
+    enum dl_priority priority;
+    struct dl_job* job;
+    enum file_ext extension;
+    struct mem_block file;     // Compressed image, while decoding
+    unsigned char* bitmap;     // Scaled BGR bitmap, if thumbnails are kept in memory
+    size_t w;
+    size_t h;
+    char ok;                   // Set by the worker
+    struct thumb_pipeline* pipeline;
+};
+
+struct thumb_pipeline {
+    struct dl_scheduler* sched;
+    struct thread_pool pool;
+    struct thumb_item* items;
+    size_t n_items;
+    size_t size;               // Thumbnails fit in size * size
+    const char* out_dir;       // Where thumbnails are written, NULL for none
+    enum thumb_format format;
+    char keep;                 // Keep thumbnails in memory (for displaying them)
+    int debug;
+    int notify_fd[2];          // Workers write finished item indices here
+    size_t in_flight;          // Requested items which haven't finished
+    size_t max_in_flight;      // Limit for batch mode, so downloaded images don't pile up
+    size_t n_finished;
+    size_t n_failed;
+};
+
+int thumb_pipeline_init(struct thumb_pipeline* p, struct dl_scheduler* sched, unsigned long first, unsigned long last, size_t size, const char* out_dir, enum thumb_format format, char keep, int debug) {
+    memset(p, 0, sizeof(struct thumb_pipeline));
+    p->sched = sched;
+    p->n_items = last - first + 1;
+    p->size = size;
+    p->out_dir = out_dir;
+    p->format = format;
+    p->keep = keep;
+    p->debug = debug;
+
+    p->items = calloc(p->n_items, sizeof(struct thumb_item));
+    if(p->items == NULL) {
+        fprintf(stderr, "malloc@thumb_pipeline_init: Out of memory!\n");
+        return 0;
+    }
+    for(size_t n = 0; n < p->n_items; ++n) {
+        p->items[n].comic = first + n;
+        p->items[n].file = empty_mem;
+        p->items[n].pipeline = p;
+    }
+
+    if(pipe(p->notify_fd) == -1) {
+        free(p->items);
+        fprintf(stderr, "pipe@thumb_pipeline_init: Could not create notification pipe!\n");
+        return 0;
+    }
+    // The main thread only reads what's there
+    fcntl(p->notify_fd[0], F_SETFL, O_NONBLOCK);
+
+    if(!thread_pool_init(&p->pool, 0)) {
+        close(p->notify_fd[0]);
+        close(p->notify_fd[1]);
+        free(p->items);
+        return 0;
+    }
+    // Enough to keep every worker busy while the next images download
+    p->max_in_flight = p->pool.n_threads * 2 + DL_MAX_RUNNING;
+    return 1;
+}
+
+// Decodes, scales and encodes an item's image. Returns 0 on failure
+int thumb_make(struct thumb_pipeline* p, struct thumb_item* item) {
+    unsigned char* full = NULL;
+    struct tiled_image tiled;
+    size_t w = 0;
+    size_t h = 0;
+    int opened = open_image(&item->file, item->extension, THUMB_DECODE_BUDGET, &full, &malloc_allocator, &tiled, NULL, &w, &h);
+    if(opened == 0)
+        return 0;
+
+    size_t thumb_w;
+    size_t thumb_h;
+    scale_fit(w, h, p->size, p->size, &thumb_w, &thumb_h);
+    unsigned char* thumb = NULL;
+    if(opened == 2) { // Too big to decode whole, scale it while streaming its rows
+        struct box_scaler scaler;
+        if(box_scaler_init(&scaler, w, h, thumb_w, thumb_h)) {
+            size_t y = 0;
+            for(; y < h; ++y) {
+                unsigned char* row = tiled_image_read_row(&tiled);
+                if(row == NULL)
+                    break;
+                box_scaler_push_row(&scaler, row);
+            }
+            thumb = box_scaler_finish(&scaler);
+            if(y < h) {
+                free(thumb);
+                thumb = NULL;
+            }
+        }
+        tiled_image_free(&tiled);
+    }
+    else {
+        thumb = scale_bitmap(full, w, h, thumb_w, thumb_h);
+        free(full);
+    }
+    if(thumb == NULL)
+        return 0;
+
+    int ok = 1;
+    if(p->out_dir != NULL) {
+        size_t path_len = strlen(p->out_dir) + 32;
+        char path[path_len];
+        snprintf(path, path_len, "%s/%lu.%s", p->out_dir, item->comic, (p->format == THUMB_FORMAT_PNG) ? "png" : "ppm");
+        if(p->format == THUMB_FORMAT_PNG)
+            ok = save_png(path, thumb, thumb_w, thumb_h);
+        else
+            ok = save_ppm(path, thumb, thumb_w, thumb_h);
+    }
+
+    item->w = thumb_w;
+    item->h = thumb_h;
+    if(p->keep)
+        item->bitmap = thumb;
+    else
+        free(thumb);
+    return ok;
+}
+
+// Thread pool task
+void thumb_worker(void* arg) {
+    struct thumb_item* item = arg;
+    struct thumb_pipeline* p = item->pipeline;
+    item->ok = thumb_make(p, item);
+
+    // The compressed image is recycled by the main thread, which owns the download scheduler
+    size_t index = item - p->items;
+    if(write(p->notify_fd[1], &index, sizeof(size_t)) != sizeof(size_t))
+        fprintf(stderr, "write@thumb_worker: Could not notify main thread!\n");
+}
+
+void thumb_finish(struct thumb_pipeline* p, struct thumb_item* item, int ok) {
+    item->state = ok ? THUMB_STATE_DONE : THUMB_STATE_FAILED;
+    --p->in_flight;
+    ++p->n_finished;
+    if(!ok) {
+        ++p->n_failed;
+        if(p->debug)
+            fprintf(stderr, "@thumb_finish: No thumbnail for comic %lu\n", item->comic);
+    }
+}
+
+// Starts fetching an item, if it isn't already
+void thumb_request(struct thumb_pipeline* p, size_t index, enum dl_priority priority) {
+    struct thumb_item* item = &p->items[index];
+    if(item->state != THUMB_STATE_IDLE)
+        return;
+
+    char url[COMIC_JSON_URL_LEN];
+    comic_json_url(url, item->comic);
+    item->job = dl_submit(p->sched, url, priority);
+    if(item->job == NULL)
+        return;
+    item->priority = priority;
+    item->state = THUMB_STATE_JSON;
+    ++p->in_flight;
+}
+
+// Moves items whose downloads finished to their next stage
+void thumb_pipeline_advance(struct thumb_pipeline* p) {
+    for(size_t n = 0; n < p->n_items; ++n) {
+        struct thumb_item* item = &p->items[n];
+        if(item->job == NULL || (item->job->state != DL_STATE_DONE && item->job->state != DL_STATE_FAILED))
+            continue;
+
+        struct dl_job* job = item->job;
+        item->job = NULL;
+        int ok = job->state == DL_STATE_DONE;
+        if(item->state == THUMB_STATE_JSON) {
+            struct json_parsed json_parsed;
+            // Comics without a PNG or JPEG image (e.g. interactive ones) have no thumbnail
+            if(ok && job->data.i > 0 && job->data.ptr[0] == '{' && parse_json(&job->data, &json_parsed, p->debug)) {
+                item->extension = get_extension(&json_parsed.img);
+                if(item->extension != FILE_EXT_UNKNOWN)
+                    item->job = dl_submit(p->sched, json_parsed.img.ptr, item->priority);
+                free_json(&json_parsed);
+            }
+            if(item->job != NULL)
+                item->state = THUMB_STATE_IMAGE;
+            else
+                thumb_finish(p, item, 0);
+        }
+        else if(ok) { // Image downloaded
+            item->file = job->data;
+            job->data = empty_mem;
+            item->state = THUMB_STATE_DECODING;
+            if(!thread_pool_submit(&p->pool, thumb_worker, item)) {
+                dl_recycle(p->sched, &item->file);
+                thumb_finish(p, item, 0);
+            }
+        }
+        else
+            thumb_finish(p, item, 0);
+        dl_job_free(p->sched, job);
+    }
+}
+
+// Collects items finished by workers. Returns how many there were
+size_t thumb_pipeline_collect(struct thumb_pipeline* p) {
+    size_t count = 0;
+    size_t index;
+    while(read(p->notify_fd[0], &index, sizeof(size_t)) == sizeof(size_t)) {
+        dl_recycle(p->sched, &p->items[index].file);
+        thumb_finish(p, &p->items[index], p->items[index].ok);
+        ++count;
+    }
+    return count;
+}
+
+// Frees a finished item's thumbnail so it will be fetched again if requested
+void thumb_forget(struct thumb_pipeline* p, size_t index) {
+    struct thumb_item* item = &p->items[index];
+    if(item->state != THUMB_STATE_DONE)
+        return;
+    free(item->bitmap);
+    item->bitmap = NULL;
+    item->state = THUMB_STATE_IDLE;
+}
+
+void thumb_pipeline_free(struct thumb_pipeline* p) {
+    // Workers must be done before their items go away
+    thread_pool_destroy(&p->pool);
+    for(size_t n = 0; n < p->n_items; ++n) {
+        if(p->items[n].job != NULL)
+            dl_job_free(p->sched, p->items[n].job);
+        free(p->items[n].file.ptr);
+        free(p->items[n].bitmap);
+    }
+    free(p->items);
+    close(p->notify_fd[0]);
+    close(p->notify_fd[1]);
+}
+
+// Writes thumbnails for every item, keeping at most max_in_flight comics in the pipeline
+void thumb_batch(struct thumb_pipeline* p) {
+    size_t next = 0;
+    while(p->n_finished < p->n_items) {
+        while(next < p->n_items && p->in_flight < p->max_in_flight)
+            thumb_request(p, next++, DL_PRIORITY_BACKGROUND);
+
+        struct curl_waitfd notify = {p->notify_fd[0], CURL_WAIT_POLLIN, 0};
+        dl_step(p->sched, &notify, 1, 1000);
+        thumb_pipeline_advance(p);
+        thumb_pipeline_collect(p);
+    }
+}
+
+// Lays out the thumbnails in a grid on the framebuffer. Only the visible rows (and the next
+// screen) are fetched, and thumbnails far away from the view are dropped
+int thumb_contact_sheet(struct thumb_pipeline* p, size_t max_mem, const struct fb_settings* settings) {
+    struct fb_device dev;
+    if(!fb_open(&dev, max_mem, settings))
+        return 0;
+
+    const int cell = p->size + THUMB_MARGIN;
+    const int cols = (dev.xres >= cell) ? dev.xres / cell : 1;
+    const int pad_x = (dev.xres - cols * cell + THUMB_MARGIN) / 2;
+    const int screen_rows = (dev.yres + cell - 1) / cell;
+    const size_t total_rows = (p->n_items + cols - 1) / cols;
+    const unsigned char loading_colour = 40;
+    const unsigned char failed_colour = 90;
+    size_t scroll_row = 0;
+    char running = 1;
+
+    while(running) {
+        // Fetch what's visible first, then the next screen
+        size_t first = scroll_row * cols;
+        size_t visible_end = first + screen_rows * cols;
+        size_t prefetch_end = visible_end + screen_rows * cols;
+        for(size_t n = first; n < prefetch_end && n < p->n_items; ++n)
+            thumb_request(p, n, (n < visible_end) ? DL_PRIORITY_VISIBLE : DL_PRIORITY_PREFETCH);
+
+        // Drop thumbnails more than two screens away
+        size_t keep_from = (first > 2 * screen_rows * cols) ? first - 2 * screen_rows * cols : 0;
+        for(size_t n = 0; n < p->n_items; ++n) {
+            if(n < keep_from || n >= prefetch_end + screen_rows * cols)
+                thumb_forget(p, n);
+        }
+
+        // Draw visible cells, with placeholders for missing thumbnails
+        struct fb_target* target = fb_get_target(&dev);
+        unsigned char* canvas = target->mem;
+        memset(canvas, 0, dev.page_len);
+        for(size_t n = first; n < visible_end && n < p->n_items; ++n) {
+            struct thumb_item* item = &p->items[n];
+            int cell_x = pad_x + ((n - first) % cols) * cell;
+            int cell_y = THUMB_MARGIN / 2 + ((n - first) / cols) * cell;
+            // Cells wider than the screen (or pushed past its left edge to centre them) are clipped
+            // horizontally, like all of them are against the bottom
+            if(item->state == THUMB_STATE_DONE && item->bitmap != NULL) {
+                int x = cell_x + ((int)p->size - (int)item->w) / 2;
+                int y = cell_y + ((int)p->size - (int)item->h) / 2;
+                int l = (x < 0) ? 0 : x;
+                int r = (x + (int)item->w > dev.xres) ? dev.xres : x + (int)item->w;
+                for(size_t row = 0; r > l && row < item->h && y + (int)row < dev.yres; ++row)
+                    stride_memcpy(canvas + (l * dev.bpp) + ((y + row) * dev.ll), item->bitmap + (((row * item->w) + (l - x)) * 3), r - l, dev.bpp, 3);
+            }
+            else {
+                unsigned char colour = (item->state == THUMB_STATE_FAILED) ? failed_colour : loading_colour;
+                int l = (cell_x < 0) ? 0 : cell_x;
+                int r = (cell_x + (int)p->size > dev.xres) ? dev.xres : cell_x + (int)p->size;
+                for(size_t row = 0; r > l && row < p->size && cell_y + (int)row < dev.yres; ++row)
+                    stride_memset(canvas + (l * dev.bpp) + ((cell_y + row) * dev.ll), colour, 3, r - l, dev.bpp);
+            }
+        }
+        fb_present(&dev);
+
+        // Wait for input or for visible thumbnails to finish
+        char redraw = 0;
+        while(!redraw) {
+            struct curl_waitfd fds[2] = {
+                {STDIN_FILENO, CURL_WAIT_POLLIN, 0},
+                {p->notify_fd[0], CURL_WAIT_POLLIN, 0}
+            };
+            dl_step(p->sched, fds, 2, 1000);
+            thumb_pipeline_advance(p);
+            if(thumb_pipeline_collect(p) > 0)
+                redraw = 1;
+
+            if(fds[0].revents == 0)
+                continue;
+            char c;
+            if(read(STDIN_FILENO, &c, 1) != 1)
+                c = 'q';
+            switch(c) {
+            case 'q':
+            case 'Q':
+                running = 0;
+                redraw = 1;
+                break;
+            case 'j':
+            case 'J':
+                if(scroll_row + 1 < total_rows) {
+                    ++scroll_row;
+                    redraw = 1;
+                }
+                break;
+            case 'k':
+            case 'K':
+                if(scroll_row > 0) {
+                    --scroll_row;
+                    redraw = 1;
+                }
+                break;
+            }
+        }
+    }
+
+    return fb_close(&dev);
+}
+
+// Generates thumbnails for comics first to last (0 for the latest one), writing them to out_dir
+// (if not NULL) and/or showing them in a contact sheet. Returns 0 on failure
+int run_thumbnails(unsigned long first, unsigned long last, size_t size, const char* out_dir, enum thumb_format format, int contact_sheet, size_t max_mem, const struct fb_settings* settings, int debug) {
+    struct dl_scheduler sched;
+    if(!dl_scheduler_init(&sched, NULL, debug))
+        return 0;
+
+    // Ask for the latest comic's number if needed
+    if(last == 0) {
+        char url[COMIC_JSON_URL_LEN];
+        comic_json_url(url, 0);
+        struct mem_block json_raw = empty_mem;
+        long http_status = 0;
+        CURLcode err = dl_fetch(&sched, url, DL_PRIORITY_VISIBLE, &json_raw, &http_status);
+        struct json_parsed json_parsed;
+        if(err == CURLE_OK && http_status == 200 && json_raw.i > 0 && json_raw.ptr[0] == '{' && parse_json(&json_raw, &json_parsed, debug)) {
+            int errored = 0;
+            last = str_to_uint(json_parsed.num.ptr, &errored);
+            if(errored)
+                last = 0;
+            free_json(&json_parsed);
+        }
+        free(json_raw.ptr);
+        if(last == 0) {
+            fprintf(stderr, "dl_fetch@run_thumbnails: Failed to retrieve the latest comic's number!\n");
+            dl_scheduler_cleanup(&sched);
+            return 0;
+        }
+    }
+    if(first == 0)
+        first = 1;
+    if(first > last) {
+        fprintf(stderr, "@run_thumbnails: Empty comic range %lu-%lu!\n", first, last);
+        dl_scheduler_cleanup(&sched);
+        return 0;
+    }
+
+    if(out_dir != NULL && mkdir(out_dir, 0755) == -1 && errno != EEXIST) {
+        fprintf(stderr, "mkdir@run_thumbnails: Could not create directory %s!\n", out_dir);
+        dl_scheduler_cleanup(&sched);
+        return 0;
+    }
+
+    struct thumb_pipeline p;
+    if(!thumb_pipeline_init(&p, &sched, first, last, size, out_dir, format, contact_sheet, debug)) {
+        dl_scheduler_cleanup(&sched);
+        return 0;
+    }
+
+    int retval = 1;
+    if(contact_sheet)
+        retval = thumb_contact_sheet(&p, max_mem, settings);
+    else {
+        thumb_batch(&p);
+        if(p.n_failed > 0)
+            fprintf(stderr, "Warning: %zu of %zu comics have no thumbnail\n", p.n_failed, p.n_items);
+    }
+
+    thumb_pipeline_free(&p);
+    dl_scheduler_cleanup(&sched);
+    return retval;
+}
+
+#endif
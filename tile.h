@@ -0,0 +1,484 @@
+#ifndef TERMKCD_TILE_H
+#define TERMKCD_TILE_H
+
+// Tiled image store for comics too big to decode in one go (e.g. xkcd 1110, "Click and Drag").
+// The compressed file is kept around and decoded band by band (a band being a row of tiles),
+// only keeping the tiles that are needed in memory. When the memory budget is reached, the
+// least recently used tiles are evicted and decoded again later if needed.
+//
+// Notes:
+// - PNG and JPEG can only be decoded from top to bottom, so the decoder is kept open between
+//   calls. Going down is cheap, going back up restarts the decoder from the first row.
+// - Interlaced PNGs can't be decoded band by band, so they are not supported here.
+
+// Tile width and height, in pixels
+#define TILE_SIZE 256
+// Default memory budget for decoded tiles (64 MiB)
+#define TILE_DEFAULT_BUDGET (64 * 1024 * 1024)
+// Marks the end of the LRU list
+#define TILE_NONE ((size_t)-1)
+
+struct image_tile {
+    unsigned char* ptr; // BGR bitmap of this tile, NULL if not decoded
+    size_t prev;        // Previous (more recently used) tile in LRU list
+    size_t next;        // Next (less recently used) tile in LRU list
+    unsigned long stamp; // Last tiled_image_prepare call which needed this tile
+};
+
+struct tiled_image {
+    struct mem_block file;   // Compressed image. Not owned by the tiled image
+    enum file_ext extension;
+    size_t w;
+    size_t h;
+    size_t tiles_x;          // Tiles per band
+    size_t tiles_y;          // Number of bands
+    struct image_tile* tiles;
+    size_t lru_head;         // Most recently used tile
+    size_t lru_tail;         // Least recently used tile
+    size_t mem_used;
+    size_t mem_budget;
+    unsigned long clock;     // Incremented on every tiled_image_prepare call
+    unsigned char* row_buf;  // One decoded row of the full image
+    size_t next_row;         // Next row that the decoder will output
+    char interlaced;         // Failed to open because it's an interlaced PNG (w and h are set)
+    // PNG decoder state
+    png_structp png_ptr;
+    png_infop info_ptr;
+    struct png_source png_io;
+    // JPEG decoder state
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_custom_error_mgr jpeg_err;
+    char jpeg_active;
+};
+
+void tiled_image_close_decoder(struct tiled_image* img) {
+    if(img->png_ptr != NULL)
+        png_destroy_read_struct(&img->png_ptr, &img->info_ptr, (png_infopp)NULL);
+    img->png_ptr = NULL;
+    img->info_ptr = NULL;
+    if(img->jpeg_active)
+        jpeg_destroy_decompress(&img->cinfo);
+    img->jpeg_active = 0;
+}
+
+// (Re)starts the decoder at the first row. Fills w and h on success. Interlaced PNGs fail quietly
+// (see open_image), with interlaced, w and h set
+int tiled_image_open_decoder(struct tiled_image* img) {
+    tiled_image_close_decoder(img);
+    img->next_row = 0;
+
+    if(img->extension == FILE_EXT_PNG) {
+        if(img->file.i < 8 || png_sig_cmp((png_bytep)img->file.ptr, 0, 8)) {
+            fprintf(stderr, "png_sig_cmp@tiled_image_open_decoder: PNG signature invalid!\n");
+            return 0;
+        }
+
+        img->png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        if(!img->png_ptr) {
+            fprintf(stderr, "png_create_read_struct@tiled_image_open_decoder: Could not create png read struct!\n");
+            return 0;
+        }
+
+        img->info_ptr = png_create_info_struct(img->png_ptr);
+        if(!img->info_ptr) {
+            tiled_image_close_decoder(img);
+            fprintf(stderr, "png_create_info_struct@tiled_image_open_decoder: Could not create png info struct!\n");
+            return 0;
+        }
+
+        if(setjmp(png_jmpbuf(img->png_ptr))) {
+            tiled_image_close_decoder(img);
+            fprintf(stderr, "@tiled_image_open_decoder: An error occured while trying to read the PNG file!\n");
+            return 0;
+        }
+
+        // Same custom IO as load_png, skipping the signature
+        img->png_io.ptr = img->file.ptr;
+        img->png_io.i = 8;
+        img->png_io.len = img->file.i;
+        png_set_read_fn(img->png_ptr, &img->png_io, read_callback_png);
+        png_set_sig_bytes(img->png_ptr, 8);
+        png_read_info(img->png_ptr, img->info_ptr);
+
+        png_uint_32 png_w, png_h;
+        int colour_type, bit_depth, interlace_type;
+        png_get_IHDR(img->png_ptr, img->info_ptr, &png_w, &png_h, &bit_depth, &colour_type, &interlace_type, NULL, NULL);
+
+        if(interlace_type != PNG_INTERLACE_NONE) {
+            tiled_image_close_decoder(img);
+            img->interlaced = 1;
+            img->w = png_w;
+            img->h = png_h;
+            return 0;
+        }
+
+        // Same transformations as load_png, so tiles are BGR
+        if(bit_depth == 16)
+            png_set_strip_16(img->png_ptr);
+        else if(bit_depth < 8)
+            png_set_packing(img->png_ptr);
+        png_set_strip_alpha(img->png_ptr);
+        if(colour_type == PNG_COLOR_TYPE_PALETTE)
+            png_set_palette_to_rgb(img->png_ptr);
+        if(colour_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8)
+            png_set_expand_gray_1_2_4_to_8(img->png_ptr);
+        if(colour_type == PNG_COLOR_TYPE_GRAY || colour_type == PNG_COLOR_TYPE_GRAY_ALPHA)
+            png_set_gray_to_rgb(img->png_ptr);
+        png_set_bgr(img->png_ptr);
+        png_read_update_info(img->png_ptr, img->info_ptr);
+
+        img->w = png_w;
+        img->h = png_h;
+    }
+    else {
+        img->cinfo.err = jpeg_std_error(&img->jpeg_err.pub);
+        img->jpeg_err.pub.error_exit = jpeg_custom_error_exit;
+
+        if(setjmp(img->jpeg_err.setjmp_buffer)) {
+            tiled_image_close_decoder(img);
+            return 0;
+        }
+
+        jpeg_create_decompress(&img->cinfo);
+        img->jpeg_active = 1;
+        jpeg_mem_src(&img->cinfo, (unsigned char*)img->file.ptr, img->file.i);
+        jpeg_read_header(&img->cinfo, 1);
+        img->cinfo.out_color_space = JCS_EXT_BGR;
+        jpeg_start_decompress(&img->cinfo);
+
+        img->w = img->cinfo.output_width;
+        img->h = img->cinfo.output_height;
+    }
+
+    return 1;
+}
+
+// Opens the compressed image for tiled decoding. file must outlive the tiled image.
+// Returns 0 on failure
+int tiled_image_init(struct tiled_image* img, struct mem_block* file, enum file_ext extension, size_t mem_budget) {
+    memset(img, 0, sizeof(struct tiled_image));
+    img->file = *file;
+    img->extension = extension;
+    img->mem_budget = mem_budget;
+    img->lru_head = TILE_NONE;
+    img->lru_tail = TILE_NONE;
+
+    if(!tiled_image_open_decoder(img))
+        return 0;
+
+    img->tiles_x = (img->w + TILE_SIZE - 1) / TILE_SIZE;
+    img->tiles_y = (img->h + TILE_SIZE - 1) / TILE_SIZE;
+    img->tiles = calloc(img->tiles_x * img->tiles_y, sizeof(struct image_tile));
+    img->row_buf = malloc(img->w * 3);
+    if(img->tiles == NULL || img->row_buf == NULL) {
+        tiled_image_close_decoder(img);
+        free(img->tiles);
+        free(img->row_buf);
+        fprintf(stderr, "malloc@tiled_image_init: Out of memory!\n");
+        return 0;
+    }
+
+    return 1;
+}
+
+void tiled_image_free(struct tiled_image* img) {
+    tiled_image_close_decoder(img);
+    if(img->tiles != NULL) {
+        for(size_t n = 0; n < img->tiles_x * img->tiles_y; ++n)
+            free(img->tiles[n].ptr);
+    }
+    free(img->tiles);
+    free(img->row_buf);
+    img->tiles = NULL;
+    img->row_buf = NULL;
+}
+
+void tiled_image_lru_unlink(struct tiled_image* img, size_t n) {
+    struct image_tile* tile = &img->tiles[n];
+    if(tile->prev != TILE_NONE)
+        img->tiles[tile->prev].next = tile->next;
+    else
+        img->lru_head = tile->next;
+    if(tile->next != TILE_NONE)
+        img->tiles[tile->next].prev = tile->prev;
+    else
+        img->lru_tail = tile->prev;
+}
+
+void tiled_image_lru_push(struct tiled_image* img, size_t n) {
+    img->tiles[n].prev = TILE_NONE;
+    img->tiles[n].next = img->lru_head;
+    if(img->lru_head != TILE_NONE)
+        img->tiles[img->lru_head].prev = n;
+    else
+        img->lru_tail = n;
+    img->lru_head = n;
+}
+
+size_t tiled_image_tile_w(struct tiled_image* img, size_t tx) {
+    size_t tw = img->w - tx * TILE_SIZE;
+    return tw > TILE_SIZE ? TILE_SIZE : tw;
+}
+
+size_t tiled_image_tile_h(struct tiled_image* img, size_t ty) {
+    size_t th = img->h - ty * TILE_SIZE;
+    return th > TILE_SIZE ? TILE_SIZE : th;
+}
+
+void tiled_image_evict(struct tiled_image* img, size_t n) {
+    tiled_image_lru_unlink(img, n);
+    free(img->tiles[n].ptr);
+    img->tiles[n].ptr = NULL;
+    img->mem_used -= tiled_image_tile_w(img, n % img->tiles_x) * tiled_image_tile_h(img, n / img->tiles_x) * 3;
+}
+
+// Evicts least recently used tiles until extra_bytes more fit in the budget. Tiles needed by the
+// current tiled_image_prepare call are never evicted, so the budget may be exceeded if the
+// visible area alone doesn't fit in it
+void tiled_image_trim(struct tiled_image* img, size_t extra_bytes) {
+    while(img->mem_used + extra_bytes > img->mem_budget && img->lru_tail != TILE_NONE && img->tiles[img->lru_tail].stamp != img->clock)
+        tiled_image_evict(img, img->lru_tail);
+}
+
+unsigned char* tiled_image_alloc_tile(struct tiled_image* img, size_t n) {
+    size_t bytes = tiled_image_tile_w(img, n % img->tiles_x) * tiled_image_tile_h(img, n / img->tiles_x) * 3;
+    tiled_image_trim(img, bytes);
+
+    unsigned char* ptr = malloc(bytes);
+    if(ptr == NULL) {
+        fprintf(stderr, "malloc@tiled_image_alloc_tile: Out of memory!\n");
+        return NULL;
+    }
+    img->tiles[n].ptr = ptr;
+    img->tiles[n].stamp = img->clock;
+    img->mem_used += bytes;
+    tiled_image_lru_push(img, n);
+    return ptr;
+}
+
+// Throws away the tiles of band ty allocated for decoding it (non-NULL in band_tiles, which
+// starts at tile tx0), as they weren't decoded
+void tiled_image_evict_band(struct tiled_image* img, unsigned char** band_tiles, size_t tx0, size_t tx1, size_t ty) {
+    for(size_t tx = tx0; tx <= tx1; ++tx) {
+        if(band_tiles[tx - tx0] != NULL)
+            tiled_image_evict(img, ty * img->tiles_x + tx);
+    }
+}
+
+// Decodes the missing tiles of band ty, from tile tx0 to tx1 (inclusive)
+int tiled_image_decode_band(struct tiled_image* img, size_t tx0, size_t tx1, size_t ty) {
+    size_t row_start = ty * TILE_SIZE;
+    size_t rows = tiled_image_tile_h(img, ty);
+
+    // Allocate missing tiles
+    unsigned char* band_tiles[tx1 - tx0 + 1];
+    size_t n_missing = 0;
+    for(size_t tx = tx0; tx <= tx1; ++tx)
+        band_tiles[tx - tx0] = NULL;
+    for(size_t tx = tx0; tx <= tx1; ++tx) {
+        size_t n = ty * img->tiles_x + tx;
+        if(img->tiles[n].ptr == NULL) {
+            band_tiles[tx - tx0] = tiled_image_alloc_tile(img, n);
+            if(band_tiles[tx - tx0] == NULL) {
+                tiled_image_evict_band(img, band_tiles, tx0, tx1, ty);
+                return 0;
+            }
+            ++n_missing;
+        }
+    }
+    if(n_missing == 0)
+        return 1;
+
+    // The decoder can't go backwards, so start over
+    if(img->next_row > row_start || (img->png_ptr == NULL && !img->jpeg_active)) {
+        if(!tiled_image_open_decoder(img)) {
+            tiled_image_evict_band(img, band_tiles, tx0, tx1, ty);
+            return 0;
+        }
+    }
+
+    char failed = 0;
+    if(img->png_ptr != NULL) {
+        if(setjmp(png_jmpbuf(img->png_ptr)))
+            failed = 1;
+    }
+    else if(setjmp(img->jpeg_err.setjmp_buffer))
+        failed = 1;
+    if(failed) {
+        // Throw away the half-decoded tiles
+        tiled_image_close_decoder(img);
+        tiled_image_evict_band(img, band_tiles, tx0, tx1, ty);
+        fprintf(stderr, "@tiled_image_decode_band: An error occured while trying to read the image!\n");
+        return 0;
+    }
+
+    // Skip rows above band
+    if(img->jpeg_active && img->next_row < row_start)
+        img->next_row += jpeg_skip_scanlines(&img->cinfo, row_start - img->next_row);
+    while(img->next_row < row_start) {
+        png_read_row(img->png_ptr, (png_bytep)img->row_buf, NULL);
+        ++img->next_row;
+    }
+
+    // Decode band and split rows into tiles
+    for(size_t y = 0; y < rows; ++y) {
+        if(img->jpeg_active) {
+            unsigned char* row_ptrs[1] = {img->row_buf};
+            jpeg_read_scanlines(&img->cinfo, row_ptrs, 1);
+        }
+        else
+            png_read_row(img->png_ptr, (png_bytep)img->row_buf, NULL);
+        ++img->next_row;
+
+        for(size_t tx = tx0; tx <= tx1; ++tx) {
+            if(band_tiles[tx - tx0] != NULL) {
+                size_t tw = tiled_image_tile_w(img, tx);
+                memcpy(band_tiles[tx - tx0] + (y * tw * 3), img->row_buf + (tx * TILE_SIZE * 3), tw * 3);
+            }
+        }
+    }
+
+    // Nothing left to read, free decoder memory
+    if(img->next_row == img->h)
+        tiled_image_close_decoder(img);
+
+    return 1;
+}
+
+// Decodes the next row of the image into img->row_buf and returns it, for streaming through the
+// whole image without keeping any tiles. Returns NULL on failure
+unsigned char* tiled_image_read_row(struct tiled_image* img) {
+    if(img->next_row >= img->h || (img->png_ptr == NULL && !img->jpeg_active)) {
+        if(!tiled_image_open_decoder(img))
+            return NULL;
+    }
+
+    char failed = 0;
+    if(img->png_ptr != NULL) {
+        if(setjmp(png_jmpbuf(img->png_ptr)))
+            failed = 1;
+    }
+    else if(setjmp(img->jpeg_err.setjmp_buffer))
+        failed = 1;
+    if(failed) {
+        tiled_image_close_decoder(img);
+        fprintf(stderr, "@tiled_image_read_row: An error occured while trying to read the image!\n");
+        return NULL;
+    }
+
+    if(img->jpeg_active) {
+        unsigned char* row_ptrs[1] = {img->row_buf};
+        jpeg_read_scanlines(&img->cinfo, row_ptrs, 1);
+    }
+    else
+        png_read_row(img->png_ptr, (png_bytep)img->row_buf, NULL);
+
+    if(++img->next_row == img->h)
+        tiled_image_close_decoder(img);
+    return img->row_buf;
+}
+
+// Makes sure every tile intersecting the given region is decoded and marks them as recently used
+int tiled_image_prepare(struct tiled_image* img, size_t x, size_t y, size_t w, size_t h) {
+    if(w == 0 || h == 0)
+        return 1;
+
+    size_t tx0 = x / TILE_SIZE;
+    size_t tx1 = (x + w - 1) / TILE_SIZE;
+    size_t ty0 = y / TILE_SIZE;
+    size_t ty1 = (y + h - 1) / TILE_SIZE;
+
+    // Stamp already decoded tiles so they don't get evicted by the ones being decoded
+    ++img->clock;
+    for(size_t ty = ty0; ty <= ty1; ++ty) {
+        for(size_t tx = tx0; tx <= tx1; ++tx) {
+            size_t n = ty * img->tiles_x + tx;
+            if(img->tiles[n].ptr != NULL) {
+                img->tiles[n].stamp = img->clock;
+                tiled_image_lru_unlink(img, n);
+                tiled_image_lru_push(img, n);
+            }
+        }
+    }
+
+    // Bands must be decoded in order, as going up would restart the decoder
+    for(size_t ty = ty0; ty <= ty1; ++ty) {
+        if(!tiled_image_decode_band(img, tx0, tx1, ty))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Copies the given subimage to dest (a framebuffer-like surface with line length ll and bpp
+// bytes per pixel) at dest_x, dest_y, tile by tile
+int tiled_image_blit(struct tiled_image* img, unsigned char* dest, size_t ll, int bpp, size_t dest_x, size_t dest_y, size_t x, size_t y, size_t w, size_t h) {
+    if(!tiled_image_prepare(img, x, y, w, h))
+        return 0;
+
+    for(size_t ty = y / TILE_SIZE; ty * TILE_SIZE < y + h; ++ty) {
+        size_t tile_y = ty * TILE_SIZE;
+        size_t y0 = tile_y > y ? tile_y : y;
+        size_t y1 = tile_y + tiled_image_tile_h(img, ty);
+        if(y1 > y + h)
+            y1 = y + h;
+
+        for(size_t tx = x / TILE_SIZE; tx * TILE_SIZE < x + w; ++tx) {
+            size_t tile_x = tx * TILE_SIZE;
+            size_t tw = tiled_image_tile_w(img, tx);
+            size_t x0 = tile_x > x ? tile_x : x;
+            size_t x1 = tile_x + tw;
+            if(x1 > x + w)
+                x1 = x + w;
+
+            unsigned char* tile = img->tiles[ty * img->tiles_x + tx].ptr;
+            for(size_t row = y0; row < y1; ++row)
+                stride_memcpy(dest + ((dest_x + x0 - x) * bpp) + ((dest_y + row - y) * ll), tile + (((row - tile_y) * tw + (x0 - tile_x)) * 3), x1 - x0, bpp, 3);
+        }
+    }
+
+    return 1;
+}
+
+// Decodes a whole image if it fits in tile_budget once decoded (bitmap is set), otherwise sets up
+// tiled decoding (tiled is initialized). Bitmaps are allocated with allocator. With progressive
+// (NULL for none), whole images are decoded in the background instead (progressive is started).
+// Returns 0 on failure, 1 for a bitmap, 2 for a tiled image and 3 for a progressive decode
+int open_image(struct mem_block* file, enum file_ext extension, size_t tile_budget, unsigned char** bitmap, const struct allocator* allocator, struct tiled_image* tiled, struct progressive* progressive, size_t* w, size_t* h) {
+    (*bitmap) = NULL;
+
+    // Giant comics don't fit in memory once decoded, so they are decoded tile by tile instead
+    if(tiled_image_init(tiled, file, extension, tile_budget)) {
+        (*w) = tiled->w;
+        (*h) = tiled->h;
+        if(tiled->w * tiled->h * 3 > tile_budget)
+            return 2;
+        tiled_image_free(tiled);
+    }
+    // Only worth mentioning if tiling was needed, small interlaced images are decoded whole anyway
+    else if(tiled->interlaced && tiled->w * tiled->h * 3 > tile_budget)
+        fprintf(stderr, "@open_image: Interlaced PNGs can't be tiled! Decoding it whole\n");
+
+    if(progressive != NULL && progressive_start(progressive, file, extension, w, h))
+        return 3;
+
+    if(extension == FILE_EXT_PNG) { // Load using libpng, as it has a PNG file extension
+        png_uint_32 png_w = 0;
+        png_uint_32 png_h = 0;
+        (*bitmap) = load_png_with(file->ptr, file->i, &png_w, &png_h, allocator);
+        (*w) = png_w;
+        (*h) = png_h;
+    }
+    // Note: this else statement may be a problem in the future when more file types are used
+    else { // Load using libjpeg, as it has a JPEG file extension.
+        long unsigned int jpeg_w = 0;
+        long unsigned int jpeg_h = 0;
+        (*bitmap) = load_jpeg_with(file->ptr, file->i, &jpeg_w, &jpeg_h, allocator);
+        (*w) = jpeg_w;
+        (*h) = jpeg_h;
+    }
+
+    return (*bitmap) != NULL;
+}
+
+#endif
@@ -1,8 +1,9 @@
 #ifndef TERMKCD_UTIL_H
 #define TERMKCD_UTIL_H
 
-// Include limits header
+// Include limits headers
 #include <limits.h>
+#include <stdint.h>
 
 unsigned int str_to_uint(const char* str, int* error_flag) {
     size_t len = strlen(str);
@@ -32,4 +33,41 @@ unsigned int str_to_uint(const char* str, int* error_flag) {
     return (unsigned int)res;
 }
 
+// Parses a size in bytes, with an optional K, M or G suffix (powers of 1024). Returns 0 if invalid
+// or too big for a size_t
+size_t str_to_size(const char* str) {
+    size_t res = 0;
+    size_t n = 0;
+    for(; str[n] >= '0' && str[n] <= '9'; ++n) {
+        size_t digit = (size_t)(str[n] - '0');
+        if(res > (SIZE_MAX - digit) / 10)
+            return 0;
+        res = res * 10 + digit;
+    }
+    if(n == 0)
+        return 0;
+    size_t unit;
+    switch(str[n]) {
+    case '\0':
+        return res;
+    case 'k':
+    case 'K':
+        unit = 1024;
+        break;
+    case 'm':
+    case 'M':
+        unit = 1024 * 1024;
+        break;
+    case 'g':
+    case 'G':
+        unit = 1024 * 1024 * 1024;
+        break;
+    default:
+        return 0;
+    }
+    if(str[n + 1] != '\0' || res > SIZE_MAX / unit)
+        return 0;
+    return res * unit;
+}
+
 #endif
@@ -0,0 +1,203 @@
+#ifndef TERMKCD_WATCH_H
+#define TERMKCD_WATCH_H
+
+// Watch mode. The latest comic's metadata is polled with conditional requests (If-None-Match and
+// If-Modified-Since), so unchanged polls are a bodyless 304, over a single easy handle so the
+// connection and TLS session are kept between polls. Polling is frequent only around the time
+// xkcd usually publishes (Monday, Wednesday and Friday, around midnight US Eastern time), and
+// sparse otherwise.
+
+// Include time header for the publishing schedule
+#include <time.h>
+#include <strings.h>
+#include <unistd.h>
+// Include wait for the display action
+#include <sys/wait.h>
+
+// Schedule, in UTC
+#define WATCH_WINDOW_START 3          // Hour frequent polling starts at on publishing days
+#define WATCH_WINDOW_END 10           // Hour it stops at
+#define WATCH_FAST_INTERVAL 60        // Seconds between polls inside the window
+#define WATCH_SLOW_INTERVAL 3600      // Longest wait outside the window, in case of schedule changes
+#define WATCH_RETRY_INTERVAL 60       // Seconds before polling again after an error
+
+#define WATCH_VALIDATOR_LEN 128
+
+struct watch {
+    CURL* handle;
+    struct curl_slist* headers;
+    struct mem_block body;
+    char etag[WATCH_VALIDATOR_LEN];          // Validators of the last 200 response
+    char last_modified[WATCH_VALIDATOR_LEN];
+    unsigned long last_num;                  // 0 until the first poll
+    int last_new_day;                        // Days since the epoch a new comic was last seen
+    char failed;                             // Last poll failed
+    int debug;
+};
+
+// Copies a response header's value to dest if it's the named header
+void watch_match_header(const char* line, size_t len, const char* name, char* dest) {
+    size_t name_len = strlen(name);
+    if(len <= name_len || strncasecmp(line, name, name_len) != 0)
+        return;
+    line += name_len;
+    len -= name_len;
+    while(len > 0 && (*line == ' ' || *line == '\t')) {
+        ++line;
+        --len;
+    }
+    while(len > 0 && (line[len - 1] == '\r' || line[len - 1] == '\n' || line[len - 1] == ' '))
+        --len;
+    if(len == 0 || len >= WATCH_VALIDATOR_LEN)
+        return;
+    memcpy(dest, line, len);
+    dest[len] = '\0';
+}
+
+size_t watch_header_callback(char* buf, size_t size, size_t nmemb, struct watch* w) {
+    watch_match_header(buf, size * nmemb, "ETag:", w->etag);
+    watch_match_header(buf, size * nmemb, "Last-Modified:", w->last_modified);
+    return size * nmemb;
+}
+
+int watch_init(struct watch* w, int debug) {
+    memset(w, 0, sizeof(struct watch));
+    w->body = empty_mem;
+    w->last_new_day = -1;
+    w->debug = debug;
+    w->handle = curl_easy_init();
+    if(w->handle == NULL) {
+        fprintf(stderr, "curl_easy_init@watch_init: Could not initialize cURL!\n");
+        return 0;
+    }
+    char url[COMIC_JSON_URL_LEN];
+    comic_json_url(url, 0);
+    curl_easy_setopt(w->handle, CURLOPT_URL, url);
+    curl_easy_setopt(w->handle, CURLOPT_WRITEFUNCTION, write_callback_curl);
+    curl_easy_setopt(w->handle, CURLOPT_WRITEDATA, &w->body);
+    curl_easy_setopt(w->handle, CURLOPT_HEADERFUNCTION, watch_header_callback);
+    curl_easy_setopt(w->handle, CURLOPT_HEADERDATA, w);
+    curl_easy_setopt(w->handle, CURLOPT_TCP_KEEPALIVE, 1L);
+    // A stalled poll times out and is retried after WATCH_RETRY_INTERVAL, instead of blocking
+    set_transfer_timeouts(w->handle);
+    if(debug)
+        curl_easy_setopt(w->handle, CURLOPT_VERBOSE, 1L);
+    return 1;
+}
+
+void watch_cleanup(struct watch* w) {
+    curl_slist_free_all(w->headers);
+    curl_easy_cleanup(w->handle);
+    free(w->body.ptr);
+}
+
+// Seconds to wait before the next poll
+unsigned int watch_interval(struct watch* w) {
+    time_t now = time(NULL);
+    struct tm utc;
+    gmtime_r(&now, &utc);
+    int day = now / 86400;
+    int publishing_day = utc.tm_wday == 1 || utc.tm_wday == 3 || utc.tm_wday == 5;
+    if(publishing_day && day != w->last_new_day && utc.tm_hour >= WATCH_WINDOW_START && utc.tm_hour < WATCH_WINDOW_END)
+        return WATCH_FAST_INTERVAL;
+
+    // Sleep until the next window opens, waking up at least hourly (or sooner to retry errors)
+    int days_ahead = 0;
+    if(!publishing_day || day == w->last_new_day || utc.tm_hour >= WATCH_WINDOW_START) {
+        days_ahead = 1;
+        while((utc.tm_wday + days_ahead) % 7 != 1 && (utc.tm_wday + days_ahead) % 7 != 3 && (utc.tm_wday + days_ahead) % 7 != 5)
+            ++days_ahead;
+    }
+    time_t window = (time_t)(day + days_ahead) * 86400 + WATCH_WINDOW_START * 3600;
+    time_t wait = window - now;
+    if(wait > WATCH_SLOW_INTERVAL)
+        wait = WATCH_SLOW_INTERVAL;
+    if(w->failed && wait > WATCH_RETRY_INTERVAL)
+        wait = WATCH_RETRY_INTERVAL;
+    if(wait < WATCH_FAST_INTERVAL)
+        wait = WATCH_FAST_INTERVAL;
+    return wait;
+}
+
+// Polls once. Returns 1 and fills parsed if there's a new comic (the first poll only sets the
+// baseline), 0 otherwise
+int watch_poll(struct watch* w, struct json_parsed* parsed) {
+    // Conditional request with the last response's validators
+    curl_slist_free_all(w->headers);
+    w->headers = NULL;
+    char header[WATCH_VALIDATOR_LEN + 32];
+    if(w->etag[0] != '\0') {
+        snprintf(header, sizeof(header), "If-None-Match: %s", w->etag);
+        w->headers = curl_slist_append(w->headers, header);
+    }
+    if(w->last_modified[0] != '\0') {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", w->last_modified);
+        w->headers = curl_slist_append(w->headers, header);
+    }
+    curl_easy_setopt(w->handle, CURLOPT_HTTPHEADER, w->headers);
+
+    char etag[WATCH_VALIDATOR_LEN];
+    char last_modified[WATCH_VALIDATOR_LEN];
+    strcpy(etag, w->etag);
+    strcpy(last_modified, w->last_modified);
+    w->etag[0] = '\0';
+    w->last_modified[0] = '\0';
+    w->body.i = 0;
+    CURLcode err = curl_easy_perform(w->handle);
+    long http_status = 0;
+    curl_easy_getinfo(w->handle, CURLINFO_RESPONSE_CODE, &http_status);
+    w->failed = err != CURLE_OK || (http_status != 200 && http_status != 304);
+
+    if(err != CURLE_OK || http_status != 200) {
+        // Keep the old validators, the new ones (if any) belong to a 304 or an error
+        strcpy(w->etag, etag);
+        strcpy(w->last_modified, last_modified);
+        if(err != CURLE_OK)
+            fprintf(stderr, "curl_easy_perform@watch_poll: %s\n", curl_easy_strerror(err));
+        else if(http_status != 304)
+            fprintf(stderr, "curl_easy_perform@watch_poll: Failed to retrieve the latest comic! HTTP status code: %li\n", http_status);
+        else if(w->debug)
+            fprintf(stderr, "@watch_poll: Not modified\n");
+        return 0;
+    }
+
+    int parsed_ok = w->body.i > 0 && w->body.ptr[0] == '{';
+    if(parsed_ok && !(parsed_ok = parse_json(&w->body, parsed, w->debug)))
+        free_json(parsed);
+    if(!parsed_ok) {
+        w->failed = 1;
+        fprintf(stderr, "parse_json@watch_poll: Failed to parse JSON!\n");
+        return 0;
+    }
+    unsigned long num = strtoul(parsed->num.ptr != NULL ? parsed->num.ptr : "0", NULL, 10);
+    if(num == 0 || num == w->last_num || w->last_num == 0) {
+        if(w->debug)
+            fprintf(stderr, "@watch_poll: Latest comic is %lu\n", num);
+        if(w->last_num == 0)
+            w->last_num = num;
+        free_json(parsed);
+        return 0;
+    }
+
+    w->last_num = num;
+    w->last_new_day = time(NULL) / 86400;
+    return 1;
+}
+
+// Polls, sleeping between polls, until a new comic appears, then fills parsed
+void watch_next(struct watch* w, struct json_parsed* parsed) {
+    char first = w->last_num == 0;
+    while(1) {
+        if(!first) {
+            unsigned int wait = watch_interval(w);
+            if(w->debug)
+                fprintf(stderr, "@watch_next: Polling again in %us\n", wait);
+            sleep(wait);
+        }
+        first = 0;
+        if(watch_poll(w, parsed))
+            return;
+    }
+}
+
+#endif
@@ -30,16 +30,59 @@ size_t write_callback_curl(char* buf, size_t size, size_t nmemb, struct mem_bloc
     }
 }
 
-int parse_json(struct mem_block* raw, struct json_parsed* parsed, int debug) {
-    size_t buf_n = 0; // Current pos in buffer
-    size_t buf_len = 32; // Current buffer length (starts with 32 bytes, doubles when needed)
-    char* buffer = malloc(buf_len); // Dynamic buffer for storing current thing to parse
+// Transfers give up when connecting takes longer than WEB_CONNECT_TIMEOUT seconds, or when they
+// stall (under WEB_STALL_SPEED bytes per second for WEB_STALL_TIME seconds), instead of hanging
+// forever on a dead connection. Both fail with CURLE_OPERATION_TIMEDOUT, which callers retry
+#define WEB_CONNECT_TIMEOUT 15
+#define WEB_STALL_SPEED 1
+#define WEB_STALL_TIME 30
 
-    if(buffer == NULL) {
-        fprintf(stderr, "malloc@parse_json: Out of memory!\n");
-        return 0;
-    }
+void set_transfer_timeouts(CURL* handle) {
+    curl_easy_setopt(handle, CURLOPT_CONNECTTIMEOUT, (long)WEB_CONNECT_TIMEOUT);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_LIMIT, (long)WEB_STALL_SPEED);
+    curl_easy_setopt(handle, CURLOPT_LOW_SPEED_TIME, (long)WEB_STALL_TIME);
+}
 
+// Max length of an info.0.json link, including null terminator
+#define COMIC_JSON_URL_LEN 64
+
+// Writes the info.0.json link of a comic to url, which must have room for COMIC_JSON_URL_LEN chars
+void comic_json_url(char* url, unsigned long comic) {
+    if(comic == 0)
+        strcpy(url, "https://xkcd.com/info.0.json"); // Make sure link is https, not http, since it results in a 301
+    else
+        sprintf(url, "https://xkcd.com/%lu/info.0.json", comic);
+}
+
+// Field of parsed which stores key's value, NULL if it's an unknown key
+struct mem_block* json_field(struct json_parsed* parsed, const char* key) {
+    if(strcmp(key, "month") == 0)
+        return &parsed->month;
+    else if(strcmp(key, "num") == 0)
+        return &parsed->num;
+    else if(strcmp(key, "link") == 0)
+        return &parsed->link;
+    else if(strcmp(key, "year") == 0)
+        return &parsed->year;
+    else if(strcmp(key, "news") == 0)
+        return &parsed->news;
+    else if(strcmp(key, "safe_title") == 0)
+        return &parsed->safe_title;
+    else if(strcmp(key, "transcript") == 0)
+        return &parsed->transcript;
+    else if(strcmp(key, "alt") == 0)
+        return &parsed->alt;
+    else if(strcmp(key, "img") == 0)
+        return &parsed->img;
+    else if(strcmp(key, "title") == 0)
+        return &parsed->title;
+    else if(strcmp(key, "day") == 0)
+        return &parsed->day;
+    return NULL;
+}
+
+// Sets every field to empty
+void json_parsed_init(struct json_parsed* parsed) {
     parsed->month      = empty_mem;
     parsed->num        = empty_mem;
     parsed->link       = empty_mem;
@@ -51,108 +94,156 @@ int parse_json(struct mem_block* raw, struct json_parsed* parsed, int debug) {
     parsed->img        = empty_mem;
     parsed->title      = empty_mem;
     parsed->day        = empty_mem;
-    struct mem_block cur_key = empty_mem;
+}
 
+// Push-style JSON parser: data can be fed in pieces as it arrives, and on_value is called as soon as
+// each value is complete
+struct json_parser {
+    struct json_parsed* parsed;
+    int debug;
+    char started;             // The opening { was skipped
     // Booleans:
     // 0: Inside quote
     // 1: Escape next char
     // 2: Key/value mode (0 = key, 1 = value)
-    char modes = 0;
-    for(size_t n = 1; n < raw->i; ++n) { // Start after { so it ignores the first table indicator.
-        if(get_bit(modes, 0)) { // Inside quote
-            if(get_bit(modes, 1)) { // Next char escaped
-                if(raw->ptr[n] == 'n')
-                    buffer[buf_n++] = '\n';
-                else if(raw->ptr[n] == 'b')
-                    buffer[buf_n++] = '\b';
-                else if(raw->ptr[n] == 'f')
-                    buffer[buf_n++] = '\f';
-                else if(raw->ptr[n] == 'r')
-                    buffer[buf_n++] = '\r';
-                else if(raw->ptr[n] == 't')
-                    buffer[buf_n++] = '\t';
+    char modes;
+    char* buffer;             // Dynamic buffer for storing current thing to parse
+    size_t buf_n;             // Current pos in buffer
+    size_t buf_len;           // Current buffer length (starts with 32 bytes, doubles when needed)
+    struct mem_block cur_key;
+    void (*on_value)(struct json_parser* parser, const char* key, struct mem_block* value);
+    void* user;
+};
+
+int json_parser_init(struct json_parser* parser, struct json_parsed* parsed, int debug) {
+    parser->parsed = parsed;
+    parser->debug = debug;
+    parser->started = 0;
+    parser->modes = 0;
+    parser->buf_n = 0;
+    parser->buf_len = 32;
+    parser->buffer = malloc(parser->buf_len);
+    parser->cur_key = empty_mem;
+    parser->on_value = NULL;
+    parser->user = NULL;
+    json_parsed_init(parsed);
+
+    if(parser->buffer == NULL) {
+        fprintf(stderr, "malloc@json_parser_init: Out of memory!\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Frees the parser's own memory (not the parsed strings)
+void json_parser_free(struct json_parser* parser) {
+    free(parser->cur_key.ptr);
+    free(parser->buffer);
+    parser->cur_key = empty_mem;
+    parser->buffer = NULL;
+}
+
+// Parses the next len bytes. Returns 0 on failure, after which the parser must only be freed
+int json_parser_feed(struct json_parser* parser, const char* data, size_t len) {
+    struct json_parsed* parsed = parser->parsed;
+    char* buffer = parser->buffer;
+    size_t n = 0;
+    if(!parser->started && len > 0) { // Start after { so it ignores the first table indicator.
+        parser->started = 1;
+        n = 1;
+    }
+    for(; n < len; ++n) {
+        if(get_bit(parser->modes, 0)) { // Inside quote
+            if(get_bit(parser->modes, 1)) { // Next char escaped
+                if(data[n] == 'n')
+                    buffer[parser->buf_n++] = '\n';
+                else if(data[n] == 'b')
+                    buffer[parser->buf_n++] = '\b';
+                else if(data[n] == 'f')
+                    buffer[parser->buf_n++] = '\f';
+                else if(data[n] == 'r')
+                    buffer[parser->buf_n++] = '\r';
+                else if(data[n] == 't')
+                    buffer[parser->buf_n++] = '\t';
                 else
-                    buffer[buf_n++] = raw->ptr[n];
-                set_bit(&modes, 1, 0);
+                    buffer[parser->buf_n++] = data[n];
+                set_bit(&parser->modes, 1, 0);
             }
             else { // Next char not escaped
-                if(raw->ptr[n] == '"')
-                    set_bit(&modes, 0, 0);
-                else if(raw->ptr[n] == '\\')
-                    set_bit(&modes, 1, 1);
+                if(data[n] == '"')
+                    set_bit(&parser->modes, 0, 0);
+                else if(data[n] == '\\')
+                    set_bit(&parser->modes, 1, 1);
                 else
-                    buffer[buf_n++] = raw->ptr[n];
+                    buffer[parser->buf_n++] = data[n];
             }
         }
         else { // Outside quote
-            if(raw->ptr[n] == '"')
-                set_bit(&modes, 0, 1);
-            else if(raw->ptr[n] == ':') {
-                set_bit(&modes, 2, 1);
-                buffer[buf_n++] = '\0';
-                if(!set_string(&cur_key, buffer, buf_n)) {
-                    free(buffer);
+            if(data[n] == '"')
+                set_bit(&parser->modes, 0, 1);
+            else if(data[n] == ':') {
+                set_bit(&parser->modes, 2, 1);
+                buffer[parser->buf_n++] = '\0';
+                if(!set_string(&parser->cur_key, buffer, parser->buf_n))
                     return 0;
-                }
-                buf_n = 0;
+                parser->buf_n = 0;
             }
-            else if(raw->ptr[n] == ',' || raw->ptr[n] == '}') {
-                set_bit(&modes, 2, 0);
-                buffer[buf_n++] = '\0';
-
-                struct mem_block* cur_mem_ptr = NULL;
-                if(strcmp(cur_key.ptr, "month") == 0)
-                    cur_mem_ptr = &parsed->month;
-                else if(strcmp(cur_key.ptr, "num") == 0)
-                    cur_mem_ptr = &parsed->num;
-                else if(strcmp(cur_key.ptr, "link") == 0)
-                    cur_mem_ptr = &parsed->link;
-                else if(strcmp(cur_key.ptr, "year") == 0)
-                    cur_mem_ptr = &parsed->year;
-                else if(strcmp(cur_key.ptr, "news") == 0)
-                    cur_mem_ptr = &parsed->news;
-                else if(strcmp(cur_key.ptr, "safe_title") == 0)
-                    cur_mem_ptr = &parsed->safe_title;
-                else if(strcmp(cur_key.ptr, "transcript") == 0)
-                    cur_mem_ptr = &parsed->transcript;
-                else if(strcmp(cur_key.ptr, "alt") == 0)
-                    cur_mem_ptr = &parsed->alt;
-                else if(strcmp(cur_key.ptr, "img") == 0)
-                    cur_mem_ptr = &parsed->img;
-                else if(strcmp(cur_key.ptr, "title") == 0)
-                    cur_mem_ptr = &parsed->title;
-                else if(strcmp(cur_key.ptr, "day") == 0)
-                    cur_mem_ptr = &parsed->day;
+            else if(data[n] == ',' || data[n] == '}') {
+                set_bit(&parser->modes, 2, 0);
+                buffer[parser->buf_n++] = '\0';
+
+                const char* key = (parser->cur_key.ptr != NULL) ? parser->cur_key.ptr : "";
+                struct mem_block* cur_mem_ptr = json_field(parsed, key);
                 if(cur_mem_ptr != NULL) {
-                    if(!set_string(cur_mem_ptr, buffer, buf_n)) {
-                        free(cur_key.ptr);
-                        free(buffer);
+                    if(!set_string(cur_mem_ptr, buffer, parser->buf_n))
                         return 0;
-                    }
+                    if(parser->on_value != NULL)
+                        parser->on_value(parser, key, cur_mem_ptr);
                 }
-                else if(debug)
+                else if(parser->debug)
                     fprintf(stderr, "@parse_json: Unknown json key (%s)! Ignoring\n", buffer);
-                buf_n = 0;
+                parser->buf_n = 0;
             }
-            else if(raw->ptr[n] >= '0' && raw->ptr[n] <= '9')
-                buffer[buf_n++] = raw->ptr[n];
-            else if(raw->ptr[n] != ' ' && debug)
-                fprintf(stderr, "@parse_json: Unknown char (%c)! Ignoring\n", raw->ptr[n]);
+            else if(data[n] >= '0' && data[n] <= '9')
+                buffer[parser->buf_n++] = data[n];
+            else if(data[n] != ' ' && parser->debug)
+                fprintf(stderr, "@parse_json: Unknown char (%c)! Ignoring\n", data[n]);
         }
 
-        if(buf_n == (buf_len - 1)) { // Expand buffer by x2 if it reaches limit length
-            buf_len *= 2;
-            buffer = realloc(buffer, buf_len);
+        if(parser->buf_n == (parser->buf_len - 1)) { // Expand buffer by x2 if it reaches limit length
+            parser->buf_len *= 2;
+            buffer = realloc(buffer, parser->buf_len);
             if(buffer == NULL) {
                 fprintf(stderr, "realloc@parse_json: Out of memory!\n");
-                free(cur_key.ptr);
                 return 0;
             }
+            parser->buffer = buffer;
         }
     }
-    free(cur_key.ptr);
-    free(buffer);
     return 1;
 }
 
+int parse_json(struct mem_block* raw, struct json_parsed* parsed, int debug) {
+    struct json_parser parser;
+    if(!json_parser_init(&parser, parsed, debug))
+        return 0;
+    int ok = json_parser_feed(&parser, raw->ptr, raw->i);
+    json_parser_free(&parser);
+    return ok;
+}
+
+void free_json(struct json_parsed* parsed) {
+    free(parsed->month.ptr);
+    free(parsed->num.ptr);
+    free(parsed->link.ptr);
+    free(parsed->year.ptr);
+    free(parsed->news.ptr);
+    free(parsed->safe_title.ptr);
+    free(parsed->transcript.ptr);
+    free(parsed->alt.ptr);
+    free(parsed->img.ptr);
+    free(parsed->title.ptr);
+    free(parsed->day.ptr);
+}
+
 #endif